@@ -149,6 +149,25 @@ static const int op_format_ok[NUM_OPS] = {
     0x040  /* .ORIG: I format only         */
 };
 
+/* whether each opcode assembles to an instruction (in the line table) */
+static const int op_is_code[NUM_OPS] = {
+    0, /* no opcode */
+
+    /* real instructions */
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+
+    /* trap pseudo-ops */
+    1, 1, 1, 1, 1, 1,
+
+    /* non-trap pseudo-ops */
+    0, /* .FILL    */
+    1, /* RET      */
+    0, /* .STRINGZ */
+
+    /* directives */
+    0, 0, 0
+};
+
 typedef enum pre_parse_t pre_parse_t;
 enum pre_parse_t {
     NO_PP =  0,
@@ -183,6 +202,10 @@ static inst_t inst;
 static FILE *symout;
 static FILE *objout;
 
+/* address and source line of each instruction, for the line table */
+static int line_addr[65536], line_src[65536];
+static int num_lines;
+
 static void new_inst_line(void);
 static void bad_operands(void);
 static void unterminated_string(void);
@@ -315,6 +338,8 @@ int main(int argc, char **argv) {
     int len;
     char *ext;
     char *fname;
+    char *src_name;
+    int i;
 
     if (argc != 2) {
         fprintf(stderr, "usage: %s <ASM filename>\n", argv[0]);
@@ -340,6 +365,17 @@ int main(int argc, char **argv) {
         fprintf(stderr, "Could not open %s for reading.\n", fname);
         return 2;
     }
+    /* The line table names the source relative to the .sym beside it,
+       so the output does not depend on where it was built.  (fname's
+       extension changes below, so keep a copy.) */
+    if ((src_name = strrchr(fname, '/')) == NULL)
+        src_name = fname;
+    else
+        src_name++;
+    if ((src_name = strdup(src_name)) == NULL) {
+        perror("malloc");
+        return 3;
+    }
 
     /* Open output files. */
     strcpy(ext, ".obj");
@@ -409,6 +445,15 @@ int main(int argc, char **argv) {
         return 1;
 
     fprintf(symout, "\n");
+
+    /* Older readers stop at the blank line above. */
+    fprintf(symout, "// Line table\n");
+    fprintf(symout, "// Source file: %s\n", src_name);
+    fprintf(symout, "//\tAddress  Line\n");
+    fprintf(symout, "//\t-------  ----\n");
+    for (i = 0; i < num_lines; i++)
+        fprintf(symout, "//\t%04X     %d\n", line_addr[i], line_src[i]);
+    fprintf(symout, "\n");
     fclose(symout);
     fclose(objout);
 
@@ -576,6 +621,11 @@ static void generate_instruction(operands_t operands, const char *opstr) {
         saw_orig = 2;
         return;
     }
+    /* Note where each instruction came from (not data) for the line table. */
+    if (pass == 2 && num_lines < 65536 && op_is_code[inst.op]) {
+        line_addr[num_lines] = code_loc;
+        line_src[num_lines++] = line_num;
+    }
     if ((pre_parse[operands] & PP_R1) != 0)
         r1 = o1[1] - '0';
     if ((pre_parse[operands] & PP_R2) != 0)
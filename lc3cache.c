@@ -0,0 +1,212 @@
+/* tab:8
+ *
+ * lc3cache.c - on-disk cache of complete LC-3 runs
+ *
+ * Copyright (c) 2026 by LandonTheCoder.
+ *
+ * Permission to use, copy, modify, and distribute this software and its
+ * documentation for any purpose, without fee, and without written
+ * agreement is hereby granted, provided that the above copyright notice
+ * and the following two paragraphs appear in all copies of this software,
+ * that the files COPYING and NO_WARRANTY are included verbatim with
+ * any distribution, and that the contents of the file README are included
+ * verbatim as part of a file named README with any distribution.
+ *
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE TO ANY PARTY FOR DIRECT,
+ * INDIRECT, SPECIAL, INCIDENTAL, OR CONSEQUENTIAL DAMAGES ARISING OUT
+ * OF THE USE OF THIS SOFTWARE AND ITS DOCUMENTATION, EVEN IF THE AUTHOR
+ * HAS BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * THE AUTHOR SPECIFICALLY DISCLAIMS ANY WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE.  THE SOFTWARE PROVIDED HEREUNDER IS ON AN "AS IS"
+ * BASIS, AND THE AUTHOR NO OBLIGATION TO PROVIDE MAINTENANCE, SUPPORT,
+ * UPDATES, ENHANCEMENTS, OR MODIFICATIONS."
+ *
+ * Filename:	    lc3cache.c
+ *
+ * A run is fully determined by the memory image it starts from, its start
+ * PC, its console input, and the limits it runs under, so its result can
+ * be stored under a hash of those.  Each entry is one file, named by the
+ * 128-bit key and spread over 256 subdirectories.  Entries are written to
+ * a temporary file and renamed into place, so processes sharing a cache
+ * directory only ever see complete entries; two processes storing the
+ * same key write the same bytes, and the last rename wins.
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "lc3sim.h"
+
+/* Change the version whenever the key or entry layout changes. */
+#define CACHE_MAGIC   "LC3RUN"
+#define CACHE_VERSION 1
+
+/* Room for "<dir>/xx/<32 hex digits>.tmp.<pid>". */
+#define CACHE_PATH_EXTRA 64
+
+static char *cache_dir = NULL;
+
+// Enables the cache in dir, creating it if needed
+int cache_open(const char *dir) {
+    if (mkdir(dir, 0777) == -1 && errno != EEXIST) {
+        perror(dir);
+        return -1;
+    }
+    free(cache_dir);
+    if ((cache_dir = strdup(dir)) == NULL)
+        return -1;
+    return 0;
+}
+
+static void put_u64(unsigned char *p, unsigned long long v) {
+    for (int i = 0; i < 8; i++)
+        p[i] = (v >> (8 * i)) & 0xFF;
+}
+
+static unsigned long long get_u64(const unsigned char *p) {
+    unsigned long long v = 0;
+
+    for (int i = 7; i >= 0; i--)
+        v = (v << 8) | p[i];
+    return v;
+}
+
+/*
+ * Computes the key of a run.  The image is all of memory, so the OS, the
+ * program, and anything else loaded are covered.  Only limits that give
+ * deterministic results belong in the key; runs stopped by wall-clock
+ * time are never stored.  Returns false if there is no key, in which
+ * case the run must be neither looked up nor stored.
+ */
+bool cache_key(const int *image, int start_pc, unsigned long long max_insns,
+               const unsigned char *input, size_t input_len,
+               cache_key_t *key) {
+    size_t len = 2 * 65536 + 16 + input_len;
+    unsigned char *buf;
+
+    if ((buf = malloc(len)) == NULL)
+        return false;
+    for (int addr = 0; addr < 65536; addr++) {
+        buf[2 * addr] = image[addr] & 0xFF;
+        buf[2 * addr + 1] = (image[addr] >> 8) & 0xFF;
+    }
+    put_u64(buf + 2 * 65536, start_pc);
+    put_u64(buf + 2 * 65536 + 8, max_insns);
+    memcpy(buf + 2 * 65536 + 16, input, input_len);
+    /* Two seeds give a 128-bit key. */
+    key->hi = xxh64_bytes(buf, len, CACHE_VERSION);
+    key->lo = xxh64_bytes(buf, len, ~(unsigned long long)CACHE_VERSION);
+    free(buf);
+    return true;
+}
+
+static char * entry_path(const cache_key_t *key, bool make_dir) {
+    char *path = malloc(strlen(cache_dir) + CACHE_PATH_EXTRA);
+
+    if (path == NULL)
+        return NULL;
+    sprintf(path, "%s/%02llx", cache_dir, key->hi >> 56);
+    if (make_dir && mkdir(path, 0777) == -1 && errno != EEXIST) {
+        free(path);
+        return NULL;
+    }
+    sprintf(path + strlen(path), "/%016llx%016llx", key->hi, key->lo);
+    return path;
+}
+
+/* magic, version, key, state, stop PC, instructions, digests, length */
+#define ENTRY_HEADER_LEN (8 + 8 + 16 + 8 + 8 + 8 + 16 + 8)
+
+/*
+ * Looks up a run.  On a hit, fills in rec (with a newly allocated copy
+ * of the output) and returns true.  Damaged entries, including those
+ * whose state is not below num_states, are misses.
+ */
+bool cache_lookup(const cache_key_t *key, int num_states,
+                  cache_record_t *rec) {
+    unsigned char head[ENTRY_HEADER_LEN];
+    unsigned char magic[8] = CACHE_MAGIC;
+    char *path;
+    FILE *f;
+    bool hit = false;
+
+    if (cache_dir == NULL || (path = entry_path(key, false)) == NULL)
+        return false;
+    f = fopen(path, "rb");
+    free(path);
+    if (f == NULL)
+        return false;
+    if (fread(head, sizeof(head), 1, f) != 1 ||
+        memcmp(head, magic, 8) != 0 ||
+        get_u64(head + 8) != CACHE_VERSION ||
+        get_u64(head + 16) != key->hi || get_u64(head + 24) != key->lo ||
+        get_u64(head + 32) >= (unsigned long long)num_states ||
+        get_u64(head + 40) > 0xFFFF)
+        goto done;
+    rec->state = get_u64(head + 32);
+    rec->stop_pc = get_u64(head + 40);
+    rec->insns = get_u64(head + 48);
+    rec->reg_digest = get_u64(head + 56);
+    rec->mem_digest = get_u64(head + 64);
+    rec->out_len = get_u64(head + 72);
+    if (rec->out_len > SIZE_MAX / 2 ||
+        (rec->out = malloc(rec->out_len + 1)) == NULL)
+        goto done;
+    /* The entry must end exactly after the output. */
+    if (fread(rec->out, 1, rec->out_len + 1, f) != rec->out_len) {
+        free(rec->out);
+        rec->out = NULL;
+        goto done;
+    }
+    hit = true;
+done:
+    fclose(f);
+    return hit;
+}
+
+// Stores a run; failures only mean the next lookup misses
+void cache_store(const cache_key_t *key, const cache_record_t *rec) {
+    unsigned char head[ENTRY_HEADER_LEN];
+    char *path, *tmp;
+    FILE *f;
+    bool ok;
+
+    if (cache_dir == NULL || (path = entry_path(key, true)) == NULL)
+        return;
+    if ((tmp = malloc(strlen(path) + 32)) == NULL) {
+        free(path);
+        return;
+    }
+    sprintf(tmp, "%s.tmp.%ld", path, (long)getpid());
+
+    memset(head, 0, sizeof(head));
+    memcpy(head, CACHE_MAGIC, strlen(CACHE_MAGIC));
+    put_u64(head + 8, CACHE_VERSION);
+    put_u64(head + 16, key->hi);
+    put_u64(head + 24, key->lo);
+    put_u64(head + 32, rec->state);
+    put_u64(head + 40, rec->stop_pc);
+    put_u64(head + 48, rec->insns);
+    put_u64(head + 56, rec->reg_digest);
+    put_u64(head + 64, rec->mem_digest);
+    put_u64(head + 72, rec->out_len);
+
+    if ((f = fopen(tmp, "wb")) != NULL) {
+        ok = (fwrite(head, sizeof(head), 1, f) == 1 &&
+              fwrite(rec->out, 1, rec->out_len, f) == rec->out_len);
+        ok = (fclose(f) == 0 && ok);
+        if (!ok || rename(tmp, path) == -1)
+            unlink(tmp);
+    }
+    free(tmp);
+    free(path);
+}
@@ -0,0 +1,321 @@
+/* tab:8
+ *
+ * lc3dis.c - disassembly and symbol files for lc3sim and lc3trace
+ *
+ * Copyright (c) 2026 by LandonTheCoder.
+ *
+ * Permission to use, copy, modify, and distribute this software and its
+ * documentation for any purpose, without fee, and without written
+ * agreement is hereby granted, provided that the above copyright notice
+ * and the following two paragraphs appear in all copies of this software,
+ * that the files COPYING and NO_WARRANTY are included verbatim with
+ * any distribution, and that the contents of the file README are included
+ * verbatim as part of a file named README with any distribution.
+ *
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE TO ANY PARTY FOR DIRECT,
+ * INDIRECT, SPECIAL, INCIDENTAL, OR CONSEQUENTIAL DAMAGES ARISING OUT
+ * OF THE USE OF THIS SOFTWARE AND ITS DOCUMENTATION, EVEN IF THE AUTHOR
+ * HAS BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * THE AUTHOR SPECIFICALLY DISCLAIMS ANY WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE.  THE SOFTWARE PROVIDED HEREUNDER IS ON AN "AS IS"
+ * BASIS, AND THE AUTHOR NO OBLIGATION TO PROVIDE MAINTENANCE, SUPPORT,
+ * UPDATES, ENHANCEMENTS, OR MODIFICATIONS."
+ *
+ * Filename:	    lc3dis.c
+ *
+ * The disassembler and the .sym file reader, linked into both lc3sim and
+ * lc3trace so that a trace prints instructions exactly as the simulator
+ * lists them.  Instructions are decoded through a table built from
+ * lc3.def on first use; labels come from symbol.c.
+ */
+
+#include <ctype.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "lc3sim.h"
+#include "symbol.h"
+
+/* each instruction word's lc3.def entry, the entries, and the symbol
+   table generation (bumped whenever a label is added or removed) */
+static unsigned char dis_index[65536];
+static struct {const char *mnemonic; format_t fmt;} dis_insts[256];
+static int dis_num_insts = 0;
+unsigned int dis_sym_gen = 1;
+/* source line of each instruction, from line tables in .sym files */
+unsigned char lc3_src_file[65536];
+int lc3_src_line[65536];
+char *src_names[MAX_SOURCE_FILES + 1];
+int num_src_names = 0;
+
+
+// Disassembly
+
+
+// Fills in dis_index with the first lc3.def entry matching each word
+static void build_dis_table(void) {
+    int i;
+
+#define DEF_INST(name,format,mask,match,flags,code) \
+    dis_insts[dis_num_insts].mnemonic = #name;          \
+    dis_insts[dis_num_insts++].fmt = (format);
+#define DEF_P_OP(name,format,mask,match) \
+    DEF_INST(name,format,mask,match,FLG_NONE,{})
+#include "lc3.def"
+#undef DEF_P_OP
+#undef DEF_INST
+    dis_insts[dis_num_insts].mnemonic = "???";
+    dis_insts[dis_num_insts].fmt = FMT_;
+
+    for (int inst = 0; inst < 65536; inst++) {
+        i = 0;
+#define DEF_INST(name,format,mask,match,flags,code) \
+        if ((inst & (mask)) == (match))             \
+            goto found;                             \
+        i++;
+#define DEF_P_OP(name,format,mask,match) \
+        DEF_INST(name,format,mask,match,FLG_NONE,{})
+#include "lc3.def"
+#undef DEF_P_OP
+#undef DEF_INST
+found:
+        dis_index[inst] = i;
+    }
+}
+
+static char * put_str(char *p, const char *s) {
+    while (*s != '\0')
+        *p++ = *s++;
+    return p;
+}
+
+static char * put_hex(char *p, int value, int digits) {
+    static const char hex[] = "0123456789ABCDEF";
+
+    *p++ = 'x';
+    while (digits-- > 0)
+        *p++ = hex[(value >> (4 * digits)) & 15];
+    return p;
+}
+
+static char * put_dec(char *p, int value) {
+    char digits[8];
+    int n = 0;
+
+    *p++ = '#';
+    if (value < 0) {
+        *p++ = '-';
+        value = -value;
+    }
+    do {
+        digits[n++] = '0' + value % 10;
+    } while ((value /= 10) > 0);
+    while (n > 0)
+        *p++ = digits[--n];
+    return p;
+}
+
+// An address's label, or the address in hex
+static char * put_target(char *p, int tgt) {
+    if (lc3_sym_names[tgt] != NULL)
+        return put_str(p, lc3_sym_names[tgt]->name);
+    return put_hex(p, tgt, 4);
+}
+
+// Used in disassembly
+static char * put_operands(char *p, int addr, int inst, format_t fmt) {
+    const char *sep = "";
+    int c;
+
+    if (fmt & FMT_R1) {
+        p = put_str(p, sep);
+        *p++ = 'R';
+        *p++ = '0' + F_DR(inst);
+        sep = ",";
+    }
+    if (fmt & FMT_R2) {
+        p = put_str(p, sep);
+        *p++ = 'R';
+        *p++ = '0' + F_SR1(inst);
+        sep = ",";
+    }
+    if (fmt & FMT_R3) {
+        p = put_str(p, sep);
+        *p++ = 'R';
+        *p++ = '0' + F_SR2(inst);
+        sep = ",";
+    }
+    if (fmt & FMT_IMM5) {
+        p = put_dec(put_str(p, sep), F_imm5(inst));
+        sep = ",";
+    }
+    if (fmt & FMT_IMM6) {
+        p = put_dec(put_str(p, sep), F_imm6(inst));
+        sep = ",";
+    }
+    if (fmt & FMT_VEC8) {
+        p = put_hex(put_str(p, sep), F_vec8(inst), 2);
+        sep = ",";
+    }
+    if (fmt & FMT_ASC8) {
+        p = put_str(p, sep);
+        sep = ",";
+        switch (c = F_vec8(inst)) {
+            case  7: p = put_str(p, "'\\a'"); break;
+            case  8: p = put_str(p, "'\\b'"); break;
+            case  9: p = put_str(p, "'\\t'"); break;
+            case 10: p = put_str(p, "'\\n'"); break;
+            case 11: p = put_str(p, "'\\v'"); break;
+            case 12: p = put_str(p, "'\\f'"); break;
+            case 13: p = put_str(p, "'\\r'"); break;
+            case 27: p = put_str(p, "'\\e'"); break;
+            case 34: p = put_str(p, "'\\\"'"); break;
+            case 44: p = put_str(p, "'\\''"); break;
+            case 92: p = put_str(p, "'\\\\'"); break;
+            default:
+                if (isprint(c)) {
+                    *p++ = '\'';
+                    *p++ = c;
+                    *p++ = '\'';
+                } else
+                    p = put_hex(p, c, 2);
+                break;
+        }
+    }
+    if (fmt & FMT_IMM9) {
+        p = put_target(put_str(p, sep), (addr + 1 + F_imm9(inst)) & 0xFFFF);
+        sep = ",";
+    }
+    if (fmt & FMT_IMM11) {
+        p = put_target(put_str(p, sep), (addr + 1 + F_imm11(inst)) & 0xFFFF);
+        sep = ",";
+    }
+    if (fmt & FMT_IMM16)
+        p = put_target(put_str(p, sep), inst);
+    return p;
+}
+
+// Renders the opcode and operands of inst at addr, returning their length
+int dis_inst(char *buf, int addr, int inst) {
+    static const char* const dis_cc[8] = {
+        "", "P", "Z", "ZP", "N", "NP", "NZ", "NZP"
+    };
+    char *p = buf;
+    int i;
+
+    if (dis_num_insts == 0)
+        build_dis_table();
+
+    /* the opcode, padded to OPCODE_WIDTH */
+    i = dis_index[inst];
+    p = put_str(p, dis_insts[i].mnemonic);
+    if (dis_insts[i].fmt & FMT_CC)
+        p = put_str(p, dis_cc[F_CC(inst) >> 9]);
+    while (p - buf < OPCODE_WIDTH)
+        *p++ = ' ';
+    p = put_operands(p, addr, inst, dis_insts[i].fmt);
+    return p - buf;
+}
+
+/*
+ * Renders the listing line for inst at addr, after the breakpoint mark,
+ * into buf (of at least DIS_LINE_LEN bytes), returning its length.
+ */
+int dis_line(char *buf, int addr, int inst) {
+    char *p = buf;
+    int len;
+
+    /* the label (at most 16 characters, right-aligned) */
+    *p++ = ' ';
+    len = (lc3_sym_names[addr] != NULL ?
+           strnlen(lc3_sym_names[addr]->name, 16) : 0);
+    memset(p, ' ', 16 - len);
+    p += 16 - len;
+    if (len > 0) {
+        memcpy(p, lc3_sym_names[addr]->name, len);
+        p += len;
+    }
+    *p++ = ' ';
+    p = put_hex(p, addr, 4);
+    *p++ = ' ';
+    p = put_hex(p, inst, 4);
+    *p++ = ' ';
+    p += dis_inst(p, addr, inst);
+    return p - buf;
+}
+
+
+// Symbol files
+
+
+/*
+ * Finds (or adds) a line table source file, returning 0 if there are too
+ * many.  lc3as names the source relative to the .sym file, so the name is
+ * joined to the directory the .sym file was read from.
+ */
+static int source_file_index(const char *name, const char *sym_file) {
+    char path[PATH_MAX];
+    const char *slash;
+    int i, dir_len = 0;
+
+    if (sym_file != NULL && name[0] != '/' &&
+        (slash = strrchr(sym_file, '/')) != NULL)
+        dir_len = slash - sym_file + 1;
+    snprintf(path, sizeof(path), "%.*s%.*s", dir_len, sym_file,
+             (int)strcspn(name, "\r\n"), name);
+
+    for (i = 1; i <= num_src_names; i++)
+        if (strcmp(src_names[i], path) == 0)
+            return i;
+    if (num_src_names == MAX_SOURCE_FILES ||
+        (src_names[i] = strdup(path)) == NULL)
+        return 0;
+    return ++num_src_names;
+}
+
+// Handles one line of a .sym file
+void read_sym_line(const char *buf, sym_reader_t *rd) {
+    char sym[81];
+    int addr, line;
+
+    switch (rd->part) {
+        case SYM_HEADER:
+            if (sscanf(buf, "%*s%*s%80s", sym) == 1 &&
+                strcmp(sym, "------------") == 0)
+                rd->part = SYM_SYMBOLS;
+            break;
+        case SYM_SYMBOLS:
+            if (sscanf(buf, "%*s%80s%x", sym, &addr) == 2) {
+                add_symbol(sym, addr, 1);
+                dis_sym_gen++;
+            } else
+                rd->part = SYM_LINES;
+            break;
+        case SYM_LINES:
+            if (strncmp(buf, "// Source file: ", 16) == 0)
+                rd->file = source_file_index(buf + 16, rd->sym_file);
+            else if (rd->file != 0 &&
+                     sscanf(buf, "//%x%d", &addr, &line) == 2 &&
+                     addr >= 0 && addr <= 0xFFFF) {
+                lc3_src_file[addr] = rd->file;
+                lc3_src_line[addr] = line;
+            }
+            break;
+    }
+}
+
+int read_sym_file(const char *filename) {
+    sym_reader_t rd = {SYM_HEADER, 0, filename};
+    FILE *f;
+    char buf[PATH_MAX + 20];
+
+    if ((f = fopen(filename, "r")) == NULL)
+        return -1;
+    while (fgets(buf, sizeof(buf), f) != NULL)
+        read_sym_line(buf, &rd);
+    fclose(f);
+    return 0;
+}
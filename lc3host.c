@@ -0,0 +1,651 @@
+/* tab:8
+ *
+ * lc3host.c - hosts many interactive LC-3 sessions in one process
+ *
+ * Copyright (c) 2026 by LandonTheCoder.
+ *
+ * Permission to use, copy, modify, and distribute this software and its
+ * documentation for any purpose, without fee, and without written
+ * agreement is hereby granted, provided that the above copyright notice
+ * and the following two paragraphs appear in all copies of this software,
+ * that the files COPYING and NO_WARRANTY are included verbatim with
+ * any distribution, and that the contents of the file README are included
+ * verbatim as part of a file named README with any distribution.
+ *
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE TO ANY PARTY FOR DIRECT,
+ * INDIRECT, SPECIAL, INCIDENTAL, OR CONSEQUENTIAL DAMAGES ARISING OUT
+ * OF THE USE OF THIS SOFTWARE AND ITS DOCUMENTATION, EVEN IF THE AUTHOR
+ * HAS BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * THE AUTHOR SPECIFICALLY DISCLAIMS ANY WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE.  THE SOFTWARE PROVIDED HEREUNDER IS ON AN "AS IS"
+ * BASIS, AND THE AUTHOR NO OBLIGATION TO PROVIDE MAINTENANCE, SUPPORT,
+ * UPDATES, ENHANCEMENTS, OR MODIFICATIONS."
+ *
+ * Filename:	    lc3host.c
+ *
+ * Every connection to the host's Unix socket gets its own LC-3, started
+ * from a copy of a machine that has already booted and loaded the
+ * program.  The connection is that machine's console.
+ *
+ * Sessions are cooperative tasks.  A task runs until its instruction
+ * slice expires, or until it polls KBSR with no input buffered (or DSR
+ * with too much output unsent).  The machine state is the whole
+ * continuation, so yielding is just returning; the task's next slice
+ * re-executes the polling loop.  Waiting tasks cost nothing until epoll
+ * (or poll, where epoll is missing) reports their socket ready.
+ *
+ * Each worker thread has its own event set and run queue and accepts
+ * connections from the shared listening socket; tasks stay on the
+ * thread that accepted them.
+ *
+ * The device registers are modelled here rather than by lc3sim.c's
+ * read_memory and write_memory, which work on the one global machine
+ * and block (or sleep) waiting for console input.  Tasks need a
+ * machine each, on any thread, and must yield instead of waiting, so
+ * task_read and task_write keep only what a console needs: no
+ * statistics, probes, watchpoints, expected output, recording or
+ * replay, and no random device delays.  Console behaviour must match
+ * the simulator's; tests/host-output.py checks that it does.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#ifdef LC3SIM_EPOLL
+#include <sys/epoll.h>
+#else
+#include <sys/poll.h>
+#endif
+
+#include "lc3sim.h"
+
+#define HOST_SLICE      100000  /* instructions per turn                */
+#define HOST_MAX_INPUT (1 << 20) /* unread input allowed per session    */
+#define HOST_MAX_OUTPUT 65536   /* unsent output before DSR reads busy */
+#define HOST_MSG_ROOM   64      /* output space kept for stop messages */
+#define HOST_MAX_EVENTS 64
+
+typedef enum task_state_t task_state_t;
+enum task_state_t {
+    TASK_RUNNABLE,
+    TASK_WAIT_INPUT,   /* polled KBSR with nothing buffered     */
+    TASK_WAIT_OUTPUT,  /* polled DSR with the output buffer full */
+    TASK_DONE          /* stopped; closes once output is sent    */
+};
+
+typedef struct host_task_t host_task_t;
+struct host_task_t {
+    uint16_t reg[NUM_REGS];
+    uint16_t mem[65536];
+    bool kbsr_ready, dsr_ready;
+    task_state_t state;
+    int fd;
+    /* input read from the socket but not yet seen by the LC-3 */
+    unsigned char *in;
+    size_t in_pos, in_len, in_cap;
+    bool in_eof;
+    /* output written by the LC-3 but not yet sent */
+    unsigned char *out;
+    size_t out_len, out_cap;
+    bool want_out;
+    /* run queue link */
+    host_task_t *next;
+    bool queued;
+};
+
+typedef struct host_worker_t host_worker_t;
+struct host_worker_t {
+    pthread_t thread;
+    int listen_fd;
+    host_task_t *run_head, *run_tail;
+#ifdef LC3SIM_EPOLL
+    int ep;
+#else
+    /* watched descriptors; a NULL task marks the listening socket */
+    struct pollfd *fds;
+    host_task_t **tasks;
+    int num_fds, max_fds;
+#endif
+};
+
+/* The booted machine that every session starts from. */
+static host_task_t *host_template;
+
+
+// LC-3 machine access for one task
+
+
+static void task_finish(host_task_t *t, const char *msg) {
+    size_t len;
+
+    if (msg != NULL && t->out_cap - t->out_len >= (len = strlen(msg))) {
+        memcpy(t->out + t->out_len, msg, len);
+        t->out_len += len;
+    }
+    t->state = TASK_DONE;
+}
+
+static int task_read(host_task_t *t, int addr) {
+    switch (addr) {
+        case 0xFE00: /* KBSR */
+            if (!t->kbsr_ready) {
+                if (t->in_pos < t->in_len || t->in_eof)
+                    t->kbsr_ready = true;
+                else
+                    /* Nothing to read: give up the rest of the slice. */
+                    t->state = TASK_WAIT_INPUT;
+            }
+            return (t->kbsr_ready ? 0x8000 : 0x0000);
+        case 0xFE02: /* KBDR */
+            if (t->kbsr_ready) {
+                if (t->in_pos == t->in_len) {
+                    task_finish(t, "\nLC-3 read past end of input stream.\n");
+                    return 0;
+                }
+                t->mem[0xFE02] = t->in[t->in_pos++];
+            }
+            t->kbsr_ready = false;
+            return t->mem[0xFE02];
+        case 0xFE04: /* DSR */
+            if (!t->dsr_ready) {
+                if (t->out_cap - t->out_len > HOST_MSG_ROOM)
+                    t->dsr_ready = true;
+                else
+                    t->state = TASK_WAIT_OUTPUT;
+            }
+            return (t->dsr_ready ? 0x8000 : 0x0000);
+        case 0xFE06: /* DDR */
+            return 0x0000;
+        case 0xFFFE: return 0x8000;   /* MCR */
+    }
+    return t->mem[addr];
+}
+
+static void task_write(host_task_t *t, int addr, int value) {
+    switch (addr) {
+        case 0xFE00: /* KBSR */
+        case 0xFE02: /* KBDR */
+        case 0xFE04: /* DSR */
+            return;
+        case 0xFE06: /* DDR */
+            if (!t->dsr_ready)
+                return;
+            /* DSR only reads ready while there is room left. */
+            if (t->out_cap - t->out_len <= HOST_MSG_ROOM) {
+                task_finish(t, "\nLC-3 output overflowed.\n");
+                return;
+            }
+            t->out[t->out_len++] = value;
+            t->dsr_ready = false;
+            return;
+        case 0xFFFE: /* MCR */
+            if ((value & 0x8000) == 0)
+                task_finish(t, NULL);
+            return;
+    }
+    t->mem[addr] = value;
+}
+
+// Execute one instruction; returns false if it was illegal
+static bool task_step(host_task_t *t) {
+#define REG(i) t->reg[(i)]
+#define read_memory(addr) task_read(t, (addr))
+#define write_memory(addr,value) task_write(t, (addr), (value))
+
+    REG(R_IR) = read_memory(REG(R_PC));
+    REG(R_PC) = (REG(R_PC) + 1) & 0xFFFF;
+
+#define ADD_FLAGS(value)
+#define DEF_INST(name,format,mask,match,flags,code) \
+    if ((REG(R_IR) & (mask)) == (match)) {         \
+        code;                                       \
+        return true;                                \
+    }
+#define DEF_P_OP(name,format,mask,match)
+#include "lc3.def"
+#undef DEF_P_OP
+#undef DEF_INST
+#undef ADD_FLAGS
+
+    REG(R_PC) = (REG(R_PC) - 1) & 0xFFFF;
+    return false;
+
+#undef write_memory
+#undef read_memory
+#undef REG
+}
+
+// Run a task until it yields, stops, or uses up its slice
+static void task_run_slice(host_task_t *t) {
+    char msg[40];
+
+    for (int left = HOST_SLICE; left > 0 && t->state == TASK_RUNNABLE; left--)
+        if (!task_step(t)) {
+            snprintf(msg, sizeof(msg), "\nIllegal instruction at x%04X!\n",
+                     t->reg[R_PC]);
+            task_finish(t, msg);
+        }
+}
+
+
+// Event handling
+
+
+#ifdef LC3SIM_EPOLL
+
+static int ev_init(host_worker_t *w) {
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = NULL};
+
+    if ((w->ep = epoll_create1(0)) == -1)
+        return -1;
+#ifdef EPOLLEXCLUSIVE
+    /* only wake one worker per new connection */
+    ev.events |= EPOLLEXCLUSIVE;
+#endif
+    return epoll_ctl(w->ep, EPOLL_CTL_ADD, w->listen_fd, &ev);
+}
+
+static int ev_watch(host_worker_t *w, host_task_t *t, bool add) {
+    struct epoll_event ev = {.events = EPOLLIN | EPOLLRDHUP,
+                             .data.ptr = t};
+
+    if (t->in_eof)
+        ev.events = 0;
+    if (t->want_out)
+        ev.events |= EPOLLOUT;
+    return epoll_ctl(w->ep, add ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, t->fd, &ev);
+}
+
+static void ev_forget(host_worker_t *w, host_task_t *t) {
+    (void)epoll_ctl(w->ep, EPOLL_CTL_DEL, t->fd, NULL);
+}
+
+/* Wait for events; fills tasks[] and ready[] (bit 0 = readable, bit 1 =
+   writable, bit 2 = hung up). */
+static int ev_wait(host_worker_t *w, host_task_t **tasks, int *ready,
+                   int timeout) {
+    struct epoll_event evs[HOST_MAX_EVENTS];
+    int n;
+
+    if ((n = epoll_wait(w->ep, evs, HOST_MAX_EVENTS, timeout)) < 0)
+        return (errno == EINTR ? 0 : -1);
+    for (int i = 0; i < n; i++) {
+        tasks[i] = evs[i].data.ptr;
+        ready[i] = ((evs[i].events & EPOLLIN) ? 1 : 0) |
+                   ((evs[i].events & EPOLLOUT) ? 2 : 0) |
+                   ((evs[i].events & (EPOLLHUP | EPOLLERR)) ? 4 : 0);
+    }
+    return n;
+}
+
+#else /* poll() fallback */
+
+static int ev_find(host_worker_t *w, int fd) {
+    for (int i = 0; i < w->num_fds; i++)
+        if (w->fds[i].fd == fd)
+            return i;
+    return -1;
+}
+
+static int ev_add_fd(host_worker_t *w, int fd, host_task_t *t) {
+    if (w->num_fds == w->max_fds) {
+        w->max_fds = (w->max_fds == 0 ? 64 : w->max_fds * 2);
+        w->fds = realloc(w->fds, w->max_fds * sizeof(w->fds[0]));
+        w->tasks = realloc(w->tasks, w->max_fds * sizeof(w->tasks[0]));
+        if (w->fds == NULL || w->tasks == NULL)
+            return -1;
+    }
+    w->fds[w->num_fds].fd = fd;
+    w->fds[w->num_fds].events = POLLIN;
+    w->tasks[w->num_fds++] = t;
+    return 0;
+}
+
+static int ev_init(host_worker_t *w) {
+    return ev_add_fd(w, w->listen_fd, NULL);
+}
+
+static int ev_watch(host_worker_t *w, host_task_t *t, bool add) {
+    int i;
+
+    if (add && ev_add_fd(w, t->fd, t) == -1)
+        return -1;
+    if ((i = ev_find(w, t->fd)) == -1)
+        return -1;
+    w->fds[i].events = (t->in_eof ? 0 : POLLIN) | (t->want_out ? POLLOUT : 0);
+    return 0;
+}
+
+static void ev_forget(host_worker_t *w, host_task_t *t) {
+    int i;
+
+    if ((i = ev_find(w, t->fd)) == -1)
+        return;
+    w->fds[i] = w->fds[--w->num_fds];
+    w->tasks[i] = w->tasks[w->num_fds];
+}
+
+static int ev_wait(host_worker_t *w, host_task_t **tasks, int *ready,
+                   int timeout) {
+    int n = 0;
+
+    if (poll(w->fds, w->num_fds, timeout) < 0)
+        return (errno == EINTR ? 0 : -1);
+    for (int i = 0; i < w->num_fds && n < HOST_MAX_EVENTS; i++) {
+        short re = w->fds[i].revents;
+
+        if (re == 0)
+            continue;
+        tasks[n] = w->tasks[i];
+        ready[n++] = ((re & POLLIN) ? 1 : 0) | ((re & POLLOUT) ? 2 : 0) |
+                     ((re & (POLLHUP | POLLERR | POLLNVAL)) ? 4 : 0);
+    }
+    return n;
+}
+
+#endif /* LC3SIM_EPOLL */
+
+
+// Scheduling
+
+
+static void enqueue(host_worker_t *w, host_task_t *t) {
+    if (t->queued)
+        return;
+    t->queued = true;
+    t->next = NULL;
+    if (w->run_tail != NULL)
+        w->run_tail->next = t;
+    else
+        w->run_head = t;
+    w->run_tail = t;
+}
+
+// Close a session; a queued task is freed when the run queue reaches it
+static void task_free(host_worker_t *w, host_task_t *t) {
+    if (t->fd != -1) {
+        ev_forget(w, t);
+        close(t->fd);
+        t->fd = -1;
+    }
+    if (t->queued) {
+        t->state = TASK_DONE;
+        return;
+    }
+    free(t->in);
+    free(t->out);
+    free(t);
+}
+
+// Send buffered output; returns false if the connection failed
+static bool task_flush(host_task_t *t) {
+    size_t done = 0;
+    ssize_t sent;
+    bool ok = true;
+
+    while (done < t->out_len) {
+        sent = write(t->fd, t->out + done, t->out_len - done);
+        if (sent < 0) {
+            if (errno == EINTR)
+                continue;
+            ok = (errno == EAGAIN || errno == EWOULDBLOCK);
+            break;
+        }
+        done += sent;
+    }
+    /* Move what is left to the front, so the LC-3 can keep writing. */
+    memmove(t->out, t->out + done, t->out_len - done);
+    t->out_len -= done;
+    return ok;
+}
+
+// Flush output and update the task's wait state; false if it is gone
+static bool task_settle(host_worker_t *w, host_task_t *t) {
+    bool want_out;
+
+    if (!task_flush(t)) {
+        task_free(w, t);
+        return false;
+    }
+    want_out = (t->out_len > 0);
+    if (t->state == TASK_DONE && !want_out) {
+        task_free(w, t);
+        return false;
+    }
+    if (t->state == TASK_WAIT_OUTPUT &&
+        t->out_cap - t->out_len > HOST_MSG_ROOM)
+        t->state = TASK_RUNNABLE;
+    if (want_out != t->want_out) {
+        t->want_out = want_out;
+        (void)ev_watch(w, t, false);
+    }
+    return true;
+}
+
+// Pull whatever input is waiting on the socket
+static bool task_fill(host_worker_t *w, host_task_t *t) {
+    ssize_t got;
+
+    if (t->in_pos == t->in_len)
+        t->in_pos = t->in_len = 0;
+    if (t->in_len == t->in_cap) {
+        if (t->in_pos > 0) {
+            memmove(t->in, t->in + t->in_pos, t->in_len - t->in_pos);
+            t->in_len -= t->in_pos;
+            t->in_pos = 0;
+        } else if (t->in_cap < HOST_MAX_INPUT) {
+            unsigned char *bigger = realloc(t->in, t->in_cap * 2);
+
+            if (bigger == NULL)
+                return false;
+            t->in = bigger;
+            t->in_cap *= 2;
+        } else
+            /* Not reading any of it; let the connection drop. */
+            return false;
+    }
+    got = read(t->fd, t->in + t->in_len, t->in_cap - t->in_len);
+    if (got == 0) {
+        t->in_eof = true;
+        (void)ev_watch(w, t, false);
+    } else if (got > 0)
+        t->in_len += got;
+    else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+        return false;
+    if (t->state == TASK_WAIT_INPUT)
+        t->state = TASK_RUNNABLE;
+    return true;
+}
+
+// Accept waiting connections and start a session for each
+static void accept_sessions(host_worker_t *w) {
+    host_task_t *t;
+    int fd;
+
+    while ((fd = accept(w->listen_fd, NULL, NULL)) != -1) {
+        if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) == -1 ||
+            (t = malloc(sizeof(*t))) == NULL) {
+            close(fd);
+            continue;
+        }
+        memcpy(t, host_template, sizeof(*t));
+        t->fd = fd;
+        t->in_cap = 4096;
+        t->out_cap = HOST_MAX_OUTPUT + HOST_MSG_ROOM;
+        t->in = malloc(t->in_cap);
+        t->out = malloc(t->out_cap);
+        if (t->in == NULL || t->out == NULL || ev_watch(w, t, true) == -1) {
+            close(fd);
+            free(t->in);
+            free(t->out);
+            free(t);
+            continue;
+        }
+        enqueue(w, t);
+    }
+}
+
+static void *host_worker(void *arg) {
+    host_worker_t *w = arg;
+    host_task_t *tasks[HOST_MAX_EVENTS], *t, *rest;
+    int ready[HOST_MAX_EVENTS];
+    int n;
+
+    for (;;) {
+        n = ev_wait(w, tasks, ready, (w->run_head != NULL ? 0 : -1));
+        if (n < 0) {
+            perror("lc3sim host");
+            exit(3);
+        }
+        for (int i = 0; i < n; i++) {
+            if ((t = tasks[i]) == NULL) {
+                accept_sessions(w);
+                continue;
+            }
+            if ((ready[i] & 1) && !task_fill(w, t)) {
+                task_free(w, t);
+                continue;
+            }
+            if ((ready[i] & 4) && !(ready[i] & 1)) {
+                /* Peer is gone; no point finishing the program. */
+                task_free(w, t);
+                continue;
+            }
+            if (task_settle(w, t) && t->state == TASK_RUNNABLE)
+                enqueue(w, t);
+        }
+
+        /* Give every runnable task one slice. */
+        rest = w->run_head;
+        w->run_head = w->run_tail = NULL;
+        while ((t = rest) != NULL) {
+            rest = t->next;
+            t->queued = false;
+            if (t->fd == -1) {
+                task_free(w, t);
+                continue;
+            }
+            task_run_slice(t);
+            if (task_settle(w, t) && t->state == TASK_RUNNABLE)
+                enqueue(w, t);
+        }
+    }
+    return NULL;
+}
+
+
+// Host setup
+
+
+// Boot the template machine, discarding the OS's welcome message
+static host_task_t * boot_template(const int *image, int boot_pc,
+                                   int start_pc) {
+    host_task_t *t;
+    unsigned char boot_out[4096];
+
+    if ((t = calloc(1, sizeof(*t))) == NULL)
+        return NULL;
+    for (int addr = 0; addr < 65536; addr++)
+        t->mem[addr] = image[addr];
+    t->reg[R_PSR] = (2 << 9); /* set to condition ZERO */
+    t->reg[R_PC] = boot_pc;
+    t->in_eof = true;
+    t->out = boot_out;
+    t->out_cap = sizeof(boot_out);
+    do {
+        /* Boot output is dropped, so a full buffer never blocks it. */
+        t->out_len = 0;
+        t->state = TASK_RUNNABLE;
+        task_run_slice(t);
+    } while (t->state == TASK_RUNNABLE || t->state == TASK_WAIT_OUTPUT);
+    t->out = NULL;
+    t->out_cap = t->out_len = 0;
+    t->in_eof = false;
+    t->state = TASK_RUNNABLE;
+    t->reg[R_PC] = start_pc;
+    return t;
+}
+
+// Listen on a Unix socket (also used by lc3sim --serve)
+int open_unix_listener(const char *path) {
+    struct sockaddr_un addr;
+    struct stat st;
+    int fd;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        printf("Socket path \"%s\" is too long.\n", path);
+        return -1;
+    }
+    /* Replace a stale socket, but never some other kind of file. */
+    if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+        (void)unlink(path);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1 ||
+        bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+        listen(fd, SOMAXCONN) == -1) {
+        printf("Cannot listen on \"%s\": %s\n", path, strerror(errno));
+        if (fd != -1)
+            close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/*
+ * Serve sessions of the program in image (already holding the OS) on a
+ * Unix socket, using num_threads worker threads.  Only returns on error.
+ */
+int run_lc3_host(const char *socket_path,
+                 const int *image,
+                 int boot_pc,
+                 int start_pc,
+                 int num_threads) {
+    host_worker_t *workers;
+    int listen_fd;
+
+    if ((host_template = boot_template(image, boot_pc, start_pc)) == NULL ||
+        (workers = calloc(num_threads, sizeof(*workers))) == NULL) {
+        puts("Out of memory for LC-3 host.");
+        return 3;
+    }
+    if ((listen_fd = open_unix_listener(socket_path)) == -1)
+        return 1;
+    if (fcntl(listen_fd, F_SETFL, fcntl(listen_fd, F_GETFL) | O_NONBLOCK) ==
+        -1) {
+        perror("fcntl");
+        return 1;
+    }
+    /* A session hanging up must not kill the host. */
+    signal(SIGPIPE, SIG_IGN);
+
+    printf("Serving LC-3 sessions on \"%s\".\n", socket_path);
+    fflush(stdout);
+
+    for (int i = 0; i < num_threads; i++) {
+        workers[i].listen_fd = listen_fd;
+        if (ev_init(&workers[i]) == -1 ||
+            (i > 0 && pthread_create(&workers[i].thread, NULL, host_worker,
+                                     &workers[i]) != 0)) {
+            printf("Cannot start LC-3 host worker: %s\n", strerror(errno));
+            return 3;
+        }
+    }
+    host_worker(&workers[0]);
+    return 0;
+}
@@ -0,0 +1,146 @@
+/* tab:8
+ *
+ * lc3json.c - JSON Lines output for lc3sim
+ *
+ * Copyright (c) 2026 by LandonTheCoder.
+ *
+ * Permission to use, copy, modify, and distribute this software and its
+ * documentation for any purpose, without fee, and without written
+ * agreement is hereby granted, provided that the above copyright notice
+ * and the following two paragraphs appear in all copies of this software,
+ * that the files COPYING and NO_WARRANTY are included verbatim with
+ * any distribution, and that the contents of the file README are included
+ * verbatim as part of a file named README with any distribution.
+ *
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE TO ANY PARTY FOR DIRECT,
+ * INDIRECT, SPECIAL, INCIDENTAL, OR CONSEQUENTIAL DAMAGES ARISING OUT
+ * OF THE USE OF THIS SOFTWARE AND ITS DOCUMENTATION, EVEN IF THE AUTHOR
+ * HAS BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * THE AUTHOR SPECIFICALLY DISCLAIMS ANY WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE.  THE SOFTWARE PROVIDED HEREUNDER IS ON AN "AS IS"
+ * BASIS, AND THE AUTHOR NO OBLIGATION TO PROVIDE MAINTENANCE, SUPPORT,
+ * UPDATES, ENHANCEMENTS, OR MODIFICATIONS."
+ *
+ * Filename:	    lc3json.c
+ *
+ * With --output=jsonl, everything the simulator reports is written as one
+ * JSON object per line.  All records go through the one buffer here,
+ * which is written to standard output when it fills or when the caller
+ * is about to wait for input, so a long script costs a few large writes
+ * rather than a stdio call per field.  Strings are escaped so that any
+ * byte the LC-3 writes survives: control characters and bytes from x7F
+ * up become \u00XX escapes, i.e. the code point with the byte's value.
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "lc3sim.h"
+
+#define JSON_BUF_SIZE 65536
+
+static char json_buf[JSON_BUF_SIZE];
+static size_t json_len = 0;
+
+// Writes out everything buffered so far
+void json_flush(void) {
+    size_t done = 0;
+    ssize_t n;
+
+    /* Anything written through stdio (usage, warnings) goes first. */
+    fflush(stdout);
+    while (done < json_len) {
+        if ((n = write(STDOUT_FILENO, json_buf + done, json_len - done))
+            == -1) {
+            if (errno == EINTR)
+                continue;
+            /* The reader is gone; drop the records. */
+            break;
+        }
+        done += n;
+    }
+    json_len = 0;
+}
+
+static inline void put_char(char c) {
+    if (json_len == JSON_BUF_SIZE)
+        json_flush();
+    json_buf[json_len++] = c;
+}
+
+static void put_raw(const char *s) {
+    while (*s != '\0')
+        put_char(*s++);
+}
+
+static void put_string(const unsigned char *s, size_t len) {
+    static const char hex[] = "0123456789abcdef";
+
+    put_char('"');
+    for (size_t i = 0; i < len; i++) {
+        switch (s[i]) {
+            case '"':  put_raw("\\\""); break;
+            case '\\': put_raw("\\\\"); break;
+            case '\n': put_raw("\\n"); break;
+            case '\r': put_raw("\\r"); break;
+            case '\t': put_raw("\\t"); break;
+            default:
+                if (s[i] < 0x20 || s[i] >= 0x7F) {
+                    put_raw("\\u00");
+                    put_char(hex[s[i] >> 4]);
+                    put_char(hex[s[i] & 15]);
+                } else
+                    put_char(s[i]);
+        }
+    }
+    put_char('"');
+}
+
+static void put_key(const char *key) {
+    put_char(',');
+    put_string((const unsigned char *)key, strlen(key));
+    put_char(':');
+}
+
+// Starts a record of the given type
+void json_begin(const char *type) {
+    put_raw("{\"type\":");
+    put_string((const unsigned char *)type, strlen(type));
+}
+
+// Adds a string field
+void json_string(const char *key, const char *value) {
+    put_key(key);
+    put_string((const unsigned char *)value, strlen(value));
+}
+
+// Adds a string field holding arbitrary bytes
+void json_bytes(const char *key, const void *value, size_t len) {
+    put_key(key);
+    put_string(value, len);
+}
+
+// Adds a number field
+void json_number(const char *key, unsigned long long value) {
+    char digits[24];
+
+    put_key(key);
+    snprintf(digits, sizeof(digits), "%llu", value);
+    put_raw(digits);
+}
+
+// Adds a true/false field
+void json_bool(const char *key, bool value) {
+    put_key(key);
+    put_raw(value ? "true" : "false");
+}
+
+// Ends the current record
+void json_end(void) {
+    put_raw("}\n");
+}
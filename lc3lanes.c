@@ -0,0 +1,746 @@
+/* tab:8
+ *
+ * lc3lanes.c - lockstep multi-lane batch engine for the LC-3 simulator
+ *
+ * Copyright (c) 2026 by LandonTheCoder.
+ *
+ * Permission to use, copy, modify, and distribute this software and its
+ * documentation for any purpose, without fee, and without written
+ * agreement is hereby granted, provided that the above copyright notice
+ * and the following two paragraphs appear in all copies of this software,
+ * that the files COPYING and NO_WARRANTY are included verbatim with
+ * any distribution, and that the contents of the file README are included
+ * verbatim as part of a file named README with any distribution.
+ *
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE TO ANY PARTY FOR DIRECT,
+ * INDIRECT, SPECIAL, INCIDENTAL, OR CONSEQUENTIAL DAMAGES ARISING OUT
+ * OF THE USE OF THIS SOFTWARE AND ITS DOCUMENTATION, EVEN IF THE AUTHOR
+ * HAS BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * THE AUTHOR SPECIFICALLY DISCLAIMS ANY WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE.  THE SOFTWARE PROVIDED HEREUNDER IS ON AN "AS IS"
+ * BASIS, AND THE AUTHOR NO OBLIGATION TO PROVIDE MAINTENANCE, SUPPORT,
+ * UPDATES, ENHANCEMENTS, OR MODIFICATIONS."
+ *
+ * Filename:	    lc3lanes.c
+ *
+ * This runs one program against many inputs at once.  Each input gets
+ * its own machine (a "lane"), and the lanes are stored structure-of-arrays
+ * so that one memory word or register holds the values for every lane in
+ * a single vector.  Lanes whose PC and instruction agree execute together
+ * under a mask; lanes that diverge simply sit out until the scheduler
+ * picks their PC.  The vector types are GCC/Clang generic vectors, so the
+ * compiler emits AVX2 or SSE code where available and plain scalar code
+ * everywhere else.
+ *
+ * Only the simple, data-parallel instructions are vectorized.  Anything
+ * touching per-lane addresses (LDR, STR, LDI, STI) or device registers is
+ * run lane-by-lane using the code in lc3.def, which stays the reference
+ * for the instruction semantics.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "lc3sim.h"
+
+/* Number of machines executed side by side. */
+#define LANES 16
+
+/* Steps in each scheduling slice once the lanes have diverged. */
+#define LANES_SLICE 1024
+
+typedef uint16_t lane_vec_t __attribute__((vector_size(LANES * sizeof(uint16_t))));
+typedef int16_t lane_svec_t __attribute__((vector_size(LANES * sizeof(int16_t))));
+
+/* Build an AVX2 copy of the interpreter loop where the toolchain can pick
+   one at load time. */
+#if defined(__GNUC__) && !defined(__clang__) && defined(__x86_64__) && \
+    defined(__linux__)
+#define LANES_TARGETS __attribute__((target_clones("avx2", "default")))
+#else
+#define LANES_TARGETS
+#endif
+
+/*
+ * Decoded instruction kinds.  Names are pasted together from the name and
+ * format in lc3.def, so a new DEF_INST there fails to compile until it is
+ * added here.
+ */
+typedef enum lane_op_t lane_op_t;
+enum lane_op_t {
+    LOP_ILLEGAL = 0,
+    LOP_ADD_FMT_RRR, LOP_ADD_FMT_RRI,
+    LOP_AND_FMT_RRR, LOP_AND_FMT_RRI,
+    LOP_BR_FMT_CL,
+    LOP_JMP_FMT_R,
+    LOP_JSR_FMT_L,
+    LOP_JSRR_FMT_R,
+    LOP_LD_FMT_RL, LOP_LDI_FMT_RL, LOP_LDR_FMT_RRI6,
+    LOP_LEA_FMT_RL,
+    LOP_NOT_FMT_RR,
+    LOP_ST_FMT_RL, LOP_STI_FMT_RL, LOP_STR_FMT_RRI6,
+    LOP_TRAP_FMT_V
+};
+
+/* Why a lane stopped running (stored in the run cache, so only append). */
+typedef enum lane_state_t lane_state_t;
+enum lane_state_t {
+    LANE_RUNNING,
+    LANE_HALTED,
+    LANE_ILLEGAL,
+    LANE_INPUT_END,
+    LANE_NO_INPUT,
+    LANE_BUDGET,
+    LANE_TIMEOUT,
+    NUM_LANE_STATES
+};
+
+static const char * const lane_state_names[] = {
+    "running", "halted", "illegal instruction", "read past end of input",
+    "input not readable", "out of instruction budget", "out of time"
+};
+
+/* The same states in JSON records, named like lc3sim's stop reasons. */
+static const char * const lane_reasons[] = {
+    "running", "halted", "illegal", "eof", "unreadable", "budget", "timeout"
+};
+
+/* Per-lane console and bookkeeping; only touched on the scalar paths. */
+typedef struct lane_io_t lane_io_t;
+struct lane_io_t {
+    const char *name;
+    unsigned char *in;
+    size_t in_len, in_pos;
+    unsigned char *out;
+    size_t out_len, out_cap;
+    bool kbsr_ready, dsr_ready;
+    lane_state_t state;
+    int stop_pc;
+    unsigned long long insns;
+};
+
+typedef struct lanes_t lanes_t;
+struct lanes_t {
+    lane_vec_t reg[NUM_REGS];
+    /* all ones for lanes that are still running */
+    lane_vec_t active;
+    /* low 16 bits of instruction counts, folded into io[].insns */
+    lane_vec_t count;
+    unsigned int count_steps;
+    /* steps before the counts are folded and the run limits checked */
+    unsigned int fold_at;
+    unsigned long long max_insns;
+    int timeout_ms;
+    struct timespec start;
+    lane_vec_t *mem;
+    lane_io_t io[LANES];
+    /* drop LC-3 output (used while the OS boots) */
+    bool discard_output;
+    /* diverged scheduling: lane given the current slice (-1 for lowest
+       PC first), the last lane given one, and steps into the slice */
+    int favour, last_favoured;
+    unsigned int slice_steps;
+};
+
+static unsigned char lane_decode[65536];
+static bool lane_decode_ready = false;
+
+
+// Decoding
+
+
+// Find the lc3.def entry for one instruction word
+static lane_op_t decode_one(int inst) {
+#define DEF_INST(name,format,mask,match,flags,code) \
+    if ((inst & (mask)) == (match))                 \
+        return LOP_##name##_##format;
+#define DEF_P_OP(name,format,mask,match)
+#include "lc3.def"
+#undef DEF_P_OP
+#undef DEF_INST
+
+    return LOP_ILLEGAL;
+}
+
+static void build_decode_table(void) {
+    if (lane_decode_ready)
+        return;
+    for (int inst = 0; inst < 65536; inst++)
+        lane_decode[inst] = decode_one(inst);
+    lane_decode_ready = true;
+}
+
+
+// Per-lane (scalar) machine access
+
+
+static void lane_stop(lanes_t *L, int lane, lane_state_t why) {
+    L->io[lane].state = why;
+    L->io[lane].stop_pc = L->reg[R_PC][lane];
+    L->active[lane] = 0;
+}
+
+static void lane_putc(lane_io_t *io, int value) {
+    if (io->out_len == io->out_cap) {
+        io->out_cap = (io->out_cap == 0 ? 256 : io->out_cap * 2);
+        io->out = realloc(io->out, io->out_cap);
+        if (io->out == NULL) {
+            puts("Out of memory for LC-3 output.");
+            exit(3);
+        }
+    }
+    io->out[io->out_len++] = value;
+}
+
+/* Mirrors read_memory() with the device always ready, as it is when
+   the console is a file. */
+static int lane_read(lanes_t *L, int lane, int addr) {
+    lane_io_t *io = &L->io[lane];
+
+    switch (addr) {
+        case 0xFE00: /* KBSR */
+            io->kbsr_ready = true;
+            return 0x8000;
+        case 0xFE02: /* KBDR */
+            if (io->kbsr_ready) {
+                if (io->in_pos == io->in_len) {
+                    lane_stop(L, lane, LANE_INPUT_END);
+                    return 0;
+                }
+                L->mem[0xFE02][lane] = io->in[io->in_pos++];
+            }
+            io->kbsr_ready = false;
+            return L->mem[0xFE02][lane];
+        case 0xFE04: /* DSR */
+            io->dsr_ready = true;
+            return 0x8000;
+        case 0xFE06: /* DDR */
+            return 0x0000;
+        case 0xFFFE: return 0x8000;   /* MCR */
+    }
+    return L->mem[addr][lane];
+}
+
+/* Mirrors write_memory(). */
+static void lane_write(lanes_t *L, int lane, int addr, int value) {
+    lane_io_t *io = &L->io[lane];
+
+    switch (addr) {
+        case 0xFE00: /* KBSR */
+        case 0xFE02: /* KBDR */
+        case 0xFE04: /* DSR */
+            return;
+        case 0xFE06: /* DDR */
+            if (!io->dsr_ready)
+                return;
+            if (!L->discard_output)
+                lane_putc(io, value);
+            io->dsr_ready = false;
+            return;
+        case 0xFFFE: /* MCR */
+            if ((value & 0x8000) == 0)
+                lane_stop(L, lane, LANE_HALTED);
+            return;
+    }
+    L->mem[addr][lane] = value;
+}
+
+// Addresses that read_memory()/write_memory() treat specially
+static inline bool is_device_addr(int addr) {
+    return addr >= 0xFE00 &&
+           (addr == 0xFE00 || addr == 0xFE02 || addr == 0xFE04 ||
+            addr == 0xFE06 || addr == 0xFFFE);
+}
+
+/* Execute the already-fetched instruction in one lane, straight from
+   lc3.def.  The PC has already been incremented. */
+static void lane_exec_scalar(lanes_t *L, int lane) {
+#define REG(i) L->reg[(i)][lane]
+#define read_memory(addr) lane_read(L, lane, (addr))
+#define write_memory(addr,value) lane_write(L, lane, (addr), (value))
+#define ADD_FLAGS(value)
+#define DEF_INST(name,format,mask,match,flags,code) \
+    if ((REG(R_IR) & (mask)) == (match)) {         \
+        code;                                       \
+        return;                                     \
+    }
+#define DEF_P_OP(name,format,mask,match)
+#include "lc3.def"
+#undef DEF_P_OP
+#undef DEF_INST
+#undef ADD_FLAGS
+#undef write_memory
+#undef read_memory
+#undef REG
+
+    L->reg[R_PC][lane] = (L->reg[R_PC][lane] - 1) & 0xFFFF;
+    lane_stop(L, lane, LANE_ILLEGAL);
+}
+
+
+// Vector helpers
+
+
+/* Vectors are passed by pointer or through macros so that no function
+   call depends on the AVX calling convention. */
+
+/* same value in every lane */
+#define SPLAT(value) ((lane_vec_t){0} + (uint16_t)(value))
+/* new where the mask is set, old elsewhere */
+#define BLEND(old,new,m) (((new) & (m)) | ((old) & ~(m)))
+
+static inline bool all_ones(const lane_vec_t *v) {
+    uint64_t w[sizeof(*v) / sizeof(uint64_t)];
+    uint64_t acc = ~(uint64_t)0;
+
+    memcpy(w, v, sizeof(*v));
+    for (size_t i = 0; i < sizeof(w) / sizeof(w[0]); i++)
+        acc &= w[i];
+    return acc == ~(uint64_t)0;
+}
+
+static inline bool any_set(const lane_vec_t *v) {
+    uint64_t w[sizeof(*v) / sizeof(uint64_t)];
+    uint64_t acc = 0;
+
+    memcpy(w, v, sizeof(*v));
+    for (size_t i = 0; i < sizeof(w) / sizeof(w[0]); i++)
+        acc |= w[i];
+    return acc != 0;
+}
+
+// Vector equivalent of SET_CC() in lc3.def
+static inline void set_cc(lanes_t *L, const lane_vec_t *value,
+                          const lane_vec_t *m) {
+    lane_vec_t neg = (lane_vec_t)((lane_svec_t)*value < 0);
+    lane_vec_t zero = (lane_vec_t)(*value == 0);
+    lane_vec_t cc = (neg & 0x0800) | (zero & 0x0400) | (~(neg | zero) & 0x0200);
+
+    L->reg[R_PSR] = BLEND(L->reg[R_PSR], (L->reg[R_PSR] & 0xF1FF) | cc, *m);
+}
+
+static void fold_counts(lanes_t *L) {
+    for (int lane = 0; lane < LANES; lane++)
+        L->io[lane].insns += L->count[lane];
+    L->count = SPLAT(0);
+    L->count_steps = 0;
+}
+
+// Fold the counts, then stop lanes that are out of budget or time
+static void check_limits(lanes_t *L) {
+    unsigned long long left, fewest = 0xFFFF;
+    struct timespec now;
+    long ms;
+
+    fold_counts(L);
+    for (int lane = 0; lane < LANES; lane++) {
+        if (L->active[lane] == 0 || L->max_insns == 0)
+            continue;
+        if (L->io[lane].insns >= L->max_insns) {
+            lane_stop(L, lane, LANE_BUDGET);
+            continue;
+        }
+        left = L->max_insns - L->io[lane].insns;
+        if (left < fewest)
+            fewest = left;
+    }
+    /* A lane gains at most one instruction per step, so no lane can
+       overshoot its budget before the next check. */
+    L->fold_at = fewest;
+
+    if (L->timeout_ms > 0) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        ms = (now.tv_sec - L->start.tv_sec) * 1000 +
+             (now.tv_nsec - L->start.tv_nsec) / 1000000;
+        if (ms >= L->timeout_ms)
+            for (int lane = 0; lane < LANES; lane++)
+                if (L->active[lane] != 0)
+                    lane_stop(L, lane, LANE_TIMEOUT);
+    }
+}
+
+// Choose among diverged lanes (see pick_pc); out of line, as it is rare
+__attribute__((noinline))
+static int pick_diverged_pc(lanes_t *L, int lead) {
+    int pc = L->reg[R_PC][lead];
+
+    if (++L->slice_steps == LANES_SLICE) {
+        L->slice_steps = 0;
+        if (L->favour != -1)
+            L->favour = -1;
+        else {
+            do
+                L->last_favoured = (L->last_favoured + 1) % LANES;
+            while (L->active[L->last_favoured] == 0);
+            L->favour = L->last_favoured;
+        }
+    }
+    if (L->favour != -1 && L->active[L->favour] != 0)
+        return L->reg[R_PC][L->favour];
+    for (int lane = lead + 1; lane < LANES; lane++)
+        if (L->active[lane] != 0 && L->reg[R_PC][lane] < pc)
+            pc = L->reg[R_PC][lane];
+    return pc;
+}
+
+/*
+ * Choose the PC to execute next.  While every running lane agrees this
+ * is a single compare; after divergence the lowest PC goes first, which
+ * lets lanes that skipped ahead wait at the join point for the others.
+ * A lane looping at a low address would then keep the rest waiting, so
+ * every other slice of diverged steps goes to one lane (round-robin)
+ * instead.
+ */
+static inline int pick_pc(lanes_t *L) {
+    int lead = 0, pc;
+    lane_vec_t same;
+
+    while (L->active[lead] == 0)
+        lead++;
+    pc = L->reg[R_PC][lead];
+    same = (lane_vec_t)(L->reg[R_PC] == SPLAT(pc)) | ~L->active;
+    if (all_ones(&same))
+        return pc;
+    return pick_diverged_pc(L, lead);
+}
+
+
+// Execution
+
+
+// Execute one instruction for every lane sharing the chosen PC
+static inline void lanes_step(lanes_t *L) {
+    int pc = pick_pc(L);
+    lane_vec_t word = L->mem[pc];
+    int lead = 0, inst, addr;
+    lane_vec_t m, r;
+
+    /* Lanes at this PC, restricted to those holding the same instruction
+       (self-modifying code can make them differ). */
+    m = (lane_vec_t)(L->reg[R_PC] == SPLAT(pc)) & L->active;
+    while (m[lead] == 0)
+        lead++;
+    if (is_device_addr(pc)) {
+        /* Executing a device register; nothing is shared. */
+        inst = lane_read(L, lead, pc);
+        m = SPLAT(0);
+        m[lead] = 0xFFFF;
+    } else {
+        inst = word[lead];
+        m &= (lane_vec_t)(word == SPLAT(inst));
+    }
+
+    /* Fetch. */
+    L->reg[R_IR] = BLEND(L->reg[R_IR], SPLAT(inst), m);
+    L->reg[R_PC] = BLEND(L->reg[R_PC], SPLAT(pc + 1), m);
+    L->count -= m;
+    if (++L->count_steps == L->fold_at)
+        check_limits(L);
+
+#define DR    (((inst) >> 9) & 7)
+#define SR1   (((inst) >> 6) & 7)
+#define SR2   ((inst) & 7)
+    switch ((lane_op_t)lane_decode[inst]) {
+        case LOP_ADD_FMT_RRR:
+            r = L->reg[SR1] + L->reg[SR2];
+            L->reg[DR] = BLEND(L->reg[DR], r, m);
+            set_cc(L, &r, &m);
+            return;
+        case LOP_ADD_FMT_RRI:
+            r = L->reg[SR1] + SPLAT(F_imm5(inst));
+            L->reg[DR] = BLEND(L->reg[DR], r, m);
+            set_cc(L, &r, &m);
+            return;
+        case LOP_AND_FMT_RRR:
+            r = L->reg[SR1] & L->reg[SR2];
+            L->reg[DR] = BLEND(L->reg[DR], r, m);
+            set_cc(L, &r, &m);
+            return;
+        case LOP_AND_FMT_RRI:
+            r = L->reg[SR1] & SPLAT(F_imm5(inst));
+            L->reg[DR] = BLEND(L->reg[DR], r, m);
+            set_cc(L, &r, &m);
+            return;
+        case LOP_NOT_FMT_RR:
+            r = ~L->reg[SR1];
+            L->reg[DR] = BLEND(L->reg[DR], r, m);
+            set_cc(L, &r, &m);
+            return;
+        case LOP_BR_FMT_CL:
+            m &= (lane_vec_t)((L->reg[R_PSR] & SPLAT(F_CC(inst))) != 0);
+            L->reg[R_PC] = BLEND(L->reg[R_PC], SPLAT(pc + 1 + F_imm9(inst)),
+                                 m);
+            return;
+        case LOP_JMP_FMT_R:
+            L->reg[R_PC] = BLEND(L->reg[R_PC], L->reg[SR1], m);
+            return;
+        case LOP_JSR_FMT_L:
+            L->reg[R_R7] = BLEND(L->reg[R_R7], SPLAT(pc + 1), m);
+            L->reg[R_PC] = BLEND(L->reg[R_PC], SPLAT(pc + 1 + F_imm11(inst)),
+                                 m);
+            return;
+        case LOP_JSRR_FMT_R:
+            r = L->reg[SR1];
+            L->reg[R_R7] = BLEND(L->reg[R_R7], SPLAT(pc + 1), m);
+            L->reg[R_PC] = BLEND(L->reg[R_PC], r, m);
+            return;
+        case LOP_LEA_FMT_RL:
+            r = SPLAT(pc + 1 + F_imm9(inst));
+            L->reg[DR] = BLEND(L->reg[DR], r, m);
+            set_cc(L, &r, &m);
+            return;
+        case LOP_LD_FMT_RL:
+            addr = (pc + 1 + F_imm9(inst)) & 0xFFFF;
+            if (is_device_addr(addr))
+                break;
+            r = L->mem[addr];
+            L->reg[DR] = BLEND(L->reg[DR], r, m);
+            set_cc(L, &r, &m);
+            return;
+        case LOP_ST_FMT_RL:
+            addr = (pc + 1 + F_imm9(inst)) & 0xFFFF;
+            if (is_device_addr(addr))
+                break;
+            L->mem[addr] = BLEND(L->mem[addr], L->reg[DR], m);
+            return;
+        case LOP_TRAP_FMT_V:
+            L->reg[R_R7] = BLEND(L->reg[R_R7], SPLAT(pc + 1), m);
+            L->reg[R_PC] = BLEND(L->reg[R_PC], L->mem[F_vec8(inst)], m);
+            return;
+        default:
+            /* per-lane addresses, devices, and illegal instructions */
+            break;
+    }
+#undef DR
+#undef SR1
+#undef SR2
+
+    for (int lane = lead; lane < LANES; lane++)
+        if (m[lane] != 0)
+            lane_exec_scalar(L, lane);
+}
+
+// Run until every lane has stopped
+LANES_TARGETS
+static void lanes_run(lanes_t *L) {
+    while (any_set(&L->active))
+        lanes_step(L);
+    fold_counts(L);
+}
+
+
+// Batch driver
+
+
+static unsigned char * read_whole_file(const char *name, size_t *lenp) {
+    FILE *f;
+    unsigned char *buf = NULL;
+    size_t len = 0, cap = 0, got;
+
+    if ((f = fopen(name, "rb")) == NULL)
+        return NULL;
+    do {
+        if (len == cap) {
+            cap = (cap == 0 ? 4096 : cap * 2);
+            buf = realloc(buf, cap);
+            if (buf == NULL) {
+                fclose(f);
+                return NULL;
+            }
+        }
+        got = fread(buf + len, 1, cap - len, f);
+        len += got;
+    } while (got != 0);
+    fclose(f);
+    *lenp = len;
+    return buf;
+}
+
+// Reload every lane from the memory image and start it at pc
+static void lanes_reset(lanes_t *L, const int *image, int pc) {
+    for (int addr = 0; addr < 65536; addr++)
+        L->mem[addr] = SPLAT(image[addr]);
+    memset(L->reg, 0, sizeof(L->reg));
+    L->reg[R_PSR] = SPLAT(2 << 9); /* set to condition ZERO */
+    L->reg[R_PC] = SPLAT(pc);
+    L->active = SPLAT(0xFFFF);
+    L->count = SPLAT(0);
+    L->count_steps = 0;
+    L->fold_at = 0xFFFF;
+    L->favour = -1;
+    L->last_favoured = LANES - 1;
+    L->slice_steps = 0;
+    for (int lane = 0; lane < LANES; lane++) {
+        free(L->io[lane].in);
+        free(L->io[lane].out);
+        memset(&L->io[lane], 0, sizeof(L->io[lane]));
+    }
+}
+
+static void print_lane_result(const lane_io_t *io, bool json) {
+    if (json) {
+        json_begin("result");
+        json_string("input", io->name);
+        json_string("reason", lane_reasons[io->state]);
+        if (io->state == LANE_ILLEGAL)
+            json_number("pc", io->stop_pc);
+        json_number("insns", io->insns);
+        json_bytes("output", io->out, io->out_len);
+        json_end();
+        return;
+    }
+    printf("=== %s: ", io->name);
+    if (io->state == LANE_ILLEGAL)
+        printf("illegal instruction at x%04X", io->stop_pc);
+    else
+        printf("%s", lane_state_names[io->state]);
+    printf(" after %llu instructions, %zu bytes of output ===\n",
+           io->insns, io->out_len);
+    fwrite(io->out, 1, io->out_len, stdout);
+    if (io->out_len > 0 && io->out[io->out_len - 1] != '\n')
+        puts("");
+}
+
+// Digests of a finished lane's registers and memory, for the run cache
+static void lane_digests(const lanes_t *L, int lane, cache_record_t *rec) {
+    static int words[65536];
+
+    for (int r = 0; r < NUM_REGS; r++)
+        words[r] = L->reg[r][lane];
+    rec->reg_digest = range_hash(words, 0, NUM_REGS);
+    for (int addr = 0; addr < 65536; addr++)
+        words[addr] = L->mem[addr][lane];
+    rec->mem_digest = range_hash(words, 0, 65536);
+}
+
+/*
+ * Run the program in image (already holding the OS) once per input file.
+ * Every group of LANES inputs boots the OS from boot_pc with its output
+ * discarded, then starts the program at start_pc with console input read
+ * from the lane's file.  Each lane stops after max_insns instructions and
+ * each group after timeout_ms milliseconds (0 for no limit).  With the
+ * run cache open, inputs whose runs are cached skip execution, and new
+ * results are stored.  Results are printed in input order.
+ */
+int run_lanes_batch(const int *image,
+                    int boot_pc,
+                    int start_pc,
+                    int num_inputs,
+                    char * const *inputs,
+                    unsigned long long max_insns,
+                    int timeout_ms,
+                    bool use_cache,
+                    bool json) {
+    lanes_t *L;
+    lane_io_t *results;
+    cache_key_t *keys = NULL;
+    bool *keyed = NULL;
+    int group[LANES];
+    int next, printed, group_len, lane, status = 0;
+
+    if ((L = calloc(1, sizeof(*L))) == NULL ||
+        (L->mem = aligned_alloc(sizeof(lane_vec_t),
+                                65536 * sizeof(lane_vec_t))) == NULL ||
+        (results = calloc(num_inputs, sizeof(*results))) == NULL ||
+        (use_cache && ((keys = calloc(num_inputs, sizeof(*keys))) == NULL ||
+                       (keyed = calloc(num_inputs, sizeof(*keyed))) == NULL))) {
+        puts("Out of memory for batch execution.");
+        return 3;
+    }
+    build_decode_table();
+
+    for (next = printed = 0; printed < num_inputs; ) {
+        /* Gather up to LANES inputs that need running; cache hits and
+           unreadable inputs finish on the spot. */
+        group_len = 0;
+        for (; next < num_inputs && group_len < LANES; next++) {
+            lane_io_t *io = &results[next];
+            cache_record_t rec;
+
+            io->name = inputs[next];
+            io->state = LANE_RUNNING;
+            if ((io->in = read_whole_file(io->name, &io->in_len)) == NULL) {
+                io->state = LANE_NO_INPUT;
+                status = 1;
+                continue;
+            }
+            if (use_cache) {
+                keyed[next] = cache_key(image, start_pc, max_insns, io->in,
+                                        io->in_len, &keys[next]);
+                if (keyed[next] &&
+                    cache_lookup(&keys[next], NUM_LANE_STATES, &rec)) {
+                    io->state = rec.state;
+                    io->stop_pc = rec.stop_pc;
+                    io->insns = rec.insns;
+                    io->out = rec.out;
+                    io->out_len = io->out_cap = rec.out_len;
+                    continue;
+                }
+            }
+            group[group_len++] = next;
+        }
+
+        if (group_len > 0) {
+            /* Boot every lane together, without limits. */
+            lanes_reset(L, image, boot_pc);
+            L->discard_output = true;
+            L->max_insns = 0;
+            L->timeout_ms = 0;
+            lanes_run(L);
+            L->discard_output = false;
+
+            /* Start the program in the lanes that have input. */
+            L->reg[R_PC] = SPLAT(start_pc);
+            for (lane = 0; lane < group_len; lane++) {
+                L->io[lane] = results[group[lane]];
+                L->active[lane] = 0xFFFF;
+            }
+            L->max_insns = max_insns;
+            L->timeout_ms = timeout_ms;
+            clock_gettime(CLOCK_MONOTONIC, &L->start);
+            check_limits(L);
+            lanes_run(L);
+
+            /* Take the results back, caching the deterministic ones. */
+            for (lane = 0; lane < group_len; lane++) {
+                lane_io_t *io = &results[group[lane]];
+
+                *io = L->io[lane];
+                memset(&L->io[lane], 0, sizeof(L->io[lane]));
+                if (use_cache && keyed[group[lane]] &&
+                    io->state != LANE_TIMEOUT) {
+                    cache_record_t rec = {
+                        .state = io->state, .stop_pc = io->stop_pc,
+                        .insns = io->insns, .out = io->out,
+                        .out_len = io->out_len
+                    };
+
+                    lane_digests(L, lane, &rec);
+                    cache_store(&keys[group[lane]], &rec);
+                }
+            }
+        }
+
+        /* Print everything finished, in input order. */
+        for (; printed < next; printed++) {
+            print_lane_result(&results[printed], json);
+            free(results[printed].in);
+            free(results[printed].out);
+        }
+    }
+
+    if (json)
+        json_flush();
+    free(keyed);
+    free(keys);
+    free(results);
+    free(L->mem);
+    free(L);
+    return status;
+}
@@ -0,0 +1,233 @@
+/* tab:8
+ *
+ * lc3range.c - bulk operations on ranges of LC-3 memory
+ *
+ * Copyright (c) 2026 by LandonTheCoder.
+ *
+ * Permission to use, copy, modify, and distribute this software and its
+ * documentation for any purpose, without fee, and without written
+ * agreement is hereby granted, provided that the above copyright notice
+ * and the following two paragraphs appear in all copies of this software,
+ * that the files COPYING and NO_WARRANTY are included verbatim with
+ * any distribution, and that the contents of the file README are included
+ * verbatim as part of a file named README with any distribution.
+ *
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE TO ANY PARTY FOR DIRECT,
+ * INDIRECT, SPECIAL, INCIDENTAL, OR CONSEQUENTIAL DAMAGES ARISING OUT
+ * OF THE USE OF THIS SOFTWARE AND ITS DOCUMENTATION, EVEN IF THE AUTHOR
+ * HAS BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * THE AUTHOR SPECIFICALLY DISCLAIMS ANY WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE.  THE SOFTWARE PROVIDED HEREUNDER IS ON AN "AS IS"
+ * BASIS, AND THE AUTHOR NO OBLIGATION TO PROVIDE MAINTENANCE, SUPPORT,
+ * UPDATES, ENHANCEMENTS, OR MODIFICATIONS."
+ *
+ * Filename:	    lc3range.c
+ *
+ * Kernels over runs of LC-3 memory words, used by the state assertion,
+ * search and hashing commands.  Memory is held as an int per word in
+ * lc3sim.c, so the compare and search work on vectors of ints (GCC/Clang
+ * generic vectors, which become AVX2 or SSE code where available).
+ * Callers split ranges that wrap around x0000 themselves.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "lc3sim.h"
+
+/* Words compared per vector. */
+#define RANGE_VEC_WORDS 8
+
+typedef int range_vec_t __attribute__((vector_size(RANGE_VEC_WORDS * sizeof(int))));
+
+/* As in lc3lanes.c, let the loader pick an AVX2 copy where possible. */
+#if defined(__GNUC__) && !defined(__clang__) && defined(__x86_64__) && \
+    defined(__linux__)
+#define RANGE_TARGETS __attribute__((target_clones("avx2", "default")))
+#else
+#define RANGE_TARGETS
+#endif
+
+static inline bool vec_any_set(const range_vec_t *v) {
+    uint64_t w[sizeof(*v) / sizeof(uint64_t)];
+    uint64_t acc = 0;
+
+    memcpy(w, v, sizeof(*v));
+    for (size_t i = 0; i < sizeof(w) / sizeof(w[0]); i++)
+        acc |= w[i];
+    return acc != 0;
+}
+
+/*
+ * Returns the index of the first of n words that differs between a and b
+ * (compared as 16-bit values), or n if they all match.
+ */
+RANGE_TARGETS
+int range_mismatch(const int *a, const int *b, int n) {
+    range_vec_t va[4], vb[4], diff;
+    int i = 0;
+
+    /* Four vectors at a time; the exact word is found below. */
+    for (; i + 4 * RANGE_VEC_WORDS <= n; i += 4 * RANGE_VEC_WORDS) {
+        memcpy(va, a + i, sizeof(va));
+        memcpy(vb, b + i, sizeof(vb));
+        diff = ((va[0] ^ vb[0]) | (va[1] ^ vb[1]) |
+                (va[2] ^ vb[2]) | (va[3] ^ vb[3])) & 0xFFFF;
+        if (vec_any_set(&diff))
+            break;
+    }
+    for (; i < n; i++)
+        if (((a[i] ^ b[i]) & 0xFFFF) != 0)
+            return i;
+    return n;
+}
+
+// Whether the len words at w match pattern in the bits set in masks
+static inline bool matches_at(const int *w, const int *pattern,
+                              const int *masks, int len) {
+    for (int k = 0; k < len; k++)
+        if (((w[k] ^ pattern[k]) & masks[k]) != 0)
+            return false;
+    return true;
+}
+
+/*
+ * Returns the first index from from on where the len words of pattern
+ * occur among the n words (compared in the bits set in the matching
+ * masks), or -1 if they do not.  Vectors of words are tested against
+ * the first pattern word, and only candidates are checked in full.
+ */
+RANGE_TARGETS
+int range_find(const int *words, int n, const int *pattern,
+               const int *masks, int len, int from) {
+    range_vec_t v, first, mask, hits;
+    int i = from, last = n - len;
+
+    first = (range_vec_t){0} + (pattern[0] & masks[0] & 0xFFFF);
+    mask = (range_vec_t){0} + (masks[0] & 0xFFFF);
+    for (; i + RANGE_VEC_WORDS - 1 <= last; i += RANGE_VEC_WORDS) {
+        memcpy(&v, words + i, sizeof(v));
+        hits = ((v & mask) == first);
+        if (!vec_any_set(&hits))
+            continue;
+        for (int j = 0; j < RANGE_VEC_WORDS; j++)
+            if (hits[j] && matches_at(words + i + j, pattern, masks, len))
+                return i + j;
+    }
+    for (; i <= last; i++)
+        if (matches_at(words + i, pattern, masks, len))
+            return i;
+    return -1;
+}
+
+
+// Hashing
+
+
+/* XXH64 constants */
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3 0x165667B19E3779F9ULL
+#define PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define PRIME64_5 0x27D4EB2F165667C5ULL
+
+static inline uint64_t rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t xxh64_round(uint64_t acc, uint64_t input) {
+    acc += input * PRIME64_2;
+    acc = rotl64(acc, 31);
+    return acc * PRIME64_1;
+}
+
+static inline uint64_t xxh64_merge(uint64_t acc, uint64_t val) {
+    acc ^= xxh64_round(0, val);
+    return acc * PRIME64_1 + PRIME64_4;
+}
+
+static inline uint64_t read_le64(const unsigned char *p) {
+    uint64_t v = 0;
+
+    for (int i = 7; i >= 0; i--)
+        v = (v << 8) | p[i];
+    return v;
+}
+
+static inline uint32_t read_le32(const unsigned char *p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) |
+           ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+/*
+ * XXH64 of a byte string.  Matches the reference implementation, so
+ * hashes can be reproduced outside the simulator.
+ */
+unsigned long long xxh64_bytes(const void *data, size_t len,
+                               unsigned long long seed) {
+    const unsigned char *p = data, *end = p + len;
+    uint64_t h;
+
+    if (len >= 32) {
+        uint64_t v1 = seed + PRIME64_1 + PRIME64_2;
+        uint64_t v2 = seed + PRIME64_2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - PRIME64_1;
+
+        do {
+            v1 = xxh64_round(v1, read_le64(p));
+            v2 = xxh64_round(v2, read_le64(p + 8));
+            v3 = xxh64_round(v3, read_le64(p + 16));
+            v4 = xxh64_round(v4, read_le64(p + 24));
+            p += 32;
+        } while (p + 32 <= end);
+        h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+        h = xxh64_merge(h, v1);
+        h = xxh64_merge(h, v2);
+        h = xxh64_merge(h, v3);
+        h = xxh64_merge(h, v4);
+    } else
+        h = seed + PRIME64_5;
+
+    h += len;
+    for (; p + 8 <= end; p += 8) {
+        h ^= xxh64_round(0, read_le64(p));
+        h = rotl64(h, 27) * PRIME64_1 + PRIME64_4;
+    }
+    if (p + 4 <= end) {
+        h ^= (uint64_t)read_le32(p) * PRIME64_1;
+        h = rotl64(h, 23) * PRIME64_2 + PRIME64_3;
+        p += 4;
+    }
+    for (; p < end; p++) {
+        h ^= *p * PRIME64_5;
+        h = rotl64(h, 11) * PRIME64_1;
+    }
+
+    h ^= h >> 33;
+    h *= PRIME64_2;
+    h ^= h >> 29;
+    h *= PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
+
+/*
+ * Hashes count words of memory starting at start (wrapping at xFFFF).
+ * The words are hashed as little-endian 16-bit values with seed 0, so
+ * the result equals XXH64 of the same words written to a file that way.
+ */
+unsigned long long range_hash(const int *memory, int start, int count) {
+    static unsigned char bytes[2 * 65536];
+    int addr = start;
+
+    for (int i = 0; i < count; i++) {
+        bytes[2 * i] = memory[addr] & 0xFF;
+        bytes[2 * i + 1] = (memory[addr] >> 8) & 0xFF;
+        addr = (addr + 1) & 0xFFFF;
+    }
+    return xxh64_bytes(bytes, 2 * (size_t)count, 0);
+}
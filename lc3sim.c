@@ -34,17 +34,23 @@
  */
 
 #include <ctype.h>
+#include <errno.h>
+#include <limits.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
 // For the gui_mode boolean
 #include <stdbool.h>
+#include <stdarg.h>
 #include <stdint.h>
 // Used to set SIGINT (Ctrl-C) handler
 #include <signal.h>
 #include <strings.h>
 // Used for poll() on input to simulator and LC-3
 #include <sys/poll.h>
+// Used to map script files
+#include <sys/mman.h>
+#include <sys/stat.h>
 // Used in run_until_stopped()
 #include <sys/termios.h>
 #include <sys/types.h>
@@ -68,8 +74,21 @@
 #include "lc3os-sym.h"
 #endif
 
-/* Disassembly format specification. */
-#define OPCODE_WIDTH 6 
+/*
+ * USDT probes (provider "lc3sim") for SystemTap, bpftrace and perf.  A
+ * probe compiles to a single NOP, with its arguments left in registers,
+ * until a tracer attaches to it.
+ */
+#ifdef LC3SIM_SDT
+#include <sys/sdt.h>
+#define PROBE1(name,a)       DTRACE_PROBE1(lc3sim, name, a)
+#define PROBE2(name,a,b)     DTRACE_PROBE2(lc3sim, name, a, b)
+#define PROBE3(name,a,b,c)   DTRACE_PROBE3(lc3sim, name, a, b, c)
+#else
+#define PROBE1(name,a)
+#define PROBE2(name,a,b)
+#define PROBE3(name,a,b,c)
+#endif
 
 /* NOTE: hardcoded in scanfs! */
 #define MAX_CMD_WORD_LEN    41    /* command word limit + 1 */
@@ -77,6 +96,8 @@
 #define MAX_LABEL_LEN       81    /* label limit + 1        */
 
 #define MAX_SCRIPT_DEPTH    10    /* prevent infinite recursion in scripts */
+#define CMD_TRIE_SIZE      512    /* nodes for all command name prefixes   */
+#define MAX_FIND_LEN       256    /* words in a search pattern             */
 #define MAX_FINISH_DEPTH 10000000 /* avoid waiting to finish subroutine    */
                                   /* that recurses infinitely              */
 
@@ -92,31 +113,259 @@
 typedef enum bpt_type_t bpt_type_t;
 enum bpt_type_t {BPT_NONE, BPT_USER};
 
+/*
+ * Conditions on user breakpoints are compiled to code for a small stack
+ * machine.  Values are 16-bit words compared as signed numbers; && and
+ * || jump past their right side when the left side decides the result.
+ */
+typedef enum cond_op_t cond_op_t;
+enum cond_op_t {
+    COP_CONST, COP_REG, COP_LOAD, COP_NEG, COP_NOT, COP_INVERT, COP_BOOL,
+    COP_ADD, COP_SUB, COP_AND, COP_OR, COP_XOR,
+    COP_EQ, COP_NE, COP_LT, COP_LE, COP_GT, COP_GE,
+    COP_JFALSE, COP_JTRUE
+};
+
+#define COND_MAX_CODE  64    /* words of code in one condition */
+#define COND_MAX_STACK 16    /* values on the stack at once    */
+
+#define BPT_MAX_COMMANDS 1000   /* length of a breakpoint's command list */
+
+/*
+ * What makes a user breakpoint stop other than being reached: a
+ * condition (none if len is 0) and a number of hits to skip.  Hits are
+ * counted when the condition holds.  When it stops, the breakpoint can
+ * run a list of commands (separated by ';', NULL for none), and then
+ * carry on running if the list ended with "continue".
+ */
+typedef struct bpt_cond_t bpt_cond_t;
+struct bpt_cond_t {
+    unsigned long long hits, ignore;
+    char *commands;
+    bool resume;
+    int len;
+    short code[COND_MAX_CODE];
+    char text[];
+};
+
+/*
+ * Why the LC-3 last stopped running.  The names in stop_names are
+ * reported to session clients and must not change.
+ */
+typedef enum stop_reason_t stop_reason_t;
+enum stop_reason_t {
+    STOP_NONE, STOP_HALTED, STOP_BREAKPOINT, STOP_STEP, STOP_BUDGET,
+    STOP_TIMEOUT, STOP_ILLEGAL, STOP_INTERRUPTED, STOP_RECURSION,
+    STOP_MISMATCH, STOP_WATCH
+};
+
+static const char * const stop_names[] = {
+    "none", "halted", "breakpoint", "step", "budget",
+    "timeout", "illegal", "interrupted", "recursion", "mismatch", "watch"
+};
+
+/* Instructions run between checks of the wall-clock limit. */
+#define LIMIT_CHECK_INTERVAL 4096
+
+/* Device registers, in address order with the MCR last. */
+typedef enum device_t device_t;
+enum device_t {
+    DEV_KBSR, DEV_KBDR, DEV_DSR, DEV_DDR, DEV_MCR, NUM_DEVICES
+};
+
+static const char * const device_names[NUM_DEVICES] = {
+    "KBSR", "KBDR", "DSR", "DDR", "MCR"
+};
+
+/*
+ * Counters kept while the LC-3 runs, for the stats command.  Loads and
+ * stores follow from the opcode mix, so only opcodes and TRAP vectors
+ * are counted.  Host time is wall-clock time inside runs, part of which
+ * is spent polling the keyboard with no input available.
+ */
+typedef struct lc3_stats_t lc3_stats_t;
+struct lc3_stats_t {
+    unsigned long long opcodes[16];
+    unsigned long long traps[256];
+    unsigned long long dev_reads[NUM_DEVICES], dev_writes[NUM_DEVICES];
+    long long run_ns, wait_ns;
+};
+
+/* Limits on the profiler's tree of calling contexts. */
+#define PROFILE_MAX_NODES 16384
+#define PROFILE_MAX_DEPTH 256
+
+/*
+ * Disassembled lines are cached per address, without the breakpoint
+ * mark and GUI prefix in front.  A slot holds the instruction it was
+ * rendered from and the generation of the symbol table then, so stores
+ * need no invalidation; lines too long for a slot are not cached.
+ */
+#define DIS_SLOT_TEXT 56
+
+typedef struct dis_slot_t dis_slot_t;
+struct dis_slot_t {
+    unsigned int sym_gen;
+    unsigned short inst;
+    unsigned char len;
+    char text[DIS_SLOT_TEXT + 1];
+};
+
+/* Trace records are written a megabyte at a time. */
+#define TRACE_BUF_SIZE (1 << 20)
+
+/*
+ * Logs of the nondeterministic events in a run, written by the record
+ * command and read back by replay.  After the magic string comes the
+ * device PRNG's state (8 bytes, little-endian), then one varint per
+ * event in the order the LC-3 saw them.  For a KBSR read that found
+ * console input waiting, the varint is twice the number of reads before
+ * it that found none.  For a KBDR read, it is 1 at the end of input, or
+ * else twice the byte read plus 3.  Everything else the LC-3 sees follows
+ * from these and the PRNG.
+ */
+#define REPLAY_MAGIC "LC3REC1\n"
+
+/* Instructions kept for reverse execution by "history on". */
+#define HISTORY_DEFAULT (1 << 20)
+#define HISTORY_MAX     (1 << 28)
+
+/*
+ * How to undo one instruction: the PC, IR and PSR before it ran, the
+ * old value of the register it writes (see trace_dest()), and for a
+ * store, the word it overwrote.  Anything else an instruction changes
+ * is a device latch or console input, noted in the flags.
+ */
+typedef struct undo_t undo_t;
+struct undo_t {
+    unsigned short pc, ir, psr, reg, addr, value;
+    unsigned char flags, input;
+};
+
+/*
+ * The start of a snapshot file, as the machine is held in memory here.
+ * The symbols follow: for each, its address (high byte first) and its
+ * name with a NUL after it.
+ */
+#define SNAPSHOT_MAGIC      "LC3SNAP1"
+#define SNAPSHOT_BYTE_ORDER 0x01020304
+
+typedef struct snapshot_t snapshot_t;
+struct snapshot_t {
+    char magic[8];
+    unsigned int byte_order, sym_bytes;
+    int registers[NUM_REGS];
+    int last_KBSR_read, last_DSR_read;
+    int memory[65536];
+    unsigned char breakpoints[65536];
+};
+
+typedef enum undo_flag_t undo_flag_t;
+enum undo_flag_t {
+    UNDO_STORE = 1,  /* addr held value                 */
+    UNDO_KBSR  = 2,  /* last_KBSR_read was set          */
+    UNDO_DSR   = 4,  /* last_DSR_read was set           */
+    UNDO_INPUT = 8   /* read input from KBDR            */
+};
+
+/*
+ * A node in the profiler's tree of calling contexts: one subroutine (or
+ * TRAP routine) as reached through one chain of calls from the routine
+ * that was running when profiling began.  Calls are the JSR, JSRR and
+ * TRAP instructions that lc3.def flags FLG_SUBROUTINE; returns are
+ * FLG_RETURN (RET).
+ */
+typedef struct prof_node_t prof_node_t;
+struct prof_node_t {
+    int entry;                  /* address called */
+    int depth;                  /* 0 for the root */
+    int parent, child, sibling; /* node indices, or -1 */
+    unsigned long long calls, self;
+};
+
+/* Problems the sanitizer looks for, named as in its JSON records. */
+typedef enum san_kind_t san_kind_t;
+enum san_kind_t {
+    SAN_UNINIT_READ, SAN_CODE_WRITE, SAN_SYSTEM_WRITE, NUM_SAN_KINDS
+};
+
+static const char * const san_names[NUM_SAN_KINDS] = {
+    "uninitialized-read", "code-write", "system-write"
+};
+
+/* Instructions counted from a label to the next, for profile reports. */
+typedef struct label_total_t label_total_t;
+struct label_total_t {
+    int addr;
+    unsigned long long insns;
+};
+
 // Internal function pre-declarations
 static char * simple_readline(const char *prompt);
 
 static void show_state_if_stop_visible(void);
 static void disassemble_one(int addr);
 static void disassemble(int addr_s, int addr_e);
+static void send_code_frames(int addr, int count);
+static void send_regs_frame(void);
+static void sanitizer_report(san_kind_t kind, int target);
+static void profile_instruction(int addr);
+static inline void cover_instruction(int addr);
+static void sanitize_instruction(int addr);
+static void trace_fetch(int addr);
+static void trace_instruction(int addr);
+static void trace_close(void);
+static bool input_waiting(void);
+static int read_input(void);
+static void save_undo(int addr);
+static void save_undo_target(int addr);
+static void forget_history(void);
+static int restore_snapshot(const char *name);
+static bool breakpoint_fires(int addr);
+static void watch_access(int addr, int kind, int value);
+static int fetch_watched(int addr);
+static void restart_expected_output(void);
 
 // Declare the implementations of the simulator commands
+static void cmd_assert(const char *args);
 static void cmd_break(const char *args);
 static void cmd_continue(const char *args);
+static void cmd_copy(const char *args);
+static void cmd_coverage(const char *args);
 static void cmd_dump(const char *args);
 static void cmd_execute(const char *args);
+static void cmd_expect(const char *args);
 static void cmd_file(const char *args);
+static void cmd_fill(const char *args);
+static void cmd_find(const char *args);
 static void cmd_finish(const char *args);
+static void cmd_hash(const char *args);
 static void cmd_help(const char *args);
+static void cmd_history(const char *args);
 static void cmd_list(const char *args);
+static void cmd_load(const char *args);
 static void cmd_memory(const char *args);
 static void cmd_next(const char *args);
 static void cmd_option(const char *args);
 static void cmd_printregs(const char *args);
+static void cmd_profile(const char *args);
+static void cmd_protocol(const char *args);
 static void cmd_quit(const char *args);
+static void cmd_rcontinue(const char *args);
+static void cmd_record(const char *args);
 static void cmd_register(const char *args);
+static void cmd_replay(const char *args);
 static void cmd_reset(const char *args);
+static void cmd_restore(const char *args);
+static void cmd_rnext(const char *args);
+static void cmd_rstep(const char *args);
+static void cmd_sanitize(const char *args);
+static void cmd_save(const char *args);
+static void cmd_stats(const char *args);
 static void cmd_step(const char *args);
+static void cmd_trace(const char *args);
 static void cmd_translate(const char *args);
+static void cmd_watch(const char *args);
 static void cmd_lc3_stop(const char *args);
 
 typedef enum cmd_flag_t cmd_flag_t;
@@ -124,7 +373,9 @@ enum cmd_flag_t {
     CMD_FLAG_NONE       = 0,
     CMD_FLAG_REPEATABLE = 1, /* pressing ENTER repeats command  */
     CMD_FLAG_LIST_TYPE  = 2, /* pressing ENTER shows more       */
-    CMD_FLAG_GUI_ONLY   = 4  /* only valid in GUI mode          */
+    CMD_FLAG_GUI_ONLY   = 4, /* only valid in GUI mode          */
+    CMD_FLAG_RUNS_LC3   = 8, /* runs or replaces the LC-3       */
+    CMD_FLAG_EDITS      = 16 /* stores words (clears history)   */
 };
 
 typedef void (*command_func_t)(const char *);
@@ -143,42 +394,93 @@ struct command_t {
 
 // Command definitions
 static const struct command_t command[] = {
+    {"assert",    1, cmd_assert,    CMD_FLAG_NONE      },
     {"break",     1, cmd_break,     CMD_FLAG_NONE      },
-    {"continue",  1, cmd_continue,  CMD_FLAG_REPEATABLE},
+    {"continue",  1, cmd_continue,  CMD_FLAG_REPEATABLE | CMD_FLAG_RUNS_LC3},
+    {"copy",      3, cmd_copy,      CMD_FLAG_EDITS    },
+    {"coverage",  3, cmd_coverage,  CMD_FLAG_NONE      },
     {"dump",      1, cmd_dump,      CMD_FLAG_LIST_TYPE },
-    {"execute",   1, cmd_execute,   CMD_FLAG_NONE      },
-    {"file",      1, cmd_file,      CMD_FLAG_NONE      },
-    {"finish",    3, cmd_finish,    CMD_FLAG_REPEATABLE},
+    {"execute",   1, cmd_execute,   CMD_FLAG_RUNS_LC3  },
+    {"expect",    3, cmd_expect,    CMD_FLAG_NONE      },
+    {"file",      1, cmd_file,      CMD_FLAG_RUNS_LC3  },
+    {"fill",      4, cmd_fill,      CMD_FLAG_EDITS    },
+    {"find",      4, cmd_find,      CMD_FLAG_NONE      },
+    {"finish",    3, cmd_finish,    CMD_FLAG_REPEATABLE | CMD_FLAG_RUNS_LC3},
+    {"hash",      2, cmd_hash,      CMD_FLAG_NONE      },
     {"help",      1, cmd_help,      CMD_FLAG_NONE      },
+    {"history",   2, cmd_history,   CMD_FLAG_NONE      },
     {"list",      1, cmd_list,      CMD_FLAG_LIST_TYPE },
-    {"memory",    1, cmd_memory,    CMD_FLAG_NONE      },
-    {"next",      1, cmd_next,      CMD_FLAG_REPEATABLE},
+    {"load",      2, cmd_load,      CMD_FLAG_EDITS    },
+    {"memory",    1, cmd_memory,    CMD_FLAG_EDITS    },
+    {"next",      1, cmd_next,      CMD_FLAG_REPEATABLE | CMD_FLAG_RUNS_LC3},
     {"option",    1, cmd_option,    CMD_FLAG_NONE      },
     {"printregs", 1, cmd_printregs, CMD_FLAG_NONE      },
-    {"quit",      4, cmd_quit,      CMD_FLAG_NONE      },
-    {"register",  1, cmd_register,  CMD_FLAG_NONE      },
-    {"reset",     5, cmd_reset,     CMD_FLAG_NONE      },
-    {"step",      1, cmd_step,      CMD_FLAG_REPEATABLE},
+    {"profile",   3, cmd_profile,   CMD_FLAG_NONE      },
+    {"protocol",  4, cmd_protocol,  CMD_FLAG_GUI_ONLY  },
+    {"quit",      4, cmd_quit,      CMD_FLAG_RUNS_LC3  },
+    {"rcontinue", 2, cmd_rcontinue, CMD_FLAG_REPEATABLE | CMD_FLAG_RUNS_LC3},
+    {"record",    3, cmd_record,    CMD_FLAG_RUNS_LC3  },
+    {"register",  1, cmd_register,  CMD_FLAG_EDITS    },
+    {"replay",    3, cmd_replay,    CMD_FLAG_RUNS_LC3  },
+    {"reset",     5, cmd_reset,     CMD_FLAG_RUNS_LC3  },
+    {"restore",   4, cmd_restore,   CMD_FLAG_RUNS_LC3  },
+    {"rnext",     2, cmd_rnext,     CMD_FLAG_REPEATABLE | CMD_FLAG_RUNS_LC3},
+    {"rstep",     2, cmd_rstep,     CMD_FLAG_REPEATABLE | CMD_FLAG_RUNS_LC3},
+    {"sanitize",  3, cmd_sanitize,  CMD_FLAG_NONE      },
+    {"save",      3, cmd_save,      CMD_FLAG_NONE      },
+    {"stats",     3, cmd_stats,     CMD_FLAG_NONE      },
+    {"step",      1, cmd_step,      CMD_FLAG_REPEATABLE | CMD_FLAG_RUNS_LC3},
+    {"trace",     4, cmd_trace,     CMD_FLAG_NONE      },
     {"translate", 1, cmd_translate, CMD_FLAG_NONE      },
+    {"watch",     1, cmd_watch,     CMD_FLAG_NONE      },
     {"x",         1, cmd_lc3_stop,  CMD_FLAG_GUI_ONLY  },
     {NULL,        0, NULL,          CMD_FLAG_NONE      }
 };
 
+static const command_t * find_command(const char *word, int len);
+
+/*
+ * Every prefix of every command name, with the command it selects in
+ * text and GUI mode (the first in command[] that the prefix is long
+ * enough for), or -1.  Built on first use.
+ */
+typedef struct cmd_trie_t cmd_trie_t;
+struct cmd_trie_t {
+    unsigned short next[26];
+    short match[2];
+};
+
+static cmd_trie_t cmd_trie[CMD_TRIE_SIZE];
+static int cmd_trie_len = 0;
+
+/* What an empty line repeats (NULL for nothing), for each level of
+   command loop. */
+typedef struct repeat_t repeat_t;
+struct repeat_t {
+    char *line;
+};
+
 // LC-3 state
 static int lc3_register[NUM_REGS];
 #define REG(i) lc3_register[(i)]
 static int lc3_memory[65536];
 static bool lc3_show_later[65536];
 static bpt_type_t lc3_breakpoints[65536];
+static bpt_cond_t *bpt_conds[65536];
 
-/* startup script or file */
+/* startup script or file, and any snapshot restored before either */
 static char *start_script = NULL;
 static char *start_file = NULL;
+static const char *start_snapshot = NULL;
 
 static bool should_halt = true;
 // Maybe this is also a boolean?
 static int last_KBSR_read = 0, last_DSR_read = 0;
 static bool gui_mode;
+/* GUI protocol version agreed with the "protocol" command (see below) */
+static int gui_protocol = 1;
+static bool serve_mode = false;
+static bool json_mode = false;
 static bool interrupted_at_gui_request = false;
 static bool stop_scripts = false;
 static bool in_init = false;
@@ -193,6 +495,84 @@ static bool rand_device = true;
 static bool delay_mem_update = true;
 static bool script_uses_stdin = true;
 static int script_depth = 0;
+/* limits on each run (0 for none), and how the last run ended */
+static unsigned long long max_insns = 0;
+static int timeout_ms = 0;
+static stop_reason_t stop_reason = STOP_NONE;
+static unsigned long long run_insns = 0;
+static bool stop_unreported = false;
+/* expected LC-3 output (NULL if not checking), and the first mismatch */
+static unsigned char *expect_out = NULL;
+static size_t expect_len, expect_pos;
+/* the current program's output has differed; some program's has (for
+   the exit status) */
+static bool expect_failed, expect_ever_failed;
+static int mismatch_actual, mismatch_pc;
+/* watchpoints on each address, the same or'd over each 256-word page so
+   that an unwatched access costs one test, and the first hit of a run */
+#define WATCH_READ   1
+#define WATCH_WRITE  2
+#define WATCH_CHANGE 4
+static unsigned char watch_flags[65536], watch_pages[256];
+static bool watch_live = false, watch_hit = false;
+static int watch_kind, watch_pc, watch_addr, watch_old, watch_new;
+/* failed assertions since the simulator started */
+static int assert_failures = 0;
+/* performance counters, and when the LC-3 started waiting for input */
+static lc3_stats_t lc3_stats;
+static struct timespec wait_start;
+/* profiler: executions of each address, and the calling context tree
+   (with the current node, and calls too deep to record since) */
+static bool profiling = false;
+static unsigned long long prof_counts[65536];
+static prof_node_t prof_nodes[PROFILE_MAX_NODES];
+static int prof_num_nodes = 0, prof_cur = 0, prof_lost = 0;
+/* coverage bitsets: addresses executed other than BRs, then BRs that
+   fell through and BRs that jumped (see cover_instruction) */
+static bool covering = false;
+static uint64_t cov_sets[3][1024];
+/* disassembly: the cache of rendered lines (see lc3dis.c) */
+static dis_slot_t *dis_cache = NULL;
+static const char *lcov_at_exit = NULL;
+/* sanitizer: shadow bitsets of words written (kept even when it is off)
+   and instructions fetched, the instruction being checked (-1 if none),
+   and what has been found */
+static bool sanitizing = false;
+static int san_pc = -1;
+static uint64_t san_written[1024], san_fetched[1024];
+static uint64_t san_reported[NUM_SAN_KINDS][1024];
+static unsigned long long san_counts[NUM_SAN_KINDS];
+static int san_stack_lo = -1, san_stack_hi = -1;
+/* execution trace: the file (NULL when not tracing), records not yet
+   written, and what the next record is encoded against */
+static FILE *trace_file = NULL;
+static bool trace_failed;
+static unsigned char trace_buf[TRACE_BUF_SIZE];
+static size_t trace_len = 0;
+static int trace_ir[65536];
+static int trace_next_pc, trace_last_addr, trace_addr;
+/* device timing PRNG (xorshift64*) and any --seed, and record and
+   replay logs: KBSR reads since the last one that found input, and the
+   next event */
+static uint64_t rng_state;
+static bool have_seed = false;
+static unsigned long long seed_option;
+static FILE *record_file = NULL, *replay_file = NULL;
+static unsigned long long record_polls;
+static unsigned long long replay_event;
+/* reverse execution: a ring of the last instructions' undo records,
+   and input they read that the LC-3 has to be given again */
+static undo_t *history = NULL;
+static int history_size, history_next, history_len;
+static unsigned char *unread = NULL;
+static int unread_len = 0;
+
+/* JSON mode: the current command's text, and LC-3 output not yet
+   written as a record */
+static char *response_text = NULL;
+static size_t response_len = 0, response_cap = 0;
+static unsigned char lc3_text[4096];
+static size_t lc3_text_len = 0;
 
 /* I/O seen by the LC-3 */
 static FILE *lc3in;
@@ -205,7 +585,6 @@ static char * (*lc3readline)(const char *) = simple_readline;
 static unsigned int kbsr_waits = 0;
 #ifdef LC3SIM_IDLE
 // This data is used for sleeping when waiting for input.
-#include <limits.h>
 static const struct timespec idle_sleep = {
   .tv_nsec = 500
 };
@@ -219,6 +598,133 @@ static const char * const ccodes[8] = {
 // Start implementation
 
 
+// Output
+
+
+/*
+ * All of the simulator's own output goes through these.  In JSON mode,
+ * text is collected into the response record of the command that
+ * printed it, and anything with more structure (LC-3 output, errors,
+ * stops, register dumps) becomes a record of its own as it happens.
+ */
+
+// Writes LC-3 output collected in JSON mode as an output record
+static void flush_lc3_text(void) {
+    if (lc3_text_len == 0)
+        return;
+    json_begin("output");
+    json_bytes("text", lc3_text, lc3_text_len);
+    json_end();
+    lc3_text_len = 0;
+}
+
+// Starts a JSON record, after any LC-3 output that came before it
+static void begin_record(const char *type) {
+    flush_lc3_text();
+    json_begin(type);
+}
+
+static void sim_vprintf(const char *fmt, va_list ap) {
+    va_list copy;
+    size_t cap;
+    char *text;
+    int len;
+
+    if (!json_mode) {
+        vprintf(fmt, ap);
+        return;
+    }
+    va_copy(copy, ap);
+    len = vsnprintf(NULL, 0, fmt, copy);
+    va_end(copy);
+    if (len < 0)
+        return;
+    if (response_len + len + 1 > response_cap) {
+        for (cap = (response_cap > 0 ? response_cap : 256);
+             cap < response_len + len + 1; cap *= 2);
+        if ((text = realloc(response_text, cap)) == NULL)
+            return;
+        response_text = text;
+        response_cap = cap;
+    }
+    vsnprintf(response_text + response_len, len + 1, fmt, ap);
+    response_len += len;
+}
+
+// Writes len bytes of text, as sim_printf("%s") would
+static void sim_write(const char *text, size_t len) {
+    size_t cap;
+    char *grown;
+
+    if (!json_mode) {
+        fwrite(text, 1, len, stdout);
+        return;
+    }
+    if (response_len + len + 1 > response_cap) {
+        for (cap = (response_cap > 0 ? response_cap : 256);
+             cap < response_len + len + 1; cap *= 2);
+        if ((grown = realloc(response_text, cap)) == NULL)
+            return;
+        response_text = grown;
+        response_cap = cap;
+    }
+    memcpy(response_text + response_len, text, len);
+    response_len += len;
+    response_text[response_len] = '\0';
+}
+
+static void __attribute__((format(printf, 1, 2)))
+sim_printf(const char *fmt, ...) {
+    va_list ap;
+
+    va_start(ap, fmt);
+    sim_vprintf(fmt, ap);
+    va_end(ap);
+}
+
+static void sim_puts(const char *s) {
+    sim_printf("%s\n", s);
+}
+
+/*
+ * Reports an error: an ERR line for the GUI, a record in JSON mode, or
+ * a line of text.  Leading newlines only set the message apart from
+ * LC-3 output on a terminal.
+ */
+static void __attribute__((format(printf, 1, 2)))
+sim_error(const char *fmt, ...) {
+    char msg[MAX_FILE_NAME_LEN + 200];
+    const char *text;
+    va_list ap;
+
+    va_start(ap, fmt);
+    vsnprintf(msg, sizeof(msg), fmt, ap);
+    va_end(ap);
+    text = msg + strspn(msg, "\n");
+    if (json_mode) {
+        begin_record("error");
+        json_string("message", text);
+        json_end();
+    } else if (gui_mode)
+        printf("ERR {%s}\n", text);
+    else
+        puts(msg);
+}
+
+// Writes out whatever JSON mode still holds when the simulator exits
+static void finish_json(void) {
+    if (response_len > 0) {
+        begin_record("response");
+        json_string("command", "");
+        json_bytes("text", response_text, response_len);
+        json_end();
+        response_len = 0;
+    }
+    flush_lc3_text();
+    json_flush();
+}
+
+
 // Miscellaneous utility functions
 
 
@@ -231,6 +737,7 @@ void halt_lc3(int sig) {
 
     /* has no effect unless LC-3 is running... */
     should_halt = true;
+    stop_reason = STOP_INTERRUPTED;
 
     /* print a stop notice after ^C */
     need_a_stop_notice = true;
@@ -238,8 +745,10 @@ void halt_lc3(int sig) {
 
 // Fallback line reader for when readline isn't present
 static char * simple_readline(const char *prompt) {
-    char buf[200];
+    char *buf = NULL;
     char *strip_nl;
+    size_t cap = 0;
+    ssize_t len;
     struct pollfd p;
 
     /* If we exhaust all commands after being interrupted by the
@@ -258,29 +767,31 @@ static char * simple_readline(const char *prompt) {
     while (1) {
 
 #if !defined(USE_READLINE)
-        if (!gui_mode && script_depth == 0)
-            printf("%s", prompt);
+        if (!gui_mode && !serve_mode && !json_mode && script_depth == 0)
+            sim_printf("%s", prompt);
 #endif
-        /* read a line */
-        if (fgets(buf, 200, sim_in) != NULL)
+        /* read a line, however long */
+        if ((len = getline(&buf, &cap, sim_in)) != -1)
             break;
 
         /* no more input? */
-        if (feof(sim_in))
+        if (feof(sim_in)) {
+            free(buf);
             return NULL;
+        }
 
         /* Otherwise, probably a CTRL-C, so print a blank line and
            (possibly) another prompt, then try again. */
-        puts("");
+        sim_puts("");
     }
 
     /* strip carriage returns and linefeeds */
-    for (strip_nl = buf + strlen(buf) - 1;
+    for (strip_nl = buf + len - 1;
          strip_nl >= buf && (*strip_nl == '\n' || *strip_nl == '\r');
          strip_nl--);
     *++strip_nl = 0;
 
-    return strdup(buf);
+    return buf;
 }
 
 // A simple getline() implementation
@@ -327,6 +838,31 @@ static char * lc3s_getline(char *outbuf,
     return outbuf;
 }
 
+// Nanoseconds elapsed since start
+static long long elapsed_ns(const struct timespec *start) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000000000LL +
+           (now.tv_nsec - start->tv_nsec);
+}
+
+// Next number from the device timing PRNG
+static inline uint32_t lc3_random(void) {
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return (rng_state * 0x2545F4914F6CDD1DULL) >> 32;
+}
+
+// Seeds the device timing PRNG (any seed gives a nonzero state)
+static void seed_random(unsigned long long seed) {
+    seed += 0x9E3779B97F4A7C15ULL;
+    seed = (seed ^ (seed >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    seed = (seed ^ (seed >> 27)) * 0x94D049BB133111EBULL;
+    rng_state = (seed ^ (seed >> 31)) | 1;
+}
+
 // Clear all console input
 static void flush_console_input(void) {
     struct pollfd p;
@@ -343,10 +879,20 @@ static void flush_console_input(void) {
         fgetc(lc3in);
 }
 
-// This clears the symbol table for a stretch of memory.
+// This clears the symbol table (and source lines) for a stretch of memory.
 static void squash_symbols(int addr_s, int addr_e) {
     while (addr_s != addr_e) {
         remove_symbol_at_addr(addr_s);
+        lc3_src_file[addr_s] = 0;
+        addr_s = (addr_s + 1) & 0xFFFF;
+    }
+    dis_sym_gen++;
+}
+
+// This forgets which words of a stretch of memory ran (for the sanitizer).
+static void forget_fetches(int addr_s, int addr_e) {
+    while (addr_s != addr_e) {
+        san_fetched[addr_s >> 6] &= ~(1ULL << (addr_s & 63));
         addr_s = (addr_s + 1) & 0xFFFF;
     }
 }
@@ -357,7 +903,7 @@ static void warn_too_many_args(void) {
        extra arguments when handed to the command line;
        we silently ignore them. */
     if (!gui_mode)
-        puts(TOO_MANY_ARGS);
+        sim_puts(TOO_MANY_ARGS);
 }
 
 // Warn when argument is sent to a no-arguments command
@@ -366,16 +912,86 @@ static void no_args_allowed(const char *args) {
         warn_too_many_args();
 }
 
+// Ends the response to a top-level command for session clients
+static void end_response(const char *cmd_word) {
+    /* In JSON mode, every command (scripted or not) ends with a
+       response record holding its text. */
+    if (json_mode) {
+        begin_record("response");
+        json_string("command", cmd_word);
+        json_bytes("text", response_text, response_len);
+        json_end();
+        response_len = 0;
+        if (script_depth == 0)
+            json_flush();
+        return;
+    }
+    /* Frames are a record separator (ASCII RS) line naming the command
+       that was run ("?" if unknown, empty for a blank line), followed by
+       the stop reason and instruction count if the LC-3 ran. */
+    if (!serve_mode || script_depth > 0)
+        return;
+    if (stop_unreported)
+        sim_printf("\036%s %s %llu\n", cmd_word, stop_names[stop_reason],
+                   run_insns);
+    else
+        sim_printf("\036%s\n", cmd_word);
+    stop_unreported = false;
+    fflush(stdout);
+}
+
 
 // Address parsing
 
 
+// Parses a whole string as a number, as "%d" or "%x" would
+static bool parse_number(const char *s, int base, int *valuep) {
+    const char *digits;
+    bool negative = false;
+    long value = 0;
+    int digit;
+
+    if (*s == '+' || *s == '-')
+        negative = (*s++ == '-');
+    if (base == 16 && s[0] == '0' && tolower(s[1]) == 'x' && isxdigit(s[2]))
+        s += 2;
+    for (digits = s; *s != '\0'; s++) {
+        if (isdigit(*s))
+            digit = *s - '0';
+        else if (base == 16 && isxdigit(*s))
+            digit = tolower(*s) - 'a' + 10;
+        else
+            return false;
+        /* Anything this large is out of range anyway. */
+        if (value > 0xFFFFFF)
+            return false;
+        value = value * base + digit;
+    }
+    if (s == digits)
+        return false;
+    *valuep = (negative ? -value : value);
+    return true;
+}
+
+// Copies the next whitespace-delimited word (at most size - 1 characters)
+static int scan_word(const char **pp, char *word, int size) {
+    const char *p = *pp;
+    int len = 0;
+
+    while (isspace(*p))
+        p++;
+    while (*p != '\0' && !isspace(*p) && len < size - 1)
+        word[len++] = *p++;
+    word[len] = '\0';
+    *pp = p;
+    return len;
+}
+
 // Parse address string to integer
 static int parse_address(const char *addr) {
     symbol_t *label;
-    char *fmt;
     int value, negated;
-    unsigned char trash[2];
+    bool ok;
 
     /* default matching order: symbol, hexadecimal */
     /* hexadecimal can optionally be preceded by x or X */
@@ -390,12 +1006,12 @@ static int parse_address(const char *addr) {
         value = label->addr;
     else {
         if (*addr == '#')
-            fmt = "#%d%1s";
+            ok = parse_number(addr + 1, 10, &value);
         else if (tolower(*addr) == 'x')
-            fmt = "x%x%1s";
+            ok = parse_number(addr + 1, 16, &value);
         else
-            fmt = "%x%1s";
-        if (sscanf(addr, fmt, &value, trash) != 1 || value > 0xFFFF ||
+            ok = parse_number(addr, 16, &value);
+        if (!ok || value > 0xFFFF ||
             ((negated && value < 0) || (!negated && value < -0xFFFF)))
             return -1;
     }
@@ -416,8 +1032,9 @@ static int parse_range(const char *args,
     int num_args, start, end;
 
     /* Split and count the arguments. */
-    /* 80 == MAX_LABEL_LEN - 1 */
-    num_args = sscanf(args, "%80s%80s%1s", arg1, arg2, trash);
+    num_args = (scan_word(&args, arg1, MAX_LABEL_LEN) > 0) +
+               (scan_word(&args, arg2, MAX_LABEL_LEN) > 0) +
+               (scan_word(&args, trash, 2) > 0);
 
     /* If we have no automatic scaling for the range, we
        need both the start and the end to be specified. */
@@ -471,28 +1088,57 @@ success:
     return 0;
 }
 
+// Parses whitespace-separated values (labels or numbers) into values
+static int parse_words(const char *args, int *values, int max) {
+    char word[MAX_LABEL_LEN];
+    int count;
+
+    for (count = 0; scan_word(&args, word, MAX_LABEL_LEN) > 0; count++) {
+        if (count == max) {
+            warn_too_many_args();
+            break;
+        }
+        if ((values[count] = parse_address(word)) == -1) {
+            sim_error("No address or label corresponding to \"%s\" "
+                      "exists.", word);
+            return -1;
+        }
+    }
+    return count;
+}
+
 
 // LC-3 memory access
 
 
 int read_memory(int addr) {
-    struct pollfd p;
+    int value;
 
     switch (addr) {
         case 0xFE00: /* KBSR */
+            lc3_stats.dev_reads[DEV_KBSR]++;
             if (!last_KBSR_read) {
-                p.fd = fileno(lc3in);
-                p.events = POLLIN;
                 /* Check if input is available */
-                if (poll(&p, 1, 0) == 1 && (p.revents & POLLIN) != 0) {
+                if (input_waiting()) {
                     /* Adds random delay if random-registers mode is enabled */
+                    if (kbsr_waits > 0)
+                        lc3_stats.wait_ns += elapsed_ns(&wait_start);
                     kbsr_waits = 0;
-                    last_KBSR_read = (!rand_device || (random() & 15) == 0);
-                } else {
+                    last_KBSR_read = (!rand_device || (lc3_random() & 15) == 0);
+                } else if (replay_file == NULL) {
                     /* No input available */
                     if (kbsr_waits < INT_MAX)
                         // Saturate to reduce CPU usage
                         kbsr_waits++;
+                    if (kbsr_waits == 1) {
+                        clock_gettime(CLOCK_MONOTONIC, &wait_start);
+                        /* Let a JSON reader see any prompt before it has
+                           to answer. */
+                        if (json_mode) {
+                            flush_lc3_text();
+                            json_flush();
+                        }
+                    }
                     /* Perhaps put a sleep here to reduce CPU usage? */
 #ifdef LC3SIM_IDLE
                     if (kbsr_waits > 250) {
@@ -503,9 +1149,12 @@ int read_memory(int addr) {
 #endif
                 }
             }
-            return (last_KBSR_read ? 0x8000 : 0x0000);
+            value = (last_KBSR_read ? 0x8000 : 0x0000);
+            PROBE2(device_read, addr, value);
+            return value;
         case 0xFE02: /* KBDR */
-            if (last_KBSR_read && (lc3_memory[0xFE02] = fgetc(lc3in)) == -1) {
+            lc3_stats.dev_reads[DEV_KBDR]++;
+            if (last_KBSR_read && (lc3_memory[0xFE02] = read_input()) == -1) {
                 /* Should not happen in GUI mode. */
                 /* FIXME: This won't show up correctly in GUI.
                    Exit is likely to be detected first, and error message
@@ -513,47 +1162,102 @@ int read_memory(int addr) {
                    (read past end), then Tcl/Tk error caused by bad
                    window access after sim died.  Confusing sequence
                    if it occurs. */
-                if (gui_mode)
-                    puts("ERR {LC-3 read past end of input stream.}");
-                else
-                    puts("LC-3 read past end of input stream.");
+                sim_error("LC-3 read past end of input stream.");
                 exit(3);
             }
             last_KBSR_read = 0;
+            PROBE2(device_read, addr, lc3_memory[0xFE02]);
             return lc3_memory[0xFE02];
         case 0xFE04: /* DSR */
+            lc3_stats.dev_reads[DEV_DSR]++;
             if (!last_DSR_read) {
                 /* Simulate hardware delay when random-registers mode is
                  * enabled. (Otherwise, it is always ready.)
                  */
-                last_DSR_read = (!rand_device || (random() & 15) == 0);
+                last_DSR_read = (!rand_device || (lc3_random() & 15) == 0);
             }
-            return (last_DSR_read ? 0x8000 : 0x0000);
+            value = (last_DSR_read ? 0x8000 : 0x0000);
+            PROBE2(device_read, addr, value);
+            return value;
         case 0xFE06: /* DDR */
+            lc3_stats.dev_reads[DEV_DDR]++;
+            PROBE2(device_read, addr, 0x0000);
             return 0x0000;
-        case 0xFFFE: return 0x8000;   /* MCR */
+        case 0xFFFE: /* MCR */
+            lc3_stats.dev_reads[DEV_MCR]++;
+            PROBE2(device_read, addr, 0x8000);
+            return 0x8000;
     }
+    if (san_pc != -1 && ((san_written[addr >> 6] >> (addr & 63)) & 1) == 0)
+        sanitizer_report(SAN_UNINIT_READ, addr);
+    if ((watch_pages[addr >> 8] & WATCH_READ) != 0)
+        watch_access(addr, WATCH_READ, lc3_memory[addr]);
     return lc3_memory[addr];
 }
 
+// Compares one byte of LC-3 output with the expected output
+static void check_output(int value) {
+    if (expect_failed)
+        return;
+    if (expect_pos == expect_len ||
+        expect_out[expect_pos] != (unsigned char)value) {
+        /* Stop the LC-3 after this instruction; reported by
+           report_mismatch. */
+        expect_failed = expect_ever_failed = true;
+        mismatch_actual = (unsigned char)value;
+        mismatch_pc = (REG(R_PC) - 1) & 0xFFFF;
+        should_halt = true;
+        stop_reason = STOP_MISMATCH;
+        return;
+    }
+    expect_pos++;
+}
+
 void write_memory(int addr, int value) {
     switch (addr) {
         case 0xFE00: /* KBSR */
         case 0xFE02: /* KBDR */
         case 0xFE04: /* DSR */
+            lc3_stats.dev_writes[(addr - 0xFE00) / 2]++;
+            PROBE2(device_write, addr, value);
             return;
         case 0xFE06: /* DDR */
+            lc3_stats.dev_writes[DEV_DDR]++;
+            PROBE2(device_write, addr, value);
             if (last_DSR_read == 0)
                 return;
-            fprintf(lc3out, "%c", value);
-            fflush(lc3out);
+            if (json_mode) {
+                if (lc3_text_len == sizeof(lc3_text))
+                    flush_lc3_text();
+                lc3_text[lc3_text_len++] = value;
+            } else {
+                fprintf(lc3out, "%c", value);
+                fflush(lc3out);
+            }
             last_DSR_read = 0;
+            if (expect_out != NULL && !in_init)
+                check_output(value);
             return;
         case 0xFFFE: /* MCR */
-            if ((value & 0x8000) == 0)
+            lc3_stats.dev_writes[DEV_MCR]++;
+            PROBE2(device_write, addr, value);
+            if ((value & 0x8000) == 0) {
                 should_halt = true;
+                stop_reason = STOP_HALTED;
+            }
             return;
     }
+    if (san_pc != -1) {
+        if (((san_fetched[addr >> 6] >> (addr & 63)) & 1) != 0 ||
+            lc3_src_file[addr] != 0)
+            sanitizer_report(SAN_CODE_WRITE, addr);
+        /* The OS may store into its own space. */
+        if (addr < 0x3000 && san_pc >= 0x3000)
+            sanitizer_report(SAN_SYSTEM_WRITE, addr);
+    }
+    if (watch_pages[addr >> 8] != 0)
+        watch_access(addr, WATCH_WRITE, value);
+    san_written[addr >> 6] |= 1ULL << (addr & 63);
     /* No need to write/update GUI if the same value is already in memory. */
     if (value != lc3_memory[addr]) {
         lc3_memory[addr] = value;
@@ -591,36 +1295,16 @@ static int read_obj_file(const char *filename, int *startp, int *endp) {
     }
     fclose(f);
     squash_symbols(start, addr);
+    forget_fetches(start, addr);
+    PROBE3(load, filename, start, addr);
+    /* Undoing stores from before the load would corrupt it. */
+    forget_history();
     *startp = start;
     *endp = addr;
 
     return 0;
 }
 
-static int read_sym_file(const char *filename) {
-    FILE *f;
-    int adding = 0;
-    char buf[100];
-    char sym[81];
-    int addr;
-
-    if ((f = fopen(filename, "r")) == NULL)
-        return -1;
-    while (fgets(buf, 100, f) != NULL) {
-        if (!adding) {
-            if (sscanf(buf, "%*s%*s%80s", sym) == 1 &&
-                strcmp(sym, "------------") == 0)
-                adding = 1;
-            continue;
-        }
-        if (sscanf(buf, "%*s%80s%x", sym, &addr) != 2)
-            break;
-        add_symbol(sym, addr, 1);
-    }
-    fclose(f);
-    return 0;
-}
-
 static int read_obj_mem(const unsigned char *in_mem,
                         size_t memsz,
                         int *startp,
@@ -641,6 +1325,8 @@ static int read_obj_mem(const unsigned char *in_mem,
         addr = (addr + 1) & 0xFFFF;
     }
     squash_symbols(start, addr);
+    forget_fetches(start, addr);
+    forget_history();
     *startp = start;
     *endp = addr;
 
@@ -648,26 +1334,16 @@ static int read_obj_mem(const unsigned char *in_mem,
 }
 
 static int read_sym_mem(const unsigned char *in_mem, size_t memsz) {
-    int adding = 0;
-    char buf[100];
-    char sym[81];
-    int addr;
+    sym_reader_t rd = {SYM_HEADER, 0, NULL};
+    char buf[PATH_MAX + 20];
     int read_size, index = 0;
 
-    while (lc3s_getline(buf, 100,
+    while (lc3s_getline(buf, sizeof(buf),
                         (const char *)(in_mem + index),
                         memsz - index, &read_size) != NULL) {
         index += read_size;
         read_size = 0;
-        if (!adding) {
-            if (sscanf(buf, "%*s%*s%80s", sym) == 1 &&
-                strcmp(sym, "------------") == 0)
-                adding = 1;
-            continue;
-        }
-        if (sscanf(buf, "%*s%80s%x", sym, &addr) != 2)
-            break;
-        add_symbol(sym, addr, 1);
+        read_sym_line(buf, &rd);
     }
     return 0;
 }
@@ -676,9 +1352,24 @@ static int read_sym_mem(const unsigned char *in_mem, size_t memsz) {
 // Execute an instruction
 // Return value is whether to continue running
 static bool execute_instruction(void) {
-    /* Fetch the instruction. */
-    REG(R_IR) = read_memory(REG(R_PC));
-    REG(R_PC) = (REG(R_PC) + 1) & 0xFFFF;
+    int addr = REG(R_PC);
+
+    if (sanitizing && !in_init)
+        san_pc = addr;
+    if (history != NULL && !in_init)
+        save_undo(addr);
+
+    /* Fetch the instruction (which is not a read for watchpoints). */
+    if ((watch_pages[addr >> 8] & WATCH_READ) != 0)
+        REG(R_IR) = fetch_watched(addr);
+    else
+        REG(R_IR) = read_memory(addr);
+    REG(R_PC) = (addr + 1) & 0xFFFF;
+    if (history != NULL && !in_init)
+        save_undo_target(addr);
+    PROBE2(insn, addr, REG(R_IR));
+    if (trace_file != NULL && !in_init)
+        trace_fetch(addr);
 
     /* Try to execute it. */
 
@@ -686,6 +1377,11 @@ static bool execute_instruction(void) {
 #define DEF_INST(name,format,mask,match,flags,code) \
     if ((REG(R_IR) & (mask)) == (match)) {         \
         last_flags = (flags);                       \
+        lc3_stats.opcodes[(match) >> 12]++;         \
+        if (((match) >> 12) == 0xF) {               \
+            lc3_stats.traps[REG(R_IR) & 0xFF]++;    \
+            PROBE2(trap, REG(R_IR) & 0xFF, addr);   \
+        }                                           \
         code;                                       \
         goto executed;                              \
     }
@@ -696,37 +1392,48 @@ static bool execute_instruction(void) {
 #undef ADD_FLAGS
 
     // This runs if instruction was invalid. Otherwise, see "executed".
+    san_pc = -1;
     REG(R_PC) = (REG(R_PC) - 1) & 0xFFFF;
-    if (gui_mode)
-        printf("ERR {Illegal instruction at x%04X!}\n", REG (R_PC));
-    else
-        printf("Illegal instruction at x%04X!\n", REG (R_PC));
+    sim_error("Illegal instruction at x%04X!", REG (R_PC));
+    stop_reason = STOP_ILLEGAL;
     return false;
 
 executed:
+    if (profiling && !in_init)
+        profile_instruction(addr);
+    if (covering && !in_init)
+        cover_instruction(addr);
+    if (san_pc != -1)
+        sanitize_instruction(addr);
+    if (trace_file != NULL && !in_init)
+        trace_instruction(addr);
+
     /* Check for user breakpoints. */
-    if (lc3_breakpoints[REG(R_PC)] == BPT_USER) {
-        if (!gui_mode)
-            printf("The LC-3 hit a breakpoint...\n");
+    if (lc3_breakpoints[REG(R_PC)] == BPT_USER &&
+        (bpt_conds[REG(R_PC)] == NULL || breakpoint_fires(REG(R_PC)))) {
+        if (!gui_mode && !json_mode)
+            sim_printf("The LC-3 hit a breakpoint...\n");
+        PROBE1(breakpoint, REG(R_PC));
+        stop_reason = STOP_BREAKPOINT;
         return false;
     }
 
     /* Check for system breakpoint (associated with "next" command). */
-    if (REG(R_PC) == sys_bpt_addr)
+    if (REG(R_PC) == sys_bpt_addr) {
+        stop_reason = STOP_STEP;
         return false;
+    }
 
     if (finish_depth > 0) {
         if ((last_flags & FLG_SUBROUTINE) && 
             ++finish_depth == MAX_FINISH_DEPTH) {
-            if (gui_mode)
-                puts("ERR {Stopping due to possibly infinite "
-                     "recursion.}");
-            else
-                puts("Stopping due to possibly infinite recursion.");
+            sim_error("Stopping due to possibly infinite recursion.");
             finish_depth = 0;
+            stop_reason = STOP_RECURSION;
             return false;
         } else if ((last_flags & FLG_RETURN) && --finish_depth == 0) {
             /* Done with finish command; stop execution. */
+            stop_reason = STOP_STEP;
             return false;
         }
     }
@@ -739,6 +1446,7 @@ executed:
         p.events = POLLIN;
         if (poll(&p, 1, 0) == 1 && (p.revents & POLLIN) != 0) {
             interrupted_at_gui_request = true;
+            stop_reason = STOP_INTERRUPTED;
             return false;
         }
     }
@@ -750,136 +1458,66 @@ executed:
 // Disassembly utilities
 
 
-// Used in disassembly
-static void print_operands(int addr, int inst, format_t fmt) {
-    bool found = false;
-    int tgt;
-
-    if (fmt & FMT_R1) {
-        printf("%sR%d", (found ? "," : ""), F_DR(inst));
-        found = 1;
-    }
-    if (fmt & FMT_R2) {
-        printf("%sR%d", (found ? "," : ""), F_SR1(inst));
-        found = 1;
-    }
-    if (fmt & FMT_R3) {
-        printf("%sR%d", (found ? "," : ""), F_SR2(inst));
-        found = 1;
-    }
-    if (fmt & FMT_IMM5) {
-        printf("%s#%d", (found ? "," : ""), F_imm5(inst));
-        found = 1;
-    }
-    if (fmt & FMT_IMM6) {
-        printf("%s#%d", (found ? "," : ""), F_imm6(inst));
-        found = 1;
-    }
-    if (fmt & FMT_VEC8) {
-        printf("%sx%02X", (found ? "," : ""), F_vec8(inst));
-        found = 1;
-    }
-    if (fmt & FMT_ASC8) {
-        printf("%s", (found ? "," : ""));
-        found = 1;
-        switch (F_vec8(inst)) {
-            case  7: printf("'\\a'"); break;
-            case  8: printf("'\\b'"); break;
-            case  9: printf("'\\t'"); break;
-            case 10: printf("'\\n'"); break;
-            case 11: printf("'\\v'"); break;
-            case 12: printf("'\\f'"); break;
-            case 13: printf("'\\r'"); break;
-            case 27: printf("'\\e'"); break;
-            case 34: printf("'\\\"'"); break;
-            case 44: printf("'\\''"); break;
-            case 92: printf("'\\\\'"); break;
-            default:
-                if (isprint(F_vec8(inst)))
-                    printf("'%c'", F_vec8(inst));
-                else
-                    printf("x%02X", F_vec8(inst));
-                break;
-        }
-    }
-    if (fmt & FMT_IMM9) {
-        printf("%s", (found ? "," : ""));
-        found = 1;
-        tgt = (addr + 1 + F_imm9(inst)) & 0xFFFF;
-        if (lc3_sym_names[tgt] != NULL)
-            printf("%s", lc3_sym_names[tgt]->name);
-        else
-            printf("x%04X", tgt);
-    }
-    if (fmt & FMT_IMM11) {
-        printf("%s", (found ? "," : ""));
-        found = 1;
-        tgt = (addr + 1 + F_imm11(inst)) & 0xFFFF;
-        if (lc3_sym_names[tgt] != NULL)
-            printf("%s", lc3_sym_names[tgt]->name);
-        else
-            printf("x%04X", tgt);
+// Renders the listing line for one address, returning its length
+static int disassembly_line(char *line, int addr) {
+    char *p = line;
+    dis_slot_t *slot = NULL;
+    int inst, len;
+
+    if (dis_cache == NULL)
+        dis_cache = calloc(65536, sizeof(*dis_cache));
+    /* Device registers are read as the LC-3 would see them. */
+    inst = (addr >= 0xFE00 ? read_memory(addr) : lc3_memory[addr]);
+
+    /* GUI prefix */
+    if (gui_mode) {
+        memcpy(p, "CODE", 4);
+        p += 4;
+        *p++ = (!in_init && addr == lc3_register[R_PC] ? 'P' : ' ');
+        p += sprintf(p, "%5d", addr + 1);
     }
-    if (fmt & FMT_IMM16) {
-        printf("%s", (found ? "," : ""));
-        found = 1;
-        if (lc3_sym_names[inst] != NULL)
-            printf("%s", lc3_sym_names[inst]->name);
-        else
-            printf("x%04X", inst);
+    *p++ = (lc3_breakpoints[addr] == BPT_USER ? 'B' : ' ');
+
+    if (dis_cache != NULL && addr < 0xFE00)
+        slot = &dis_cache[addr];
+    if (slot != NULL && slot->sym_gen == dis_sym_gen && slot->inst == inst) {
+        memcpy(p, slot->text, slot->len);
+        p += slot->len;
+    } else {
+        len = dis_line(p, addr, inst);
+        if (slot != NULL && len <= DIS_SLOT_TEXT) {
+            slot->sym_gen = dis_sym_gen;
+            slot->inst = inst;
+            slot->len = len;
+            memcpy(slot->text, p, len);
+        }
+        p += len;
     }
+    *p++ = '\n';
+    return p - line;
 }
 
 // Disassemble a single instruction
 static void disassemble_one(int addr) {
-    static const char* const dis_cc[8] = {
-        "", "P", "Z", "ZP", "N", "NP", "NZ", "NZP"
-    };
-    int inst = read_memory(addr);
+    char line[DIS_LINE_LEN + 16];
 
-    /* GUI prefix */
-    if (gui_mode)
-        printf("CODE%c%5d",
-               (!in_init && addr == lc3_register[R_PC] ? 'P' : ' '),
-               addr + 1);
-
-    /* Try to find a label. */
-    if (lc3_sym_names[addr] != NULL)
-        printf("%c %16.16s x%04X x%04X ",
-               (lc3_breakpoints[addr] == BPT_USER ? 'B' : ' '),
-               lc3_sym_names[addr]->name, addr, inst);
-    else
-        printf("%c %17sx%04X x%04X ", 
-               (lc3_breakpoints[addr] == BPT_USER ? 'B' : ' '),
-               "", addr, inst);
-
-    /* Try to disassemble it. */
-
-#define DEF_INST(name,format,mask,match,flags,code)                        \
-    if ((inst & (mask)) == (match)) {                                      \
-        if ((format) & FMT_CC)                                             \
-            printf("%s%-*s", #name, (int)(OPCODE_WIDTH - strlen(#name)),   \
-                   dis_cc[F_CC(inst) >> 9]);                               \
-        else                                                               \
-            printf("%-*s", OPCODE_WIDTH, #name);                           \
-        print_operands(addr, inst, (format));                              \
-        goto printed;                                                      \
-    }
-#define DEF_P_OP(name,format,mask,match) \
-    DEF_INST(name,format,mask,match,FLG_NONE,{})
-#include "lc3.def"
-#undef DEF_P_OP
-#undef DEF_INST
-
-    // This executes if it is not a recognized instruction.
-    printf("%-*s", OPCODE_WIDTH, "???");
-
-printed:
-    puts("");
+    sim_write(line, disassembly_line(line, addr));
 }
 
 // Disassemble a range of memory
 static void disassemble(int addr_s, int addr_e) {
+    int count, run;
+
+    if (gui_mode && gui_protocol >= 2) {
+        /* CODE frames cannot wrap, so split at x0000. */
+        count = ((addr_e - addr_s - 1) & 0xFFFF) + 1;
+        for (; count > 0; count -= run) {
+            run = (count < 65536 - addr_s ? count : 65536 - addr_s);
+            send_code_frames(addr_s, run);
+            addr_s = (addr_s + run) & 0xFFFF;
+        }
+        return;
+    }
     do {
         disassemble_one(addr_s);
         addr_s = (addr_s + 1) & 0xFFFF;
@@ -892,31 +1530,59 @@ static void disassemble(int addr_s, int addr_e) {
 
 // Dumps register values
 static void print_registers(void) {
+    char name[3] = "R0";
     int regnum;
 
-    if (!gui_mode) {
-        printf("PC=x%04X IR=x%04X PSR=x%04X (%s)\n", REG(R_PC), REG(R_IR),
-               REG(R_PSR), ccodes[(REG(R_PSR) >> 9) & 7]);
+    if (json_mode) {
+        begin_record("registers");
+        for (regnum = 0; regnum < R_PC; regnum++) {
+            name[1] = '0' + regnum;
+            json_number(name, REG(regnum));
+        }
+        json_number("PC", REG(R_PC));
+        json_number("IR", REG(R_IR));
+        json_number("PSR", REG(R_PSR));
+        json_string("cc", ccodes[(REG(R_PSR) >> 9) & 7]);
+        json_end();
+    } else if (!gui_mode) {
+        sim_printf("PC=x%04X IR=x%04X PSR=x%04X (%s)\n", REG(R_PC), REG(R_IR),
+                   REG(R_PSR), ccodes[(REG(R_PSR) >> 9) & 7]);
         for (regnum = 0; regnum < R_PC; regnum++)
-            printf("R%d=x%04X ", regnum, REG(regnum));
-        puts("");
+            sim_printf("R%d=x%04X ", regnum, REG(regnum));
+        sim_puts("");
         disassemble_one(REG(R_PC));
-    } else {
+    } else if (gui_protocol >= 2)
+        send_regs_frame();
+    else {
         for (regnum = 0; regnum < NUM_REGS; regnum++)
-            printf("REG R%d x%04X\n", regnum, REG(regnum));
+            sim_printf("REG R%d x%04X\n", regnum, REG(regnum));
         /* regnum is now NUM_REGS */
-        printf("REG R%d %s\n", regnum, ccodes[(REG(R_PSR) >> 9) & 7]);
+        sim_printf("REG R%d %s\n", regnum, ccodes[(REG(R_PSR) >> 9) & 7]);
     }
 }
 
 // This sends memory updates when delayed memory dump was configured.
 static void dump_delayed_mem_updates(void) {
-    int addr;
+    int addr, end;
 
     if (!have_mem_to_dump)
         return;
     have_mem_to_dump = false;
 
+    /* Protocol 2 sends each run of changed words as one frame. */
+    if (gui_protocol >= 2) {
+        for (addr = 0; addr < 65536; addr = end) {
+            if (!lc3_show_later[addr]) {
+                end = addr + 1;
+                continue;
+            }
+            for (end = addr; end < 65536 && lc3_show_later[end]; end++)
+                lc3_show_later[end] = false;
+            send_code_frames(addr, end - addr);
+        }
+        return;
+    }
+
     /* FIXME: Could use a hash table here, but hint is probably enough. */
     for (addr = 0; addr < 65536; addr++) {
         if (lc3_show_later[addr]) {
@@ -952,24 +1618,24 @@ static void dump_memory(int addr_s, int addr_e) {
         addr_e += 0x10000;
     for (start = (addr_s / 12) * 12; start < addr_e; start += 12) {
         // Hex dump, with 12 words (24 bytes) per row
-        printf("%04X: ", start & 0xFFFF);
+        sim_printf("%04X: ", start & 0xFFFF);
         for (i = 0, addr = start; i < 12; i++, addr++) {
             // Display hex portion
             if (addr >= addr_s && addr < addr_e)
-                printf("%04X ", (a[i] = read_memory(addr & 0xFFFF)));
+                sim_printf("%04X ", (a[i] = read_memory(addr & 0xFFFF)));
             else
                 // If address is out of range, print blanks
-                printf("     ");
+                sim_printf("     ");
         }
-        printf(" ");
+        sim_printf(" ");
         for (i = 0, addr = start; i < 12; i++, addr++) {
             // Display printable characters
             if (addr >= addr_s && addr < addr_e)
-                printf("%c", (a[i] < 0x100 && isprint(a[i])) ? a[i] : '.');
+                sim_printf("%c", (a[i] < 0x100 && isprint(a[i])) ? a[i] : '.');
             else
-                printf(" ");
+                sim_printf(" ");
         }
-        puts("");
+        sim_puts("");
     }
 }
 
@@ -977,18 +1643,27 @@ static void dump_memory(int addr_s, int addr_e) {
 // Breakpoint management
 
 
+// Forgets the condition, hit count and commands of the breakpoint at addr
+static void clear_condition(int addr) {
+    if (bpt_conds[addr] != NULL)
+        free(bpt_conds[addr]->commands);
+    free(bpt_conds[addr]);
+    bpt_conds[addr] = NULL;
+}
+
 // Clears breakpoint at specified LC-3 address
 static void clear_breakpoint(int addr) {
     if (lc3_breakpoints[addr] != BPT_USER) {
         if (!gui_mode)
-            printf("No such breakpoint was set.\n");
+            sim_error("No such breakpoint was set.");
     } else {
         if (gui_mode)
-            printf("BCLEAR %d\n", addr + 1);
+            sim_printf("BCLEAR %d\n", addr + 1);
         else
-            printf("Cleared breakpoint at x%04X.\n", addr);
+            sim_printf("Cleared breakpoint at x%04X.\n", addr);
     }
     lc3_breakpoints[addr] = BPT_NONE;
+    clear_condition(addr);
 }
 
 // Clears all breakpoints
@@ -999,128 +1674,1788 @@ static void clear_all_breakpoints(void) {
      * breakpoints.
      */
     memset(lc3_breakpoints, 0, sizeof(lc3_breakpoints));
+    for (int i = 0; i < 65536; i++)
+        if (bpt_conds[i] != NULL)
+            clear_condition(i);
 }
 
 // Print user-set breakpoints on console
 static void list_breakpoints(void) {
     bool found = false;
+    bpt_cond_t *c;
 
     /* A bit hokey, but no big deal for this few. */
     for (int i = 0; i < 65536; i++) {
         if (lc3_breakpoints[i] == BPT_USER) {
             if (!found) {
-                printf("The following instructions are set as "
-                       "breakpoints:\n");
+                sim_printf("The following instructions are set as "
+                           "breakpoints:\n");
                 found = true;
             }
             disassemble_one(i);
+            if (gui_mode || (c = bpt_conds[i]) == NULL)
+                continue;
+            sim_printf("    ");
+            if (c->len > 0)
+                sim_printf("if %s; ", c->text);
+            sim_printf("hit %llu time%s", c->hits, (c->hits == 1 ? "" : "s"));
+            if (c->ignore > 0)
+                sim_printf(", skipping the first %llu", c->ignore);
+            sim_printf("\n");
+            if (c->commands != NULL)
+                sim_printf("    commands: %s\n", c->commands);
         }
     }
 
     if (!found)
-        printf("No breakpoints are set.\n");
+        sim_printf("No breakpoints are set.\n");
 }
 
-// Set user breakpoint on LC-3 address
-static void set_breakpoint(int addr) {
+/*
+ * Set user breakpoint on LC-3 address, with a condition or none (NULL).
+ * Any commands the breakpoint already had are kept.
+ */
+static void set_breakpoint(int addr, bpt_cond_t *cond) {
+    bool had_cond = (bpt_conds[addr] != NULL);
+
+    if (had_cond && bpt_conds[addr]->commands != NULL && cond != NULL) {
+        cond->commands = bpt_conds[addr]->commands;
+        cond->resume = bpt_conds[addr]->resume;
+        bpt_conds[addr]->commands = NULL;
+    }
+    if (cond != NULL || bpt_conds[addr] == NULL ||
+        bpt_conds[addr]->commands == NULL) {
+        clear_condition(addr);
+        bpt_conds[addr] = cond;
+    } else {
+        /* Drop the condition but keep the commands. */
+        bpt_conds[addr]->len = 0;
+        bpt_conds[addr]->text[0] = '\0';
+        bpt_conds[addr]->hits = bpt_conds[addr]->ignore = 0;
+    }
     if (lc3_breakpoints[addr] == BPT_USER) {
-        if (!gui_mode)
-            printf("That breakpoint is already set.\n");
+        if (!gui_mode && (cond != NULL || had_cond))
+            sim_printf("Changed breakpoint at x%04X.\n", addr);
+        else if (!gui_mode)
+            sim_printf("That breakpoint is already set.\n");
     } else {
         lc3_breakpoints[addr] = BPT_USER;
         if (gui_mode)
-            printf("BREAK %d\n", addr + 1);
+            sim_printf("BREAK %d\n", addr + 1);
         else
-            printf("Set breakpoint at x%04X.\n", addr);
+            sim_printf("Set breakpoint at x%04X.\n", addr);
     }
 }
 
+// A 16-bit word as a signed number
+static inline int cond_word(int value) {
+    return ((value & 0xFFFF) ^ 0x8000) - 0x8000;
+}
 
-// Program loops
+// Whether the condition of the breakpoint at addr holds (without counting)
+static bool condition_holds(int addr) {
+    const bpt_cond_t *c = bpt_conds[addr];
+    int stack[COND_MAX_STACK], sp = -1, a;
+
+    if (c == NULL || c->len == 0)
+        return true;
+    for (int pc = 0; pc < c->len; pc++) {
+        switch (c->code[pc]) {
+            case COP_CONST:  stack[++sp] = c->code[++pc]; break;
+            case COP_REG:    stack[++sp] = cond_word(REG(c->code[++pc]));
+                             break;
+            /* Reads memory as it is, without device side effects. */
+            case COP_LOAD:   stack[sp] = cond_word(lc3_memory[stack[sp] &
+                                                              0xFFFF]);
+                             break;
+            case COP_NEG:    stack[sp] = cond_word(-stack[sp]); break;
+            case COP_NOT:    stack[sp] = !stack[sp]; break;
+            case COP_INVERT: stack[sp] = ~stack[sp]; break;
+            case COP_BOOL:   stack[sp] = (stack[sp] != 0); break;
+            case COP_JFALSE:
+                if (stack[sp] == 0)
+                    pc = c->code[pc + 1] - 1;
+                else {
+                    sp--;
+                    pc++;
+                }
+                break;
+            case COP_JTRUE:
+                if (stack[sp] != 0) {
+                    stack[sp] = 1;
+                    pc = c->code[pc + 1] - 1;
+                } else {
+                    sp--;
+                    pc++;
+                }
+                break;
+            default:
+                a = stack[sp--];
+                switch (c->code[pc]) {
+                    case COP_ADD: stack[sp] = cond_word(stack[sp] + a); break;
+                    case COP_SUB: stack[sp] = cond_word(stack[sp] - a); break;
+                    case COP_AND: stack[sp] &= a; break;
+                    case COP_OR:  stack[sp] |= a; break;
+                    case COP_XOR: stack[sp] ^= a; break;
+                    case COP_EQ:  stack[sp] = (stack[sp] == a); break;
+                    case COP_NE:  stack[sp] = (stack[sp] != a); break;
+                    case COP_LT:  stack[sp] = (stack[sp] < a); break;
+                    case COP_LE:  stack[sp] = (stack[sp] <= a); break;
+                    case COP_GT:  stack[sp] = (stack[sp] > a); break;
+                    case COP_GE:  stack[sp] = (stack[sp] >= a); break;
+                }
+        }
+    }
+    return stack[0] != 0;
+}
 
+// Reports that a command in a breakpoint's list would clear the history
+static void report_history_edit(const command_t *cmd) {
+    sim_error("\"%s\" cannot run from a breakpoint while history is on "
+              "(it would clear the history).", cmd->command);
+}
+
+/*
+ * Checks a command list for a breakpoint, returning -1 (after reporting
+ * why) if a command cannot run from a breakpoint.  Sets *resume if the
+ * list ends with "continue".
+ */
+static int check_bpt_commands(const char *list, bool *resume) {
+    const command_t *cmd;
+    const char *p = list, *end;
+    int len;
+
+    *resume = false;
+    for (; *p != '\0'; p = (*end == ';' ? end + 1 : end)) {
+        p += strspn(p, " \t");
+        end = p + strcspn(p, ";");
+        len = strcspn(p, " \t;");
+        if (len == 0)
+            continue;
+        if ((cmd = find_command(p, len)) == NULL) {
+            sim_error("Unknown command \"%.*s\" in the list.", len, p);
+            return -1;
+        }
+        if (cmd->cmd_func == cmd_continue && end[strspn(end, " \t;")] ==
+                                            '\0')
+            *resume = true;
+        else if (cmd->flags & CMD_FLAG_RUNS_LC3) {
+            sim_error("\"%s\" cannot run from a breakpoint (\"continue\" "
+                      "can only end the list).", cmd->command);
+            return -1;
+        } else if ((cmd->flags & CMD_FLAG_EDITS) && history != NULL) {
+            report_history_edit(cmd);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Runs the commands of the breakpoint at addr, in the middle of a run,
+ * returning whether the LC-3 should carry on running.  If history was
+ * turned on after the list was set, the LC-3 stops at the first command
+ * that would clear it, so the history is kept.
+ */
+static bool run_bpt_commands(int addr) {
+    char list[BPT_MAX_COMMANDS + 1], *p, *end;
+    const command_t *cmd;
+    bool resume = bpt_conds[addr]->resume;
+    int len;
+
+    /* A command may change the list (or remove the breakpoint). */
+    strcpy(list, bpt_conds[addr]->commands);
+    for (p = list; *p != '\0'; p = end) {
+        p += strspn(p, " \t");
+        end = p + strcspn(p, ";");
+        if (*end == ';')
+            *end++ = '\0';
+        len = strcspn(p, " \t");
+        if (len == 0 || (cmd = find_command(p, len)) == NULL ||
+            (cmd->flags & CMD_FLAG_RUNS_LC3))
+            continue;
+        if ((cmd->flags & CMD_FLAG_EDITS) && history != NULL) {
+            report_history_edit(cmd);
+            return false;
+        }
+        PROBE2(command, cmd->command, p + len + strspn(p + len, " \t"));
+        (*cmd->cmd_func)(p + len + strspn(p + len, " \t"));
+        PROBE1(command_done, cmd->command);
+    }
+    return resume;
+}
+
+// Whether the breakpoint at addr (which has a condition) stops the LC-3
+static bool breakpoint_fires(int addr) {
+    bpt_cond_t *c = bpt_conds[addr];
+
+    if (!condition_holds(addr) || ++c->hits <= c->ignore)
+        return false;
+    if (c->commands != NULL && run_bpt_commands(addr))
+        return false;
+    return true;
+}
+
+// Whether a user breakpoint at addr would stop the LC-3 now
+static bool breakpoint_stops_at(int addr) {
+    return lc3_breakpoints[addr] == BPT_USER && condition_holds(addr);
+}
+
+/* A condition being compiled, and the rest of its text. */
+typedef struct cond_parser_t cond_parser_t;
+struct cond_parser_t {
+    const char *p;
+    short code[COND_MAX_CODE];
+    int len, depth, max_depth;
+    bool failed;
+};
+
+static void compile_or(cond_parser_t *cp);
+
+// Appends a word of code; ops change the depth of the stack by delta
+static void cond_emit(cond_parser_t *cp, int word, int delta) {
+    if (cp->len == COND_MAX_CODE) {
+        cp->failed = true;
+        return;
+    }
+    cp->code[cp->len++] = word;
+    cp->depth += delta;
+    if (cp->depth > cp->max_depth)
+        cp->max_depth = cp->depth;
+}
+
+// Consumes the operator op (after any spaces) if it comes next
+static bool cond_accept(cond_parser_t *cp, const char *op) {
+    size_t len = strlen(op);
+
+    /* Leave the text where the first error was found. */
+    if (cp->failed)
+        return false;
+    while (isspace(*cp->p))
+        cp->p++;
+    if (strncmp(cp->p, op, len) != 0)
+        return false;
+    /* Keep "<" from matching the start of "<=", and so on. */
+    if (len == 1 && strchr("<>=!&|", op[0]) != NULL &&
+        (cp->p[1] == '=' || (op[0] != '!' && cp->p[1] == op[0])))
+        return false;
+    cp->p += len;
+    return true;
+}
+
+// Compiles a register, M[...], number, label, or parenthesized condition
+static void compile_operand(cond_parser_t *cp) {
+    static const char * const rname[] = {
+        "R0", "R1", "R2", "R3", "R4", "R5", "R6", "R7", "PC", "IR", "PSR"
+    };
+    char word[MAX_LABEL_LEN];
+    size_t len;
+    int value;
+
+    if (cond_accept(cp, "(")) {
+        compile_or(cp);
+        if (!cond_accept(cp, ")"))
+            cp->failed = true;
+        return;
+    }
+    if (cond_accept(cp, "-")) {
+        compile_operand(cp);
+        cond_emit(cp, COP_NEG, 0);
+        return;
+    }
+    if (cond_accept(cp, "!")) {
+        compile_operand(cp);
+        cond_emit(cp, COP_NOT, 0);
+        return;
+    }
+    if (cond_accept(cp, "~")) {
+        compile_operand(cp);
+        cond_emit(cp, COP_INVERT, 0);
+        return;
+    }
+    len = (*cp->p == '#' && cp->p[1] == '-' ? 2 : *cp->p == '#');
+    len += strspn(cp->p + len, "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnop"
+                               "qrstuvwxyz0123456789_");
+    if (len == 0 || len >= sizeof(word)) {
+        cp->failed = true;
+        return;
+    }
+    memcpy(word, cp->p, len);
+    word[len] = '\0';
+    cp->p += len;
+    if (strcasecmp(word, "M") == 0 && cond_accept(cp, "[")) {
+        compile_or(cp);
+        if (!cond_accept(cp, "]"))
+            cp->failed = true;
+        cond_emit(cp, COP_LOAD, 0);
+        return;
+    }
+    for (int i = 0; i < NUM_REGS; i++) {
+        if (strcasecmp(word, rname[i]) == 0) {
+            cond_emit(cp, COP_REG, 1);
+            cond_emit(cp, i, 0);
+            return;
+        }
+    }
+    if ((value = parse_address(word)) == -1) {
+        cp->p -= len;
+        cp->failed = true;
+        return;
+    }
+    cond_emit(cp, COP_CONST, 1);
+    cond_emit(cp, cond_word(value), 0);
+}
+
+// Compiles operands joined by + - & | ^ (left to right, all one level)
+static void compile_sum(cond_parser_t *cp) {
+    static const struct {const char *op; cond_op_t code;} ops[] = {
+        {"+", COP_ADD}, {"-", COP_SUB}, {"&", COP_AND}, {"|", COP_OR},
+        {"^", COP_XOR}
+    };
+    bool more = true;
+
+    compile_operand(cp);
+    while (more && !cp->failed) {
+        more = false;
+        for (size_t i = 0; i < sizeof(ops) / sizeof(ops[0]); i++) {
+            if (cond_accept(cp, ops[i].op)) {
+                compile_operand(cp);
+                cond_emit(cp, ops[i].code, -1);
+                more = true;
+                break;
+            }
+        }
+    }
+}
+
+// Compiles a sum, or a comparison of two
+static void compile_compare(cond_parser_t *cp) {
+    static const struct {const char *op; cond_op_t code;} ops[] = {
+        {"==", COP_EQ}, {"!=", COP_NE}, {"<=", COP_LE}, {">=", COP_GE},
+        {"<", COP_LT}, {">", COP_GT}
+    };
+
+    compile_sum(cp);
+    for (size_t i = 0; i < sizeof(ops) / sizeof(ops[0]); i++) {
+        if (cond_accept(cp, ops[i].op)) {
+            compile_sum(cp);
+            cond_emit(cp, ops[i].code, -1);
+            return;
+        }
+    }
+}
+
+// Compiles comparisons joined by &&
+static void compile_and(cond_parser_t *cp) {
+    int jump;
+
+    compile_compare(cp);
+    while (!cp->failed && cond_accept(cp, "&&")) {
+        cond_emit(cp, COP_JFALSE, -1);
+        jump = cp->len;
+        cond_emit(cp, 0, 0);
+        compile_compare(cp);
+        cond_emit(cp, COP_BOOL, 0);
+        if (!cp->failed)
+            cp->code[jump] = cp->len;
+    }
+}
+
+// Compiles conditions joined by ||
+static void compile_or(cond_parser_t *cp) {
+    int jump;
+
+    compile_and(cp);
+    while (!cp->failed && cond_accept(cp, "||")) {
+        cond_emit(cp, COP_JTRUE, -1);
+        jump = cp->len;
+        cond_emit(cp, 0, 0);
+        compile_and(cp);
+        cond_emit(cp, COP_BOOL, 0);
+        if (!cp->failed)
+            cp->code[jump] = cp->len;
+    }
+}
+
+/*
+ * Compiles a breakpoint condition ("" for none) that skips the first
+ * ignore hits, returning NULL (after reporting why) if it is not valid.
+ */
+static bpt_cond_t * compile_condition(const char *text,
+                                      unsigned long long ignore) {
+    cond_parser_t cp = {.p = text};
+    bpt_cond_t *c;
+
+    while (isspace(*cp.p))
+        cp.p++;
+    if (*cp.p != '\0') {
+        compile_or(&cp);
+        while (isspace(*cp.p))
+            cp.p++;
+        if (cp.failed || *cp.p != '\0') {
+            sim_error("Could not understand the condition at \"%.40s\".",
+                      (*cp.p != '\0' ? cp.p : "(end)"));
+            return NULL;
+        }
+        if (cp.max_depth > COND_MAX_STACK) {
+            sim_error("That condition is too complicated.");
+            return NULL;
+        }
+    }
+    if ((c = malloc(sizeof(*c) + strlen(text) + 1)) == NULL) {
+        sim_error("Out of memory.");
+        return NULL;
+    }
+    c->hits = 0;
+    c->ignore = ignore;
+    c->commands = NULL;
+    c->resume = false;
+    c->len = cp.len;
+    memcpy(c->code, cp.code, sizeof(cp.code));
+    strcpy(c->text, text + strspn(text, " \t"));
+    return c;
+}
+
+// Watchpoints
+
+
+// Notes an access to a watched page, stopping the run if it is watched
+static void watch_access(int addr, int kind, int value) {
+    int old = lc3_memory[addr];
+
+    if (!watch_live || watch_hit)
+        return;
+    if (kind == WATCH_WRITE && (watch_flags[addr] & WATCH_WRITE) == 0) {
+        /* Change watchpoints ignore stores of the value already there. */
+        if ((watch_flags[addr] & WATCH_CHANGE) == 0 || value == old)
+            return;
+        kind = WATCH_CHANGE;
+    } else if ((watch_flags[addr] & kind) == 0)
+        return;
+    /* Stop after this instruction; reported by report_watch. */
+    watch_hit = true;
+    watch_kind = kind;
+    watch_pc = (REG(R_PC) - 1) & 0xFFFF;
+    watch_addr = addr;
+    watch_old = old;
+    watch_new = value;
+    should_halt = true;
+}
+
+// Fetches an instruction from a page with read watchpoints
+static int fetch_watched(int addr) {
+    bool live = watch_live;
+    int value;
+
+    watch_live = false;
+    value = read_memory(addr);
+    watch_live = live;
+    return value;
+}
+
+// Recomputes the page summaries for the pages holding start to end - 1
+static void update_watch_pages(int start, int end) {
+    for (int page = start >> 8; page <= (end - 1) >> 8; page++) {
+        watch_pages[page] = 0;
+        for (int i = page << 8; i < (page + 1) << 8; i++)
+            watch_pages[page] |= watch_flags[i];
+    }
+}
+
+// Adds kind to the watchpoints on start to end - 1 (no wrapping)
+static void set_watches(int start, int end, int kind) {
+    for (int i = start; i < end; i++)
+        watch_flags[i] |= kind;
+    update_watch_pages(start, end);
+}
+
+// Removes the watchpoints on start to end - 1 (no wrapping)
+static void clear_watches(int start, int end) {
+    memset(watch_flags + start, 0, end - start);
+    update_watch_pages(start, end);
+}
+
+// Names the kinds of watchpoint in flags, as in "read write"
+static const char * watch_kinds(int flags) {
+    static char buf[20];
+
+    snprintf(buf, sizeof(buf), "%s%s%s",
+             (flags & WATCH_READ ? " read" : ""),
+             (flags & WATCH_WRITE ? " write" : ""),
+             (flags & WATCH_CHANGE ? " change" : ""));
+    return buf + 1;
+}
+
+// Prints the watchpoints, one line per run of addresses watched alike
+static void list_watches(void) {
+    bool found = false;
+    int start, i;
+
+    for (i = 0; i < 65536; i = start + 1) {
+        if (watch_pages[i >> 8] == 0) {
+            start = i | 0xFF;
+            continue;
+        }
+        for (start = i; start < 65535 && watch_flags[start + 1] ==
+                                         watch_flags[i]; start++)
+            ;
+        if (watch_flags[i] == 0)
+            continue;
+        if (!found) {
+            sim_printf("The following addresses are watched:\n");
+            found = true;
+        }
+        if (start == i)
+            sim_printf("  x%04X        %s\n", i, watch_kinds(watch_flags[i]));
+        else
+            sim_printf("  x%04X-x%04X  %s\n", i, start,
+                       watch_kinds(watch_flags[i]));
+    }
+    if (!found)
+        sim_printf("No watchpoints are set.\n");
+}
+
+// Reports the watchpoint that stopped the last run, if any
+static void report_watch(void) {
+    if (!watch_hit)
+        return;
+    watch_hit = false;
+    stop_reason = STOP_WATCH;
+    if (watch_kind == WATCH_READ)
+        sim_error("\nWatchpoint: the instruction at x%04X read x%04X from "
+                  "x%04X.", watch_pc, watch_new, watch_addr);
+    else
+        sim_error("\nWatchpoint: the instruction at x%04X wrote x%04X to "
+                  "x%04X (was x%04X).", watch_pc, watch_new, watch_addr,
+                  watch_old);
+}
+
+
+// Profiling
+
+
+// Starts a new profile rooted at the PC
+static void reset_profile(void) {
+    memset(prof_counts, 0, sizeof(prof_counts));
+    prof_nodes[0] = (prof_node_t){REG(R_PC), 0, -1, -1, -1, 0, 0};
+    prof_num_nodes = 1;
+    prof_cur = 0;
+    prof_lost = 0;
+}
+
+// Enters the routine at entry from the current calling context
+static void profile_call(int entry) {
+    prof_node_t *cur = &prof_nodes[prof_cur];
+    int *link = &cur->child, n;
+
+    /* Children are kept in the order of their first call. */
+    for (n = *link; n != -1; n = *(link = &prof_nodes[n].sibling))
+        if (prof_nodes[n].entry == entry)
+            break;
+    if (n == -1) {
+        /* Too deep or too many: charge the callee to its caller. */
+        if (prof_num_nodes == PROFILE_MAX_NODES ||
+            cur->depth == PROFILE_MAX_DEPTH) {
+            prof_lost++;
+            return;
+        }
+        n = *link = prof_num_nodes++;
+        prof_nodes[n] = (prof_node_t){entry, cur->depth + 1, prof_cur, -1,
+                                      -1, 0, 0};
+    }
+    prof_nodes[n].calls++;
+    prof_cur = n;
+}
+
+// Counts an instruction executed at addr (called only when profiling)
+static void profile_instruction(int addr) {
+    prof_counts[addr]++;
+    prof_nodes[prof_cur].self++;
+    if ((last_flags & FLG_SUBROUTINE) != 0)
+        profile_call(REG(R_PC));
+    else if ((last_flags & FLG_RETURN) != 0) {
+        if (prof_lost > 0)
+            prof_lost--;
+        else if (prof_nodes[prof_cur].parent != -1)
+            prof_cur = prof_nodes[prof_cur].parent;
+    }
+}
+
+// Label of an address, or the address in hex
+static const char * routine_name(int addr, char *buf) {
+    if (lc3_sym_names[addr] != NULL)
+        return lc3_sym_names[addr]->name;
+    sprintf(buf, "x%04X", addr);
+    return buf;
+}
+
+// Fills in the instructions run in each node and everything it called
+static void profile_totals(unsigned long long *total) {
+    for (int n = 0; n < prof_num_nodes; n++)
+        total[n] = prof_nodes[n].self;
+    /* Children always come after their parents. */
+    for (int n = prof_num_nodes - 1; n > 0; n--)
+        total[prof_nodes[n].parent] += total[n];
+}
+
+// Lists instructions in a range with their execution counts
+static void profile_list(int addr_s, int addr_e) {
+    do {
+        if (prof_counts[addr_s] > 0)
+            sim_printf("%12llu", prof_counts[addr_s]);
+        else
+            sim_printf("%12s", "");
+        disassemble_one(addr_s);
+        addr_s = (addr_s + 1) & 0xFFFF;
+    } while (addr_s != addr_e);
+}
+
+// Orders labels by decreasing instruction count
+static int compare_label_totals(const void *a, const void *b) {
+    unsigned long long ta = ((const label_total_t *)a)->insns;
+    unsigned long long tb = ((const label_total_t *)b)->insns;
+
+    return (ta < tb) - (ta > tb);
+}
+
+// Prints instruction counts summed from each label to the next
+static void profile_labels(int max_lines) {
+    static label_total_t labels[65536];
+    label_total_t *label = NULL;
+    unsigned long long all = 0, unlabeled = 0;
+    int num_labels = 0, used = 0;
+
+    for (int addr = 0; addr < 65536; addr++) {
+        if (lc3_sym_names[addr] != NULL) {
+            label = &labels[num_labels++];
+            label->addr = addr;
+            label->insns = 0;
+        }
+        all += prof_counts[addr];
+        if (label == NULL)
+            unlabeled += prof_counts[addr];
+        else
+            label->insns += prof_counts[addr];
+    }
+    if (all == 0) {
+        sim_printf("No instructions have been profiled.\n");
+        return;
+    }
+    qsort(labels, num_labels, sizeof(labels[0]), compare_label_totals);
+    while (used < num_labels && labels[used].insns > 0)
+        used++;
+
+    sim_printf("%12s %7s  label\n", "insns", "share");
+    for (int i = 0; i < used && i < max_lines; i++)
+        sim_printf("%12llu %6.2f%%  %s (x%04X)\n", labels[i].insns,
+                   labels[i].insns * 100.0 / all,
+                   lc3_sym_names[labels[i].addr]->name, labels[i].addr);
+    if (used > max_lines)
+        sim_printf("(%d more labels)\n", used - max_lines);
+    if (unlabeled > 0)
+        sim_printf("%12llu %6.2f%%  (before the first label)\n", unlabeled,
+                   unlabeled * 100.0 / all);
+}
+
+// Prints the calling context tree below node n
+static void profile_calls(int n, const unsigned long long *total) {
+    char buf[8];
+
+    sim_printf("%10llu %12llu %12llu  %*s%s\n", prof_nodes[n].calls,
+               prof_nodes[n].self, total[n], 2 * prof_nodes[n].depth, "",
+               routine_name(prof_nodes[n].entry, buf));
+    for (int c = prof_nodes[n].child; c != -1; c = prof_nodes[c].sibling)
+        profile_calls(c, total);
+}
+
+// Writes one line per calling context, in the folded format of flame graphs
+static int profile_folded(const char *name) {
+    static int path[PROFILE_MAX_DEPTH + 1];
+    char buf[8];
+    FILE *f;
+    int depth;
+
+    if ((f = fopen(name, "w")) == NULL)
+        return -1;
+    for (int n = 0; n < prof_num_nodes; n++) {
+        if (prof_nodes[n].self == 0)
+            continue;
+        depth = 0;
+        for (int p = n; p != -1; p = prof_nodes[p].parent)
+            path[depth++] = prof_nodes[p].entry;
+        while (depth-- > 0)
+            fprintf(f, "%s%c", routine_name(path[depth], buf),
+                    (depth > 0 ? ';' : ' '));
+        fprintf(f, "%llu\n", prof_nodes[n].self);
+    }
+    return fclose(f);
+}
+
+
+// Coverage
+
+
+#define COV_TEST(set, addr) (((set)[(addr) >> 6] >> ((addr) & 63)) & 1)
+#define COV_OTHER     0
+#define COV_NOT_TAKEN 1
+#define COV_TAKEN     2
+#define COV_RAN(addr) (COV_TEST(cov_sets[COV_OTHER], addr) |     \
+                       COV_TEST(cov_sets[COV_NOT_TAKEN], addr) | \
+                       COV_TEST(cov_sets[COV_TAKEN], addr))
+
+// Whether an instruction is a BR that can go either way
+static bool is_conditional_branch(int inst) {
+    return (inst & 0xF000) == 0 && F_CC(inst) != 0 && F_CC(inst) != 0x0E00;
+}
+
+/*
+ * Marks an instruction executed at addr (called only when covering).
+ * This runs for every instruction, so it sets exactly one bit: a BR's
+ * bit says which way it went, and also that it ran.  The reports skip
+ * the BRs that cannot go both ways.
+ */
+static inline void cover_instruction(int addr) {
+    int ir = REG(R_IR), set = COV_OTHER;
+
+    if ((ir & 0xF000) == 0)
+        set = ((REG(R_PSR) & F_CC(ir)) != 0 ? COV_TAKEN : COV_NOT_TAKEN);
+    cov_sets[set][addr >> 6] |= 1ULL << (addr & 63);
+}
+
+// Number of bits set in a bitset over LC-3 memory
+static int count_bits(const uint64_t *set) {
+    int n = 0;
+
+    for (int i = 0; i < 1024; i++)
+        n += __builtin_popcountll(set[i]);
+    return n;
+}
+
+// Number of addresses executed
+static int count_executed(void) {
+    int n = 0;
+
+    for (int i = 0; i < 1024; i++)
+        n += __builtin_popcountll(cov_sets[COV_OTHER][i] |
+                                  cov_sets[COV_NOT_TAKEN][i] |
+                                  cov_sets[COV_TAKEN][i]);
+    return n;
+}
+
+// Orders a file's instructions by source line
+static int compare_src_lines(const void *a, const void *b) {
+    int la = lc3_src_line[*(const int *)a];
+    int lb = lc3_src_line[*(const int *)b];
+
+    return (la > lb) - (la < lb);
+}
+
+// Writes a BRDA record for one direction of a branch
+static void write_lcov_branch(FILE *f, int line, int dir, int addr,
+                              const uint64_t *taken) {
+    if (!COV_RAN(addr))
+        fprintf(f, "BRDA:%d,0,%d,-\n", line, dir);
+    else
+        fprintf(f, "BRDA:%d,0,%d,%d\n", line, dir,
+                (int)COV_TEST(taken, addr));
+}
+
+/*
+ * Writes the coverage of every source file with a line table as an lcov
+ * tracefile.  Counts are 0 or 1, since only whether an instruction ran
+ * is kept.
+ */
+static int write_lcov(const char *name) {
+    static int addrs[65536];
+    int num, lines, lines_hit, branches, branches_hit, addr;
+    FILE *f;
+
+    if ((f = fopen(name, "w")) == NULL)
+        return -1;
+    for (int file = 1; file <= num_src_names; file++) {
+        num = 0;
+        for (addr = 0; addr < 65536; addr++)
+            if (lc3_src_file[addr] == file)
+                addrs[num++] = addr;
+        if (num == 0)
+            continue;
+        qsort(addrs, num, sizeof(addrs[0]), compare_src_lines);
+
+        fprintf(f, "TN:\nSF:%s\n", src_names[file]);
+        branches = branches_hit = 0;
+        for (int i = 0; i < num; i++) {
+            addr = addrs[i];
+            if (!is_conditional_branch(lc3_memory[addr]))
+                continue;
+            write_lcov_branch(f, lc3_src_line[addr], 0, addr,
+                              cov_sets[COV_TAKEN]);
+            write_lcov_branch(f, lc3_src_line[addr], 1, addr,
+                              cov_sets[COV_NOT_TAKEN]);
+            branches += 2;
+            branches_hit += COV_TEST(cov_sets[COV_TAKEN], addr) +
+                            COV_TEST(cov_sets[COV_NOT_TAKEN], addr);
+        }
+        fprintf(f, "BRF:%d\nBRH:%d\n", branches, branches_hit);
+        lines = lines_hit = 0;
+        for (int i = 0; i < num; i++) {
+            addr = addrs[i];
+            /* One record per line, hit if any of its words ran. */
+            if (i + 1 < num && lc3_src_line[addrs[i + 1]] ==
+                               lc3_src_line[addr]) {
+                if (COV_RAN(addr))
+                    addrs[i + 1] = addr;
+                continue;
+            }
+            fprintf(f, "DA:%d,%d\n", lc3_src_line[addr],
+                    (int)COV_RAN(addr));
+            lines++;
+            lines_hit += COV_RAN(addr);
+        }
+        fprintf(f, "LF:%d\nLH:%d\nend_of_record\n", lines, lines_hit);
+    }
+    return fclose(f);
+}
+
+// Prints how much has been covered
+static void print_coverage(void) {
+    int branches = 0, taken = 0, lines = 0, lines_hit = 0;
+
+    for (int addr = 0; addr < 65536; addr++) {
+        if (COV_RAN(addr) && is_conditional_branch(lc3_memory[addr])) {
+            branches++;
+            taken += COV_TEST(cov_sets[COV_TAKEN], addr) +
+                     COV_TEST(cov_sets[COV_NOT_TAKEN], addr);
+        }
+        if (lc3_src_file[addr] != 0) {
+            lines++;
+            lines_hit += COV_RAN(addr);
+        }
+    }
+    sim_printf("Coverage is %s.\n", (covering ? "on" : "off"));
+    sim_printf("%d addresses executed; %d of %d directions taken by %d "
+               "conditional branches.\n", count_executed(),
+               taken, 2 * branches, branches);
+    if (lines > 0)
+        sim_printf("%d of %d instructions with source lines executed.\n",
+                   lines_hit, lines);
+}
+
+// Writes the lcov tracefile named by --coverage when the simulator exits
+static void write_lcov_at_exit(void) {
+    if (write_lcov(lcov_at_exit) == -1)
+        perror(lcov_at_exit);
+}
+
+
+// Sanitizer
+
+
+// Describes where an address is relative to a label shortly before it
+static const char * describe_location(int addr, char *buf) {
+    int label = addr;
+
+    while (lc3_sym_names[label] == NULL && label > 0 && addr - label < 256)
+        label--;
+    if (lc3_sym_names[label] == NULL)
+        buf[0] = '\0';
+    else if (label == addr)
+        sprintf(buf, "%s", lc3_sym_names[label]->name);
+    else
+        sprintf(buf, "%s+%d", lc3_sym_names[label]->name, addr - label);
+    return buf;
+}
+
+// Reports a problem with the instruction at san_pc, once per target
+static void sanitizer_report(san_kind_t kind, int target) {
+    static const char * const what[NUM_SAN_KINDS] = {
+        "read of never-written memory", "store into code",
+        "store into the OS and vector area"
+    };
+    uint64_t bit = 1ULL << (target & 63);
+    char where[MAX_LABEL_LEN + 8];
+
+    san_counts[kind]++;
+    if ((san_reported[kind][target >> 6] & bit) != 0)
+        return;
+    san_reported[kind][target >> 6] |= bit;
+
+    describe_location(san_pc, where);
+    if (json_mode) {
+        begin_record("sanitizer");
+        json_string("kind", san_names[kind]);
+        json_number("addr", target);
+        json_number("pc", san_pc);
+        json_string("label", where);
+        json_end();
+    } else if (!gui_mode)
+        sim_printf("\nSanitizer: %s at x%04X by the instruction at x%04X%s%s"
+                   "%s.\n", what[kind], target, san_pc,
+                   (where[0] != '\0' ? " (" : ""), where,
+                   (where[0] != '\0' ? ")" : ""));
+}
+
+// Finishes checking an instruction that executed at addr
+static void sanitize_instruction(int addr) {
+    int inst = REG(R_IR), base;
+
+    san_fetched[addr >> 6] |= 1ULL << (addr & 63);
+    /* Loads and stores through R6 are taken as stack accesses. */
+    if (((inst >> 12) == 0x6 || (inst >> 12) == 0x7) && F_SR1(inst) == 6) {
+        base = REG(R_R6);
+        if (san_stack_lo == -1 || base < san_stack_lo)
+            san_stack_lo = base;
+        if (base > san_stack_hi)
+            san_stack_hi = base;
+    }
+    san_pc = -1;
+}
+
+// Prints what the sanitizer has found
+static void print_sanitizer(void) {
+    static const char * const what[NUM_SAN_KINDS] = {
+        "reads of never-written memory", "stores into code",
+        "stores into the OS and vector area"
+    };
+
+    if (json_mode) {
+        begin_record("sanitize");
+        json_bool("on", sanitizing);
+        for (int k = 0; k < NUM_SAN_KINDS; k++)
+            json_number(san_names[k], san_counts[k]);
+        if (san_stack_lo != -1) {
+            json_number("stack_lo", san_stack_lo);
+            json_number("stack_hi", san_stack_hi);
+        }
+        json_end();
+        return;
+    }
+    sim_printf("The sanitizer is %s.\n", (sanitizing ? "on" : "off"));
+    for (int k = 0; k < NUM_SAN_KINDS; k++)
+        sim_printf("%12llu %s (at %d address%s)\n", san_counts[k], what[k],
+                   count_bits(san_reported[k]),
+                   (count_bits(san_reported[k]) == 1 ? "" : "es"));
+    if (san_stack_lo != -1)
+        sim_printf("Stack accesses through R6 ranged from x%04X to "
+                   "x%04X.\n", san_stack_lo, san_stack_hi);
+}
+
+
+// Tracing
+
+
+// Writes out the trace records buffered so far
+static void trace_flush(void) {
+    if (trace_len > 0 && fwrite(trace_buf, 1, trace_len, trace_file)
+                         != trace_len && !trace_failed) {
+        sim_error("Could not write the trace.");
+        trace_failed = true;
+    }
+    trace_len = 0;
+}
+
+// Starts tracing to a new file
+static int trace_open(const char *file) {
+    FILE *f;
+
+    if ((f = fopen(file, "wb")) == NULL)
+        return -1;
+    if (trace_file != NULL)
+        trace_close();
+    trace_file = f;
+    trace_failed = false;
+    /* Every PC and IR is written in full the first time. */
+    memset(trace_ir, 0xFF, sizeof(trace_ir));
+    trace_next_pc = -1;
+    trace_last_addr = 0;
+    memcpy(trace_buf, TRACE_MAGIC, strlen(TRACE_MAGIC));
+    trace_len = strlen(TRACE_MAGIC);
+    return 0;
+}
+
+// Finishes the trace file, if any
+static void trace_close(void) {
+    if (trace_file == NULL)
+        return;
+    trace_flush();
+    if (fclose(trace_file) != 0 && !trace_failed)
+        sim_error("Could not write the trace.");
+    trace_file = NULL;
+}
+
+/*
+ * The data address that the instruction inst at addr is about to use
+ * (see trace_access()), or 0 if it uses none.  LDI and STI only know
+ * theirs before they run.
+ */
+static int data_address(int addr, int inst) {
+    int next = (addr + 1) & 0xFFFF;
+
+    switch (inst >> 12) {
+        case 0x2: case 0x3:  /* LD, ST */
+            return (next + F_imm9(inst)) & 0xFFFF;
+        case 0xA: case 0xB:  /* LDI, STI */
+            return lc3_memory[(next + F_imm9(inst)) & 0xFFFF];
+        case 0x6: case 0x7:  /* LDR, STR */
+            return (REG(F_SR1(inst)) + F_imm6(inst)) & 0xFFFF;
+        case 0xF:            /* TRAP */
+            return F_vec8(inst);
+        default:
+            return 0;
+    }
+}
+
+// Notes the data address of the instruction just fetched from addr
+static void trace_fetch(int addr) {
+    trace_addr = data_address(addr, REG(R_IR));
+}
+
+static inline unsigned char * put_trace_word(unsigned char *p, int value) {
+    p[0] = value & 0xFF;
+    p[1] = (value >> 8) & 0xFF;
+    return p + 2;
+}
+
+// Records an instruction that executed at addr (called only when tracing)
+static void trace_instruction(int addr) {
+    int inst = REG(R_IR), dest = trace_dest(inst), flags = 0, delta;
+    trace_access_t access = trace_access(inst);
+    unsigned int zigzag;
+    unsigned char *p;
+
+    if (trace_len > TRACE_BUF_SIZE - TRACE_MAX_RECORD)
+        trace_flush();
+    p = trace_buf + trace_len + 1;
+    if (addr != trace_next_pc) {
+        flags |= TRACE_PC;
+        p = put_trace_word(p, addr);
+    }
+    if (trace_ir[addr] != inst) {
+        flags |= TRACE_IR;
+        p = put_trace_word(p, inst);
+        trace_ir[addr] = inst;
+    }
+    if (dest != -1) {
+        flags |= TRACE_REG;
+        p = put_trace_word(p, REG(dest));
+    }
+    if (access != TRACE_NONE) {
+        /* The smallest signed step to the address, zigzag-encoded. */
+        flags |= TRACE_ADDR;
+        delta = ((trace_addr - trace_last_addr + 0x8000) & 0xFFFF) - 0x8000;
+        zigzag = ((unsigned int)delta << 1) ^ (unsigned int)(delta >> 31);
+        for (; zigzag >= 0x80; zigzag >>= 7)
+            *p++ = (zigzag & 0x7F) | 0x80;
+        *p++ = zigzag;
+        trace_last_addr = trace_addr;
+        if (access == TRACE_STORE) {
+            flags |= TRACE_VALUE;
+            p = put_trace_word(p, REG(F_DR(inst)));
+        } else if (access == TRACE_VECTOR) {
+            flags |= TRACE_VALUE;
+            p = put_trace_word(p, REG(R_PC));
+        }
+    }
+    trace_buf[trace_len] = flags;
+    trace_len = p - trace_buf;
+    trace_next_pc = (addr + 1) & 0xFFFF;
+}
+
+
+// Record and replay
+
+
+static void put_varint(FILE *f, unsigned long long value) {
+    for (; value >= 0x80; value >>= 7)
+        putc((value & 0x7F) | 0x80, f);
+    putc(value, f);
+}
+
+// Reads the next replay event, ending the replay at the end of the log
+static void next_replay_event(void) {
+    int c, shift = 0;
+
+    replay_event = 0;
+    do {
+        if ((c = getc(replay_file)) == EOF || shift > 63) {
+            /* From here on, the LC-3 sees live input again. */
+            fclose(replay_file);
+            replay_file = NULL;
+            return;
+        }
+        replay_event |= (unsigned long long)(c & 0x7F) << shift;
+        shift += 7;
+    } while (c & 0x80);
+}
+
+// Ends a replay that no longer matches what the LC-3 is doing
+static void replay_diverged(void) {
+    sim_error("\nThe run no longer matches the replay log; replay ended.");
+    fclose(replay_file);
+    replay_file = NULL;
+}
+
+// Whether console input is waiting for a KBSR read
+static bool input_waiting(void) {
+    struct pollfd p;
+    bool ready;
+
+    if (unread_len > 0)
+        return true;
+    if (replay_file != NULL) {
+        if ((replay_event & 1) == 0) {
+            if (replay_event > 0) {
+                replay_event -= 2;
+                return false;
+            }
+            next_replay_event();
+            return true;
+        }
+        replay_diverged();
+    }
+    p.fd = fileno(lc3in);
+    p.events = POLLIN;
+    ready = (poll(&p, 1, 0) == 1 && (p.revents & POLLIN) != 0);
+    if (record_file != NULL) {
+        if (ready) {
+            put_varint(record_file, 2 * record_polls);
+            record_polls = 0;
+        } else
+            record_polls++;
+    }
+    return ready;
+}
+
+// Reads a byte of console input for KBDR, or -1 at the end of input
+static int read_input(void) {
+    int c;
+
+    if (unread_len > 0)
+        c = unread[--unread_len];
+    else if (replay_file != NULL && (replay_event & 1) != 0) {
+        c = (replay_event == 1 ? -1 : (int)(replay_event - 3) / 2);
+        next_replay_event();
+    } else {
+        if (replay_file != NULL)
+            replay_diverged();
+        c = fgetc(lc3in);
+        if (record_file != NULL)
+            put_varint(record_file, (c == EOF ? 1 : 2 * c + 3));
+    }
+    /* Stepping back over this read gives the byte back. */
+    if (history_len > 0 && c != EOF && !in_init) {
+        undo_t *u = &history[(history_next + history_size - 1) %
+                             history_size];
+
+        u->flags |= UNDO_INPUT;
+        u->input = c;
+    }
+    return c;
+}
+
+// Finishes the log being recorded, if any
+static void record_close(void) {
+    if (record_file != NULL && fclose(record_file) != 0)
+        sim_error("Could not write the record log.");
+    record_file = NULL;
+}
+
+// Starts logging the LC-3's nondeterministic events to a new file
+static int record_open(const char *file) {
+    unsigned char state[8];
+    FILE *f;
+
+    if ((f = fopen(file, "wb")) == NULL)
+        return -1;
+    if (record_file != NULL)
+        record_close();
+    record_file = f;
+    record_polls = 0;
+    for (int i = 0; i < 8; i++)
+        state[i] = (rng_state >> (8 * i)) & 0xFF;
+    fputs(REPLAY_MAGIC, f);
+    fwrite(state, 1, sizeof(state), f);
+    return 0;
+}
+
+// Starts replaying a log, returning -1 if it cannot be read
+static int replay_open(const char *file) {
+    unsigned char head[sizeof(REPLAY_MAGIC) - 1 + 8];
+    FILE *f;
+
+    if ((f = fopen(file, "rb")) == NULL)
+        return -1;
+    if (fread(head, sizeof(head), 1, f) != 1 ||
+        memcmp(head, REPLAY_MAGIC, sizeof(REPLAY_MAGIC) - 1) != 0) {
+        fclose(f);
+        return -1;
+    }
+    if (replay_file != NULL)
+        fclose(replay_file);
+    rng_state = 0;
+    for (int i = 7; i >= 0; i--)
+        rng_state = (rng_state << 8) | head[sizeof(REPLAY_MAGIC) - 1 + i];
+    replay_file = f;
+    next_replay_event();
+    return 0;
+}
+
+
+// Reverse execution
+
+
+// Forgets all recorded instructions
+static void forget_history(void) {
+    history_next = history_len = 0;
+    unread_len = 0;
+}
+
+// Keeps history for the last size instructions (none if 0)
+static int set_history_size(int size) {
+    undo_t *h = NULL;
+    unsigned char *u = NULL;
+
+    /* Each instruction reads at most one byte of input. */
+    if (size > 0 && ((h = malloc(size * sizeof(*h))) == NULL ||
+                     (u = malloc(size)) == NULL)) {
+        free(h);
+        return -1;
+    }
+    free(history);
+    free(unread);
+    history = h;
+    unread = u;
+    history_size = size;
+    forget_history();
+    return 0;
+}
+
+// Notes the state before the instruction at addr is fetched (called only
+// with history), so that input read by the fetch is given back too
+static void save_undo(int addr) {
+    undo_t *u = &history[history_next];
+
+    u->pc = addr;
+    u->ir = REG(R_IR);
+    u->psr = REG(R_PSR);
+    u->flags = ((last_KBSR_read ? UNDO_KBSR : 0) |
+                (last_DSR_read ? UNDO_DSR : 0));
+    if (++history_next == history_size)
+        history_next = 0;
+    if (history_len < history_size)
+        history_len++;
+}
+
+// Notes what the fetched instruction (in IR) will overwrite; undoing it
+// decodes the same IR
+static void save_undo_target(int addr) {
+    undo_t *u = &history[(history_next + history_size - 1) % history_size];
+    int dest = trace_dest(REG(R_IR));
+
+    u->reg = (dest != -1 ? REG(dest) : 0);
+    if (trace_access(REG(R_IR)) == TRACE_STORE) {
+        u->flags |= UNDO_STORE;
+        u->addr = data_address(addr, REG(R_IR));
+        u->value = lc3_memory[u->addr];
+    }
+}
+
+// Restores a word of memory, updating the GUI as write_memory does
+static void restore_word(int addr, int value) {
+    if (value == lc3_memory[addr])
+        return;
+    lc3_memory[addr] = value;
+    if (gui_mode) {
+        if (!delay_mem_update)
+            disassemble_one(addr);
+        else {
+            lc3_show_later[addr] = true;
+            have_mem_to_dump = true;
+        }
+    }
+}
+
+// Undoes the last instruction, returning false if there is none
+static bool undo_instruction(void) {
+    undo_t *u;
+    int dest = trace_dest(REG(R_IR));
+
+    if (history_len == 0)
+        return false;
+    history_next = (history_next + history_size - 1) % history_size;
+    history_len--;
+    u = &history[history_next];
+
+    if (u->flags & UNDO_STORE)
+        restore_word(u->addr, u->value);
+    if (dest != -1)
+        REG(dest) = u->reg;
+    REG(R_PSR) = u->psr;
+    REG(R_IR) = u->ir;
+    REG(R_PC) = u->pc;
+    last_KBSR_read = ((u->flags & UNDO_KBSR) != 0);
+    last_DSR_read = ((u->flags & UNDO_DSR) != 0);
+    if (u->flags & UNDO_INPUT)
+        unread[unread_len++] = u->input;
+    return true;
+}
+
+// Reports running out of history, unless the GUI is driving
+static void report_history_start(void) {
+    if (gui_mode)
+        return;
+    if (history == NULL)
+        sim_printf("No history is being kept; use \"history on\".\n");
+    else
+        sim_printf("Reached the oldest instruction in the history.\n");
+}
+
+
+// Snapshots
+
+
+/*
+ * Writes the machine to a snapshot file.  Memory and breakpoints are
+ * copied out as they are held here, so a snapshot is only for simulators
+ * built for the same kind of host.  Breakpoint conditions and commands
+ * are not saved.
+ */
+static int save_snapshot(const char *name) {
+    static snapshot_t snap;
+    symbol_t *sym;
+    FILE *f;
+    bool ok;
+
+    if ((f = fopen(name, "wb")) == NULL)
+        return -1;
+    memcpy(snap.magic, SNAPSHOT_MAGIC, sizeof(snap.magic));
+    snap.byte_order = SNAPSHOT_BYTE_ORDER;
+    snap.sym_bytes = 0;
+    for (int h = 0; h < SYMBOL_HASH; h++)
+        for (sym = lc3_sym_hash[h]; sym != NULL; sym = sym->next_with_hash)
+            snap.sym_bytes += 2 + strlen(sym->name) + 1;
+    memcpy(snap.registers, lc3_register, sizeof(snap.registers));
+    snap.last_KBSR_read = last_KBSR_read;
+    snap.last_DSR_read = last_DSR_read;
+    memcpy(snap.memory, lc3_memory, sizeof(snap.memory));
+    for (int addr = 0; addr < 65536; addr++)
+        snap.breakpoints[addr] = (lc3_breakpoints[addr] == BPT_USER);
+
+    ok = (fwrite(&snap, sizeof(snap), 1, f) == 1);
+    for (int h = 0; ok && h < SYMBOL_HASH; h++)
+        for (sym = lc3_sym_hash[h]; sym != NULL; sym = sym->next_with_hash) {
+            putc(sym->addr >> 8, f);
+            putc(sym->addr & 0xFF, f);
+            fputs(sym->name, f);
+            putc('\0', f);
+        }
+    return ((fclose(f) == 0 && ok) ? 0 : -1);
+}
+
+// Loads the symbols stored after a snapshot, replacing the current ones
+static void restore_symbols(const unsigned char *p, const unsigned char *end) {
+    size_t len;
+
+    memset(lc3_sym_names, 0, sizeof(lc3_sym_names));
+    memset(lc3_sym_hash, 0, sizeof(lc3_sym_hash));
+    memset(lc3_src_file, 0, sizeof(lc3_src_file));
+    dis_sym_gen++;
+    while (end - p > 2) {
+        len = strnlen((const char *)p + 2, end - p - 2);
+        if (len == (size_t)(end - p - 2))
+            break;  /* the last name is cut short */
+        add_symbol((const char *)p + 2, (p[0] << 8) | p[1], 1);
+        p += 2 + len + 1;
+    }
+}
+
+// Counts the breakpoints with conditions or commands (which snapshots lack)
+static int count_conditions(void) {
+    int count = 0;
+
+    for (int addr = 0; addr < 65536; addr++)
+        count += (lc3_breakpoints[addr] == BPT_USER && bpt_conds[addr] != NULL);
+    return count;
+}
+
+/*
+ * Replaces the machine with a snapshot.  The file is mapped, and memory
+ * comes out of it in one pass.  Words are cut to 16 bits, as a damaged
+ * file could hold anything.  Returns -1, leaving the machine alone, if
+ * the file is not a snapshot from this kind of host.
+ */
+static int restore_snapshot(const char *name) {
+    const snapshot_t *snap;
+    struct stat st;
+    void *map;
+    FILE *f;
+
+    if ((f = fopen(name, "rb")) == NULL)
+        return -1;
+    if (fstat(fileno(f), &st) != 0 || st.st_size < (off_t)sizeof(*snap) ||
+        (map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(f),
+                    0)) == MAP_FAILED) {
+        fclose(f);
+        return -1;
+    }
+    fclose(f);
+    snap = map;
+    if (memcmp(snap->magic, SNAPSHOT_MAGIC, sizeof(snap->magic)) != 0 ||
+        snap->byte_order != SNAPSHOT_BYTE_ORDER ||
+        snap->sym_bytes != st.st_size - sizeof(*snap)) {
+        munmap(map, st.st_size);
+        return -1;
+    }
+
+    if (gui_mode) {
+        for (int addr = 0; addr < 65536; addr++) {
+            restore_word(addr, snap->memory[addr] & 0xFFFF);
+            if (snap->breakpoints[addr] &&
+                lc3_breakpoints[addr] != BPT_USER)
+                set_breakpoint(addr, NULL);
+            else if (!snap->breakpoints[addr] &&
+                     lc3_breakpoints[addr] == BPT_USER)
+                clear_breakpoint(addr);
+            /* Kept breakpoints lose their conditions, as below. */
+            clear_condition(addr);
+        }
+    } else {
+        for (int addr = 0; addr < 65536; addr++)
+            lc3_memory[addr] = snap->memory[addr] & 0xFFFF;
+        clear_all_breakpoints();
+        for (int addr = 0; addr < 65536; addr++)
+            lc3_breakpoints[addr] = (snap->breakpoints[addr] ? BPT_USER
+                                                             : BPT_NONE);
+    }
+    for (int r = 0; r < NUM_REGS; r++)
+        lc3_register[r] = snap->registers[r] & 0xFFFF;
+    last_KBSR_read = (snap->last_KBSR_read != 0);
+    last_DSR_read = (snap->last_DSR_read != 0);
+    restore_symbols((const unsigned char *)(snap + 1),
+                    (const unsigned char *)map + st.st_size);
+    munmap(map, st.st_size);
+
+    /* Everything restored counts as written, as for a load. */
+    memset(san_written, 0xFF, sizeof(san_written));
+    forget_history();
+    return 0;
+}
+
+
+// Program loops
+
+
+// Builds the trie of command name prefixes
+static void build_cmd_trie(void) {
+    const char *name;
+    int cmd, len, node, c;
+
+    memset(cmd_trie, 0, sizeof(cmd_trie));
+    cmd_trie[0].match[0] = cmd_trie[0].match[1] = -1;
+    cmd_trie_len = 1;
+    for (cmd = 0; (name = command[cmd].command) != NULL; cmd++) {
+        for (node = 0, len = 1; name[len - 1] != '\0'; len++) {
+            c = name[len - 1] - 'a';
+            if (cmd_trie[node].next[c] == 0) {
+                cmd_trie[cmd_trie_len].match[0] = -1;
+                cmd_trie[cmd_trie_len].match[1] = -1;
+                cmd_trie[node].next[c] = cmd_trie_len++;
+            }
+            node = cmd_trie[node].next[c];
+            if (len < command[cmd].min_len)
+                continue;
+            /* Earlier commands win, as with the old linear search. */
+            if (cmd_trie[node].match[1] == -1)
+                cmd_trie[node].match[1] = cmd;
+            if (cmd_trie[node].match[0] == -1 &&
+                (command[cmd].flags & CMD_FLAG_GUI_ONLY) == 0)
+                cmd_trie[node].match[0] = cmd;
+        }
+    }
+}
+
+// Finds the command selected by a (possibly abbreviated) command word
+static const command_t * find_command(const char *word, int len) {
+    int node = 0, c, i;
+
+    if (cmd_trie_len == 0)
+        build_cmd_trie();
+    for (i = 0; i < len; i++) {
+        c = tolower(word[i]);
+        if (c < 'a' || c > 'z' || (node = cmd_trie[node].next[c - 'a']) == 0)
+            return NULL;
+    }
+    if (len == 0 || (i = cmd_trie[node].match[gui_mode ? 1 : 0]) == -1)
+        return NULL;
+    return &command[i];
+}
+
+// Executes one command line, or repeats the last command for an empty one
+static void do_command(const char *line, repeat_t *repeat) {
+    const command_t *a_command;
+    const char *source = line, *start, *args;
+    char *last = repeat->line, *next = NULL;
+    int cword_len;
+
+    /* Skip white space. */
+    for (start = line; isspace(*start); start++);
+    if (*start == '\0') {
+        /* An empty line repeats the last command, if allowed. */
+        if (last == NULL) {
+            end_response("");
+            return;
+        }
+        source = last;
+        for (start = source; isspace(*start); start++);
+    }
+    /* The last line is freed once the command has run. */
+    repeat->line = NULL;
+
+    /* Find the command word (at most MAX_CMD_WORD_LEN - 1 characters),
+       then point to arguments. */
+    for (cword_len = 0; start[cword_len] != '\0' &&
+         !isspace(start[cword_len]) && cword_len < MAX_CMD_WORD_LEN - 1;
+         cword_len++);
+    for (args = start + cword_len; isspace(*args); args++);
+
+    /* Match command word to list of commands. */
+    if ((a_command = find_command(start, cword_len)) == NULL) {
+        /* No match found--complain! */
+        sim_error("Unknown command.  Type 'h' for help.");
+        end_response("?");
+        free(last);
+        return;
+    }
+
+    /* Note what an empty line should repeat (start may point into the
+       last line, so build it separately). */
+    if (a_command->flags & CMD_FLAG_LIST_TYPE) {
+        if ((next = malloc(cword_len + sizeof(" more"))) != NULL) {
+            memcpy(next, start, cword_len);
+            strcpy(next + cword_len, " more");
+        }
+    } else if ((a_command->flags & CMD_FLAG_REPEATABLE) && script_depth == 0)
+        next = strdup(source);
+
+    /* Execute the command. */
+    PROBE2(command, a_command->command, args);
+    (*a_command->cmd_func)(args);
+    PROBE1(command_done, a_command->command);
+
+    free(last);
+    repeat->line = next;
+    end_response(a_command->command);
+}
 
 // The simulator's command loop
 static void command_loop(void) {
-    int cword_len;
-    char *cmd = NULL;
-    char *start;
-    char *last_cmd = NULL;
-    char cword[MAX_CMD_WORD_LEN];
-    const command_t *a_command;
+    repeat_t repeat = {.line = NULL};
+    char *cmd;
 
     while (!stop_scripts && (cmd = lc3readline("(lc3sim) ")) != NULL) {
-        /* Skip white space. */
-        for (start = cmd; isspace(*start); start++);
-        if (*start == '\0') {
-            /* An empty line repeats the last command, if allowed. */
-            free(cmd);
-            if ((cmd = last_cmd) == NULL)
-                continue;
-            /* Skip white space. */
-            for (start = cmd; isspace(*start); start++);
-        } else if (last_cmd != NULL)
-            free(last_cmd);
-        last_cmd = NULL;
-
-        /* Should never fail; just ignore the command if it does. */
-        /* 40 below == MAX_CMD_WORD_LEN - 1 */
-        if (sscanf(start, "%40s", cword) != 1) {
-            free(cmd);
+        do_command(cmd, &repeat);
+        free(cmd);
+    }
+    free(repeat.line);
+}
+
+/*
+ * Runs the commands of a script mapped into memory, ending each line in
+ * place.  Returns the offset of the first line not run: everything, or
+ * the point where LC-3 console input starts coming from the script file
+ * itself (option stdin off), or a final line with no newline.  The caller
+ * runs the rest through the normal command loop.
+ */
+static size_t run_mapped_script(char *text, size_t len) {
+    repeat_t repeat = {.line = NULL};
+    size_t pos = 0;
+    char *nl;
+
+    while (pos < len && !stop_scripts && script_uses_stdin) {
+        if ((nl = memchr(text + pos, '\n', len - pos)) == NULL)
             break;
-        }
+        *nl = '\0';
+        if (nl > text + pos && nl[-1] == '\r')
+            nl[-1] = '\0';
+        do_command(text + pos, &repeat);
+        pos = nl - text + 1;
+    }
+    free(repeat.line);
+    return pos;
+}
 
-        /* Record command word length, then point to arguments. */
-        cword_len = strlen(cword);
-        for (start += cword_len; isspace(*start); start++);
+// Milliseconds elapsed since start
+static long elapsed_ms(const struct timespec *start) {
+    struct timespec now;
 
-        /* Match command word to list of commands. */
-        a_command = command;
-        while (1) {
-            if (a_command->command == NULL) {
-                /* No match found--complain! */
-                free(cmd);
-                printf("Unknown command.  Type 'h' for help.\n");
-                break;
-            }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000 +
+           (now.tv_nsec - start->tv_nsec) / 1000000;
+}
 
-            /* Try to match a_command. */
-            if (strncasecmp(cword, a_command->command, cword_len) == 0 &&
-                cword_len >= a_command->min_len &&
-                (gui_mode || (a_command->flags & CMD_FLAG_GUI_ONLY) == 0)) {
+// Adds the host time of a run that began at start to the counters
+static void count_run_time(const struct timespec *start) {
+    lc3_stats.run_ns += elapsed_ns(start);
+    /* A run that stops while polling the keyboard ends that wait. */
+    if (kbsr_waits > 0) {
+        lc3_stats.wait_ns += elapsed_ns(&wait_start);
+        kbsr_waits = 0;
+    }
+}
 
-                /* Execute the command. */
-                (*a_command->cmd_func)(start);
+// Executes instructions until the LC-3 stops or a run limit is reached
+static void run_with_limits(void) {
+    unsigned long long left, chunk, n;
+    struct timespec start;
 
-                /* Handle list type and repeatable commands. */
-                if (a_command->flags & CMD_FLAG_LIST_TYPE) {
-                    char buf[MAX_CMD_WORD_LEN + 5];
+    /* Booting the OS is never limited. */
+    left = (max_insns > 0 && !in_init ? max_insns : ULLONG_MAX);
+    if (timeout_ms > 0)
+        clock_gettime(CLOCK_MONOTONIC, &start);
 
-                    strcpy(buf, cword);
-                    strcat(buf, " more");
-                    last_cmd = strdup(buf);
-                } else if (a_command->flags & CMD_FLAG_REPEATABLE &&
-                           script_depth == 0) {
-                    last_cmd = cmd;
-                } else {
-                    free(cmd);
-                }
-                break;
+    /* The budget is counted down a chunk at a time, so the common path
+       tests only the countdown and should_halt. */
+    while (1) {
+        chunk = (left < LIMIT_CHECK_INTERVAL ? left : LIMIT_CHECK_INTERVAL);
+        for (n = chunk; n > 0 && !should_halt; n--) {
+            if (!execute_instruction()) {
+                /* An illegal instruction was not executed. */
+                if (stop_reason != STOP_ILLEGAL)
+                    n--;
+                run_insns += chunk - n;
+                return;
             }
-            a_command++;
         }
+        run_insns += chunk - n;
+        if (should_halt)
+            return;
+        if ((left -= chunk) == 0) {
+            stop_reason = STOP_BUDGET;
+            sim_error("\nStopped after %llu instructions (the run budget).",
+                      max_insns);
+            return;
+        }
+        if (timeout_ms > 0 && !in_init && elapsed_ms(&start) >= timeout_ms) {
+            stop_reason = STOP_TIMEOUT;
+            sim_error("\nStopped after running for %d ms.", timeout_ms);
+            return;
+        }
+    }
+}
+
+// Formats a byte of LC-3 output for mismatch reports
+static const char * show_byte(char *buf, int value) {
+    /* Braces and backslashes would upset the GUI's Tcl parsing. */
+    if (isprint(value) && strchr("{}\\", value) == NULL)
+        sprintf(buf, "x%02X '%c'", value, value);
+    else
+        sprintf(buf, "x%02X", value);
+    return buf;
+}
+
+// Reports output that differs from the expected output after a run
+static void report_mismatch(void) {
+    char exp_buf[10], act_buf[10];
+
+    if (expect_out == NULL || in_init)
+        return;
+    if (stop_reason == STOP_MISMATCH) {
+        if (expect_pos == expect_len)
+            sim_error("\nOutput overflow at byte %zu: expected end of "
+                      "output, got %s (PC x%04X, %llu instructions into "
+                      "the run).", expect_pos,
+                      show_byte(act_buf, mismatch_actual), mismatch_pc,
+                      run_insns);
+        else
+            sim_error("\nOutput mismatch at byte %zu: expected %s, got %s "
+                      "(PC x%04X, %llu instructions into the run).",
+                      expect_pos, show_byte(exp_buf, expect_out[expect_pos]),
+                      show_byte(act_buf, mismatch_actual), mismatch_pc,
+                      run_insns);
+    } else if (stop_reason == STOP_HALTED && !expect_failed &&
+               expect_pos < expect_len) {
+        /* Halting early is a mismatch too. */
+        expect_failed = expect_ever_failed = true;
+        stop_reason = STOP_MISMATCH;
+        sim_error("\nOutput ended at byte %zu of %zu expected when the LC-3 "
+                  "halted.", expect_pos, expect_len);
+    }
+}
+
+// Describes how the last run ended to tracers, and in JSON mode a record
+static void record_stop(void) {
+    PROBE3(stop, stop_names[stop_reason], REG(R_PC), run_insns);
+    if (!json_mode || in_init)
+        return;
+    begin_record("stop");
+    json_string("reason", stop_names[stop_reason]);
+    json_number("pc", REG(R_PC));
+    json_number("insns", run_insns);
+    json_end();
+}
+
+// Stores count words from start in one pass, with one GUI update
+static void write_words(int start, const int *values, int count) {
+    int addr = start;
+
+    for (int i = 0; i < count; i++) {
+        /* Device registers keep their side effects. */
+        if (addr >= 0xFE00)
+            write_memory(addr, values[i] & 0xFFFF);
+        else {
+            lc3_memory[addr] = values[i] & 0xFFFF;
+            san_written[addr >> 6] |= 1ULL << (addr & 63);
+        }
+        addr = (addr + 1) & 0xFFFF;
+    }
+    /* Undoing instructions from before the edit would mix the states. */
+    forget_history();
+    if (count > 0) {
+        if (gui_mode)
+            disassemble(start, addr);
+        else
+            sim_printf("Wrote %d word%s to x%04X-x%04X.\n", count,
+                       (count == 1 ? "" : "s"), start, (addr - 1) & 0xFFFF);
+    }
+}
+
+// Executes a single instruction as a run of its own
+static bool step_instruction(void) {
+    struct timespec start;
+    bool more;
+
+    stop_reason = STOP_STEP;
+    stop_unreported = true;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    watch_live = !in_init;
+    more = execute_instruction();
+    watch_live = false;
+    count_run_time(&start);
+    run_insns = (stop_reason == STOP_ILLEGAL ? 0 : 1);
+    if (should_halt) {
+        /* halted, diverged from the expected output, or hit a watchpoint */
+        should_halt = false;
+        more = false;
     }
+    report_mismatch();
+    report_watch();
+    record_stop();
+    return more;
 }
 
 // Runs LC-3 until stopping condition occurs (like breakpoint, halt, error).
 static void run_until_stopped(void) {
     struct termios tio;
+    struct timespec start;
     int old_lflag, old_min, old_time;
     bool tty_fail;
 
     should_halt = false;
+    stop_reason = STOP_NONE;
+    run_insns = 0;
+    stop_unreported = !in_init;
     if (gui_mode) {
         /* removes PC marker in GUI */
-        printf("CONT\n");
+        sim_printf("CONT\n");
         tty_fail = true;
     } else if (!isatty(fileno(lc3in)) || 
                tcgetattr(fileno(lc3in), &tio) != 0)
@@ -1141,7 +3476,14 @@ static void run_until_stopped(void) {
         (void)tcsetattr(fileno(lc3in), TCSANOW, &tio);
     }
 
-    while (!should_halt && execute_instruction());
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    watch_live = !in_init;
+    run_with_limits();
+    watch_live = false;
+    count_run_time(&start);
+    report_mismatch();
+    report_watch();
+    record_stop();
 
     if (!tty_fail) {
         // Restore console state after LC-3 finishes
@@ -1170,7 +3512,8 @@ static void run_until_stopped(void) {
 
     /* stopped by CTRL-C?  Check if we need a stop notice... */
     if (need_a_stop_notice) {
-        printf("\nLC-3 stopped.\n\n");
+        if (!json_mode)
+            sim_printf("\nLC-3 stopped.\n\n");
         need_a_stop_notice = false;
     }
 
@@ -1188,67 +3531,157 @@ static void run_until_stopped(void) {
 }
 
 
+// Loads the LC-3 OS code and symbols into memory without running it
+static int load_os(int *startp, int *endp) {
+    bool no_symbols;
+
+#ifdef LC3SIM_INCBIN
+    // Data is built into binary, so it can be position-independent
+    if (read_obj_mem(lc3os_obj, lc3os_obj_len, startp, endp) == -1)
+        return -1;
+    no_symbols = (read_sym_mem(lc3os_sym, lc3os_sym_len) == -1);
+#else
+    if (read_obj_file(INSTALL_DIR "/lc3os.obj", startp, endp) == -1)
+        return -1;
+    no_symbols = (read_sym_file(INSTALL_DIR "/lc3os.sym") == -1);
+#endif
+    if (no_symbols) {
+        sim_error("Failed to read LC-3 OS symbols.");
+    }
+    return 0;
+}
+
 // Resets LC-3
 static void init_machine(void) {
+    static lc3_stats_t before_boot;
     int os_start, os_end;
 
     in_init = true;
+    /* Booting is left out of the counters. */
+    before_boot = lc3_stats;
 
     memset(lc3_register, 0, sizeof(lc3_register));
     REG(R_PSR) = (2L << 9); /* set to condition ZERO */
     memset(lc3_memory, 0, sizeof(lc3_memory));
     memset(lc3_show_later, 0, sizeof(lc3_show_later));
+    memset(san_written, 0, sizeof(san_written));
+    memset(san_fetched, 0, sizeof(san_fetched));
+    memset(lc3_src_file, 0, sizeof(lc3_src_file));
     memset(lc3_sym_names, 0, sizeof(lc3_sym_names));
     memset(lc3_sym_hash, 0, sizeof(lc3_sym_hash));
+    dis_sym_gen++;
     clear_all_breakpoints();
+    clear_watches(0, 0x10000);
+    restart_expected_output();
 
-#ifdef LC3SIM_INCBIN
-    // Data is built into binary, so it can be position-independent
-    if (read_obj_mem(lc3os_obj, lc3os_obj_len, &os_start, &os_end) == -1) {
-        if (gui_mode)
-            puts("ERR {Failed to read LC-3 OS code.}");
-        else
-            puts("Failed to read LC-3 OS code.");
+    if (load_os(&os_start, &os_end) == -1) {
+        sim_error("Failed to read LC-3 OS code.");
         show_state_if_stop_visible();
     } else {
-        if (read_sym_mem(lc3os_sym, lc3os_sym_len) == -1) {
-            if (gui_mode)
-                puts("ERR {Failed to read LC-3 OS symbols.}");
-            else
-                puts("Failed to read LC-3 OS symbols.");
-        }
         if (gui_mode) /* load new code into GUI display */
             disassemble(os_start, os_end);
         REG(R_PC) = 0x0200;
         run_until_stopped();
     }
-#else
-    if (read_obj_file(INSTALL_DIR "/lc3os.obj", &os_start, &os_end) == -1) {
-        if (gui_mode)
-            puts("ERR {Failed to read LC-3 OS code.}");
-        else
-            puts("Failed to read LC-3 OS code.");
-        show_state_if_stop_visible();
-    } else {
-        if (read_sym_file(INSTALL_DIR "/lc3os.sym") == -1) {
-            if (gui_mode)
-                puts("ERR {Failed to read LC-3 OS symbols.}");
-            else
-                puts("Failed to read LC-3 OS symbols.");
-        }
-        if (gui_mode) /* load new code into GUI display */
-            disassemble(os_start, os_end);
-        REG(R_PC) = 0x0200;
-        run_until_stopped();
+
+    lc3_stats = before_boot;
+    in_init = false;
+
+    if (start_snapshot != NULL && restore_snapshot(start_snapshot) == -1)
+        sim_error("Could not restore \"%s\".", start_snapshot);
+    if (start_script != NULL)
+        cmd_execute(start_script);
+    else if (start_file != NULL)
+        cmd_file(start_file);
+}
+
+// Loads the OS and an object file, without booting, for the other engines
+static int load_program_image(const char *obj_file, int *startp) {
+    int os_start, os_end, end;
+
+    if (load_os(&os_start, &os_end) == -1) {
+        sim_error("Failed to read LC-3 OS code.");
+        return -1;
     }
-#endif
+    if (read_obj_file(obj_file, startp, &end) == -1) {
+        sim_error("Failed to load \"%s.\"", obj_file);
+        return -1;
+    }
+    return 0;
+}
+
+// Runs one object file against each input file in lockstep lanes
+static int run_batch(const char *obj_file, int num_inputs, char **inputs,
+                     bool use_cache) {
+    int start;
+
+    if (load_program_image(obj_file, &start) == -1)
+        return 1;
+    return run_lanes_batch(lc3_memory, 0x0200, start, num_inputs, inputs,
+                           max_insns, timeout_ms, use_cache, json_mode);
+}
+
+// Serves sessions of one object file on a Unix socket
+static int run_host(const char *socket_path, const char *obj_file,
+                    int num_threads) {
+    int start;
+
+    if (load_program_image(obj_file, &start) == -1)
+        return 1;
+    return run_lc3_host(socket_path, lc3_memory, 0x0200, start, num_threads);
+}
+
+// Boots once, then forks a command-loop session for each connection
+static int serve_sessions(const char *socket_path) {
+    int listen_fd, fd;
+    pid_t pid;
+
+    if ((listen_fd = open_unix_listener(socket_path)) == -1)
+        return 1;
+
+    /* Every session starts from this machine (and any program or script
+       given on the command line) without booting again. */
+    init_machine();
+    sim_printf("Serving lc3sim sessions on \"%s\".\n", socket_path);
+    end_response("start");
+    fflush(stdout);
+    fflush(lc3out);
 
-    in_init = false;
+    /* Sessions are never waited for. */
+    signal(SIGCHLD, SIG_IGN);
 
-    if (start_script != NULL)
-        cmd_execute(start_script);
-    else if (start_file != NULL)
-        cmd_file(start_file);
+    while (1) {
+        if ((fd = accept(listen_fd, NULL, NULL)) == -1) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            perror("accept");
+            return 1;
+        }
+        if ((pid = fork()) == 0) {
+            /* The connection carries both commands and LC-3 console
+               I/O, just like stdin and stdout without a GUI. */
+            close(listen_fd);
+            if (dup2(fd, 0) == -1 || dup2(fd, 1) == -1)
+                exit(1);
+            close(fd);
+            /* Commands and console input share the socket, so keep
+               stdio from reading ahead (poll() cannot see bytes held
+               in stdin's buffer, so KBSR would never become ready) and
+               keep input sent along with a command. */
+            setvbuf(stdin, NULL, _IONBF, 0);
+            flush_on_start = false;
+            serve_mode = true;
+            lc3readline = simple_readline;
+            if (!have_seed)
+                seed_random(time(NULL) ^ getpid());
+            signal(SIGCHLD, SIG_DFL);
+            command_loop();
+            exit(0);
+        }
+        if (pid == -1)
+            perror("fork");
+        close(fd);
+    }
 }
 
 
@@ -1257,12 +3690,58 @@ static void init_machine(void) {
 
 // Only called in GUI mode: prints value of a register to GUI
 static void print_register(int which) {
-    printf("REG R%d x%04X\n", which, REG (which));
+    sim_printf("REG R%d x%04X\n", which, REG (which));
     /* condition codes are not stored outside of PSR */
     if (which == R_PSR)
-        printf("REG R%d %s\n", NUM_REGS, ccodes[(REG(R_PSR) >> 9) & 7]);
+        sim_printf("REG R%d %s\n", NUM_REGS, ccodes[(REG(R_PSR) >> 9) & 7]);
     /* change focus in GUI */
-    printf("TOCODE\n");
+    sim_printf("TOCODE\n");
+}
+
+/*
+ * Protocol 2 frames: a text header "FRAME <length> <kind> <args>" and
+ * then exactly <length> bytes.  "CODE <line> <count>" carries count
+ * listing lines for the GUI lines from <line> on (address + 1), each
+ * being the text of a CODE message from its PC marker on, without the
+ * line number.  "REGS" carries the NUM_REGS registers as big-endian
+ * 16-bit words; the GUI works out the condition codes from the PSR.
+ * Long runs of lines are split into CODE frames of CODE_FRAME_LINES.
+ */
+#define CODE_FRAME_LINES 1024
+
+// Sends count listing lines from addr on, CODE_FRAME_LINES per frame
+static void send_code_frames(int addr, int count) {
+    static char frame[CODE_FRAME_LINES * (DIS_LINE_LEN + 16)];
+    char line[DIS_LINE_LEN + 16];
+    size_t len;
+    int i, n, run;
+
+    for (; count > 0; addr += run, count -= run) {
+        run = (count < CODE_FRAME_LINES ? count : CODE_FRAME_LINES);
+        len = 0;
+        for (i = 0; i < run; i++) {
+            n = disassembly_line(line, addr + i);
+            /* drop "CODE" and the line number, keeping the PC marker */
+            frame[len++] = line[4];
+            memcpy(frame + len, line + 10, n - 10);
+            len += n - 10;
+        }
+        sim_printf("FRAME %zu CODE %d %d\n", len, addr + 1, run);
+        sim_write(frame, len);
+    }
+}
+
+// Sends the register set as one frame
+static void send_regs_frame(void) {
+    unsigned char regs[2 * NUM_REGS];
+    int regnum;
+
+    for (regnum = 0; regnum < NUM_REGS; regnum++) {
+        regs[2 * regnum] = (REG(regnum) >> 8) & 0xFF;
+        regs[2 * regnum + 1] = REG(regnum) & 0xFF;
+    }
+    sim_printf("FRAME %d REGS\n", 2 * NUM_REGS);
+    sim_write((const char *)regs, sizeof(regs));
 }
 
 // Accepts a port on stdin, and connects to localhost:port to communicate with GUI
@@ -1331,90 +3810,368 @@ static void gui_stop_and_dump(void) {
 
 // The "help" command
 static void cmd_help(const char *args) {
-    printf("file <file>           -- file load (also sets PC to start of "
-           "file)\n\n");
+    sim_printf("file <file>           -- file load (also sets PC to start of "
+               "file)\n\n");
+
+    sim_printf("break ...             -- breakpoint management\n");
+    sim_printf("watch ...             -- stop on reads, writes or changes "
+               "of memory\n\n");
+
+    sim_printf("continue              -- continue execution\n");
+    sim_printf("finish                -- execute to end of current "
+               "subroutine\n");
+    sim_printf("next                  -- execute next instruction (full "
+               "subroutine/trap)\n");
+    sim_printf("step                  -- execute one step (into "
+               "subroutine/trap)\n\n");
+
+    sim_printf("history [on|off|<n>]  -- keep the last n instructions for "
+               "reverse execution\n");
+    sim_printf("rcontinue             -- run backward to a breakpoint\n");
+    sim_printf("rnext                 -- undo one instruction (full "
+               "subroutine/trap)\n");
+    sim_printf("rstep                 -- undo one instruction\n\n");
+
+    sim_printf("list ...              -- list instructions at the PC, an "
+               "address, a label\n");
+    sim_printf("dump ...              -- dump memory at the PC, an address, "
+               "a label\n");
+    sim_printf("translate <addr>      -- show the value of a label and print "
+               "the contents\n");
+    sim_printf("printregs             -- print registers and current "
+               "instruction\n\n");
+
+    sim_printf("memory <addr> <v>...  -- set the values held in memory "
+               "locations\n");
+    sim_printf("fill <a1> <a2> <val>  -- set every location in a range\n");
+    sim_printf("copy <a1> <a2> <dest> -- copy a range of memory\n");
+    sim_printf("find <a1> <a2> ...    -- search a range for words or a "
+               "string\n");
+    sim_printf("load <addr> <file>    -- load words from a .hex/.txt or "
+               "binary file\n");
+    sim_printf("register <reg> <v>... -- set registers to values\n\n");
+
+    sim_printf("assert ...            -- check memory, registers, or CCs\n");
+    sim_printf("hash <addr1> <addr2>  -- print the XXH64 hash of a memory "
+               "range\n");
+    sim_printf("stats [reset]         -- show or clear performance "
+               "counters\n");
+    sim_printf("profile ...           -- count instructions by address, "
+               "label and call\n");
+    sim_printf("coverage ...          -- track instructions and branches run "
+               "(lcov output)\n");
+    sim_printf("sanitize ...          -- check for uninitialized reads and "
+               "stray stores\n");
+    sim_printf("trace <file>|off      -- record each instruction run in a "
+               "binary trace\n");
+    sim_printf("record <file>|off     -- log console input timing and "
+               "device PRNG state\n");
+    sim_printf("replay <file>|off     -- repeat a recorded run exactly\n\n");
+
+
+    sim_printf("execute <file name>   -- execute a script file\n");
+    sim_printf("expect <file>|off     -- stop when LC-3 output differs from a "
+               "file\n\n");
+
+    sim_printf("reset                 -- reset LC-3 and reload last file\n");
+    sim_printf("save <file>           -- save the machine to a snapshot\n");
+    sim_printf("restore <file>        -- restore the machine from a "
+               "snapshot\n\n");
+
+    sim_printf("quit                  -- quit the simulator\n\n");
+
+    sim_printf("help                  -- print this help\n\n");
+
+    sim_printf("All commands except quit can be abbreviated.\n");
+}
+
+// Reports a failed assertion
+static void assert_failed(const char *fmt, ...) {
+    char what[200];
+    va_list ap;
+
+    assert_failures++;
+    va_start(ap, fmt);
+    vsnprintf(what, sizeof(what), fmt, ap);
+    va_end(ap);
+    sim_error("Assertion failed: %s.", what);
+}
+
+// Checks count words of memory from start against expected
+static void assert_words(int start, const int *expected, int count) {
+    int first, done, n, shown = 0, wrong = 0, addr;
+
+    /* Compare up to the end of memory, then from x0000 if wrapping. */
+    for (done = 0; done < count; done += n) {
+        addr = (start + done) & 0xFFFF;
+        n = count - done;
+        if (n > 65536 - addr)
+            n = 65536 - addr;
+        for (first = 0; ; first++) {
+            first += range_mismatch(lc3_memory + addr + first,
+                                    expected + done + first, n - first);
+            if (first == n)
+                break;
+            if (shown++ < 8)
+                assert_failed("x%04X is x%04X, expected x%04X",
+                              addr + first, lc3_memory[addr + first],
+                              expected[done + first] & 0xFFFF);
+            else
+                assert_failures++;
+            wrong++;
+        }
+    }
+    if (wrong > 8 && !gui_mode)
+        sim_printf("(%d more differences not shown)\n", wrong - 8);
+    if (wrong == 0 && !gui_mode)
+        sim_printf("Memory x%04X-x%04X holds the expected %d word%s.\n",
+                   start, (start + count - 1) & 0xFFFF, count,
+                   (count == 1 ? "" : "s"));
+}
 
-    printf("break ...             -- breakpoint management\n\n");
+// Reads an object file into a separate image for comparison
+static int read_obj_image(const char *filename, int *image, int *startp,
+                          int *countp) {
+    FILE *f;
+    unsigned char buf[2];
+    int count = 0;
 
-    printf("continue              -- continue execution\n");
-    printf("finish                -- execute to end of current subroutine\n");
-    printf("next                  -- execute next instruction (full "
-           "subroutine/trap)\n");
-    printf("step                  -- execute one step (into "
-           "subroutine/trap)\n\n");
+    if ((f = fopen(filename, "r")) == NULL)
+        return -1;
+    if (fread(buf, 2, 1, f) != 1) {
+        fclose(f);
+        return -1;
+    }
+    *startp = (buf[0] << 8) | buf[1];
+    while (count < 65536 && fread(buf, 2, 1, f) == 1)
+        image[count++] = (buf[0] << 8) | buf[1];
+    fclose(f);
+    *countp = count;
+    return 0;
+}
 
-    printf("list ...              -- list instructions at the PC, an "
-           "address, a label\n");
-    printf("dump ...              -- dump memory at the PC, an address, "
-           "a label\n");
-    printf("translate <addr>      -- show the value of a label and print the "
-           "contents\n");
-    printf("printregs             -- print registers and current "
-           "instruction\n\n");
+// The "assert" command (checks machine state)
+static void cmd_assert(const char *args) {
+    static const char * const rname[NUM_REGS] = {
+        "R0", "R1", "R2", "R3", "R4", "R5", "R6", "R7", "PC", "IR", "PSR"
+    };
+    static int expected[65536];
+    char kind[11], arg1[MAX_LABEL_LEN], arg2[MAX_LABEL_LEN], trash[2];
+    int num_args, kind_len, start, count, value, rnum, offset;
+
+    num_args = sscanf(args, "%10s%80s%80s%1s", kind, arg1, arg2, trash);
+    if (num_args < 2)
+        goto show_syntax;
+    kind_len = strlen(kind);
+
+    /* Memory against values listed on the command line. */
+    if (strncasecmp(kind, "memory", kind_len) == 0) {
+        if (num_args < 3 || (start = parse_address(arg1)) == -1)
+            goto show_syntax;
+        /* Skip the kind and the address, then read every value. */
+        sscanf(args, "%*s%*s%n", &offset);
+        if ((count = parse_words(args + offset, expected, 65536)) != -1)
+            assert_words(start, expected, count);
+        return;
+    }
 
-    printf("memory <addr> <val>   -- set the value held in a memory "
-           "location\n");
-    printf("register <reg> <val>  -- set a register to a value\n\n");
+    /* Memory against every word of an object file. */
+    if (strncasecmp(kind, "image", kind_len) == 0) {
+        if (num_args > 2)
+            warn_too_many_args();
+        if (read_obj_image(arg1, expected, &start, &count) == -1) {
+            if (gui_mode)
+                sim_printf("ERR {Could not read object file.}\n");
+            else
+                sim_error("Could not read object file \"%s\".", arg1);
+            return;
+        }
+        assert_words(start, expected, count);
+        return;
+    }
 
+    /* A register, by the names used by the register command. */
+    if (strncasecmp(kind, "register", kind_len) == 0) {
+        if (num_args < 3)
+            goto show_syntax;
+        if (num_args > 3)
+            warn_too_many_args();
+        for (rnum = 0; rnum < NUM_REGS; rnum++)
+            if (strcasecmp(rname[rnum], arg1) == 0)
+                break;
+        if (rnum == NUM_REGS) {
+            sim_puts("Registers are R0...R7, PC, IR, and PSR.");
+            return;
+        }
+        if ((value = parse_address(arg2)) == -1) {
+            sim_puts("No address or label corresponding to the "
+                     "desired value exists.");
+            return;
+        }
+        if (REG(rnum) != value)
+            assert_failed("%s is x%04X, expected x%04X", rname[rnum],
+                          REG(rnum), value);
+        else if (!gui_mode)
+            sim_printf("%s holds the expected x%04X.\n", rname[rnum], value);
+        return;
+    }
 
-    printf("execute <file name>   -- execute a script file\n\n");
+    /* Condition codes, as NEGATIVE, ZERO, or POSITIVE (or prefixes). */
+    if (strncasecmp(kind, "cc", kind_len) == 0) {
+        static const char * const cc_val[3] = {
+            "POSITIVE", "ZERO", "NEGATIVE"
+        };
+        const char *cc_now = ccodes[(REG(R_PSR) >> 9) & 7];
 
-    printf("reset                 -- reset LC-3 and reload last file\n\n");
+        if (num_args > 2)
+            warn_too_many_args();
+        for (value = 0; value < 3; value++)
+            if (strncasecmp(arg1, cc_val[value], strlen(arg1)) == 0)
+                break;
+        if (value == 3) {
+            sim_puts("CC can only be NEGATIVE, ZERO, or POSITIVE.");
+            return;
+        }
+        if (strcmp(cc_now, cc_val[value]) != 0)
+            assert_failed("CC is %s, expected %s", cc_now, cc_val[value]);
+        else if (!gui_mode)
+            sim_printf("CC is %s as expected.\n", cc_now);
+        return;
+    }
 
-    printf("quit                  -- quit the simulator\n\n");
+show_syntax:
+    sim_printf("syntax: assert memory <addr> <value>...\n");
+    sim_printf("        assert image <object file>\n");
+    sim_printf("        assert register <reg> <value>\n");
+    sim_printf("        assert cc NEGATIVE|ZERO|POSITIVE\n");
+}
 
-    printf("help                  -- print this help\n\n");
+// Gives the breakpoint at addr the commands in list (none if empty)
+static void set_bpt_commands(int addr, const char *list) {
+    bpt_cond_t *c;
+    bool resume;
 
-    printf("All commands except quit can be abbreviated.\n");
+    if (addr == -1) {
+        sim_error(BAD_ADDRESS);
+        return;
+    }
+    if (lc3_breakpoints[addr] != BPT_USER) {
+        sim_error("No such breakpoint was set.");
+        return;
+    }
+    if (strlen(list) > BPT_MAX_COMMANDS) {
+        sim_error("That list of commands is too long.");
+        return;
+    }
+    if (check_bpt_commands(list, &resume) == -1)
+        return;
+    if ((c = bpt_conds[addr]) == NULL &&
+        (c = bpt_conds[addr] = compile_condition("", 0)) == NULL)
+        return;
+    free(c->commands);
+    c->commands = NULL;
+    c->resume = false;
+    if (list[strspn(list, " \t;")] != '\0') {
+        if ((c->commands = strdup(list + strspn(list, " \t"))) == NULL) {
+            sim_error("Out of memory.");
+            return;
+        }
+        c->resume = resume;
+    } else if (c->len == 0 && c->ignore == 0)
+        clear_condition(addr);
+    if (!gui_mode)
+        sim_printf("%s the commands of the breakpoint at x%04X.\n",
+                   (bpt_conds[addr] != NULL &&
+                    bpt_conds[addr]->commands != NULL ? "Set" : "Removed"),
+                   addr);
 }
 
 // The "break" command (manages breakpoints)
 static void cmd_break(const char *args) {
-    char opt[11], addr_str[MAX_LABEL_LEN], trash[2];
-    int num_args, opt_len, addr;
-
-    /* 80 == MAX_LABEL_LEN - 1 */
-    num_args = sscanf(args, "%10s%80s%1s", opt, addr_str, trash);
-
-    if (num_args > 0) {
+    char opt[11], addr_str[MAX_LABEL_LEN], word[21], trash[2];
+    unsigned long long ignore = 0;
+    const char *rest;
+    char *end;
+    bpt_cond_t *cond = NULL;
+    int opt_len, addr;
+
+    if (scan_word(&args, opt, sizeof(opt)) > 0) {
         opt_len = strlen(opt);
         if (strncasecmp(opt, "list", opt_len) == 0) {
-            if (num_args > 1)
+            if (scan_word(&args, trash, sizeof(trash)) > 0)
                 warn_too_many_args();
             list_breakpoints();
             return;
         }
-        if (num_args > 1) {
-            if (num_args > 2)
-                warn_too_many_args();
+        if (scan_word(&args, addr_str, sizeof(addr_str)) > 0) {
             addr = parse_address(addr_str);
             if (strncasecmp(opt, "clear", opt_len) == 0) {
+                if (scan_word(&args, trash, sizeof(trash)) > 0)
+                    warn_too_many_args();
                 if (strcasecmp(addr_str, "all") == 0) {
                     clear_all_breakpoints();
                     if (!gui_mode)
-                        printf("Cleared all breakpoints.\n");
+                        sim_printf("Cleared all breakpoints.\n");
                     return;
                 }
                 if (addr != -1)
                     clear_breakpoint(addr);
                 else
-                    puts(BAD_ADDRESS);
+                    sim_error(BAD_ADDRESS);
+                return;
+            } else if (strncasecmp(opt, "commands", opt_len) == 0) {
+                set_bpt_commands(addr, args);
                 return;
             } else if (strncasecmp(opt, "set", opt_len) == 0) {
-                if (addr != -1)
-                    set_breakpoint(addr);
-                else
-                    puts(BAD_ADDRESS);
+                if (addr == -1) {
+                    sim_error(BAD_ADDRESS);
+                    return;
+                }
+                /* [after <n>] [if <condition>] */
+                rest = args;
+                if (scan_word(&rest, word, sizeof(word)) > 0 &&
+                    strcasecmp(word, "after") == 0) {
+                    errno = 0;
+                    if (scan_word(&rest, word, sizeof(word)) > 0)
+                        ignore = strtoull(word, &end, 10);
+                    if (!isdigit(*word) || *end != '\0' || errno != 0) {
+                        sim_error("Give the number of hits to skip after "
+                                  "\"after\".");
+                        return;
+                    }
+                    args = rest;
+                }
+                rest = args;
+                if (scan_word(&rest, word, sizeof(word)) > 0) {
+                    if (strcasecmp(word, "if") != 0) {
+                        warn_too_many_args();
+                        rest = "";
+                    }
+                    if ((cond = compile_condition(rest, ignore)) == NULL)
+                        return;
+                } else if (ignore > 0 &&
+                           (cond = compile_condition("", ignore)) == NULL)
+                    return;
+                set_breakpoint(addr, cond);
                 return;
             }
         }
     }
 
     // Print help for command
-    printf("breakpoint options include:\n");
-    printf("  break clear <addr>|all -- clear one or all breakpoints\n");
-    printf("  break list             -- list all breakpoints\n");
-    printf("  break set <addr>       -- set a breakpoint\n");
+    sim_printf("breakpoint options include:\n");
+    sim_printf("  break clear <addr>|all -- clear one or all breakpoints\n");
+    sim_printf("  break commands <addr> [<command>; ...]\n");
+    sim_printf("                         -- run commands when a breakpoint "
+               "stops (none to remove;\n");
+    sim_printf("                            end with continue to keep "
+               "running)\n");
+    sim_printf("  break list             -- list all breakpoints\n");
+    sim_printf("  break set <addr> [after <n>] [if <condition>]\n");
+    sim_printf("                         -- set a breakpoint, skipping the "
+               "first n hits\n");
+    sim_printf("                            where the condition holds, e.g. "
+               "R3 == #0 && M[x4000] > x10\n");
 }
 
 // The "continue" command
@@ -1427,6 +4184,39 @@ static void cmd_continue(const char *args) {
     run_until_stopped();
 }
 
+// The "coverage" command (tracks which instructions and branches ran)
+static void cmd_coverage(const char *args) {
+    char opt[11], trash[2];
+
+    if (scan_word(&args, opt, sizeof(opt)) == 0) {
+        print_coverage();
+        return;
+    }
+    if (strcasecmp(opt, "lcov") == 0) {
+        while (isspace(*args))
+            args++;
+        if (*args == '\0')
+            sim_printf("syntax: coverage [on|off|reset|lcov <file>]\n");
+        else if (write_lcov(args) == -1)
+            sim_error("Could not write \"%s\".", args);
+        return;
+    }
+    if (scan_word(&args, trash, sizeof(trash)) != 0)
+        warn_too_many_args();
+    if (strcasecmp(opt, "on") == 0)
+        covering = true;
+    else if (strcasecmp(opt, "off") == 0)
+        covering = false;
+    else if (strcasecmp(opt, "reset") == 0) {
+        memset(cov_sets, 0, sizeof(cov_sets));
+    } else {
+        sim_printf("syntax: coverage [on|off|reset|lcov <file>]\n");
+        return;
+    }
+    if (!gui_mode)
+        sim_printf("Coverage is %s.\n", (covering ? "on" : "off"));
+}
+
 // The "dump" command (perform hex dump)
 static void cmd_dump(const char *args) {
     static int last_end = 0;
@@ -1439,30 +4229,33 @@ static void cmd_dump(const char *args) {
     }
 
     // Print help for command
-    printf("dump options include:\n");
-    printf("  dump               -- dump memory around PC\n");
-    printf("  dump <addr>        -- dump memory starting from an "
-           "address or label\n");
-    printf("  dump <addr> <addr> -- dump a range of memory\n");
-    printf("  dump more          -- continue previous dump (or press "
-           "<Enter>)\n");
+    sim_printf("dump options include:\n");
+    sim_printf("  dump               -- dump memory around PC\n");
+    sim_printf("  dump <addr>        -- dump memory starting from an "
+               "address or label\n");
+    sim_printf("  dump <addr> <addr> -- dump a range of memory\n");
+    sim_printf("  dump more          -- continue previous dump (or press "
+               "<Enter>)\n");
 }
 
 // The "execute" command (run a simulator script)
 static void cmd_execute(const char *args) {
     FILE *previous_input;
     FILE *script;
+    struct stat st;
+    char *text;
+    size_t done = 0;
 
     if (script_depth == MAX_SCRIPT_DEPTH) {
         /* Safer to exit than to bury a warning arbitrarily deep. */
-        printf("Cannot execute more than %d levels of scripts!\n",
-               MAX_SCRIPT_DEPTH);
+        sim_error("Cannot execute more than %d levels of scripts!",
+                  MAX_SCRIPT_DEPTH);
         stop_scripts = true;
         return;
     }
 
     if ((script = fopen(args, "r")) == NULL) {
-        printf("Cannot open script file \"%s\".\n", args);
+        sim_error("Cannot open script file \"%s\".", args);
         stop_scripts = true;
         return;
     }
@@ -1475,7 +4268,17 @@ static void cmd_execute(const char *args) {
 #if defined(USE_READLINE)
     lc3readline = simple_readline;
 #endif
-    command_loop();
+    /* Map regular files and run them in place; the command loop reads
+       whatever is left (if anything). */
+    if (script_uses_stdin && fstat(fileno(script), &st) == 0 &&
+        S_ISREG(st.st_mode) && st.st_size > 0 &&
+        (text = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                     fileno(script), 0)) != MAP_FAILED) {
+        done = run_mapped_script(text, st.st_size);
+        munmap(text, st.st_size);
+    }
+    if (done == 0 || fseek(script, done, SEEK_SET) == 0)
+        command_loop();
     sim_in = previous_input;
     if (--script_depth == 0) {
         if (gui_mode) {
@@ -1495,6 +4298,207 @@ static void cmd_execute(const char *args) {
     fclose(script);
 }
 
+// Compares the next program's output from the start of the file again
+static void restart_expected_output(void) {
+    expect_pos = 0;
+    expect_failed = false;
+}
+
+// Reads the expected output for later runs (NULL stops checking)
+static int load_expected_output(const char *name) {
+    FILE *f;
+    unsigned char *buf = NULL, *grown;
+    size_t len = 0, cap = 0, got;
+
+    free(expect_out);
+    expect_out = NULL;
+    if (name == NULL)
+        return 0;
+    if ((f = fopen(name, "rb")) == NULL)
+        return -1;
+    do {
+        if (len == cap) {
+            cap = (cap == 0 ? 4096 : cap * 2);
+            if ((grown = realloc(buf, cap)) == NULL) {
+                free(buf);
+                fclose(f);
+                return -1;
+            }
+            buf = grown;
+        }
+        got = fread(buf + len, 1, cap - len, f);
+        len += got;
+    } while (got != 0);
+    fclose(f);
+    expect_out = buf;
+    expect_len = len;
+    restart_expected_output();
+    return 0;
+}
+
+// The "expect" command (compare LC-3 output with a file as it is written)
+static void cmd_expect(const char *args) {
+    if (*args == '\0') {
+        sim_printf("syntax: expect <file>|off\n");
+        return;
+    }
+    if (strcasecmp(args, "off") == 0) {
+        load_expected_output(NULL);
+        if (!gui_mode)
+            sim_printf("Will not check the LC-3 output.\n");
+        return;
+    }
+    if (load_expected_output(args) == -1) {
+        if (gui_mode)
+            sim_printf("ERR {Cannot read expected output file.}\n");
+        else
+            sim_error("Cannot read expected output file \"%s\".", args);
+        return;
+    }
+    if (!gui_mode)
+        sim_printf("Will check the LC-3 output against \"%s\" (%zu bytes).\n",
+                   args, expect_len);
+}
+
+// The "copy" command (copies a range of memory)
+static void cmd_copy(const char *args) {
+    static int values[65536];
+    char arg1[MAX_LABEL_LEN], arg2[MAX_LABEL_LEN], arg3[MAX_LABEL_LEN];
+    char trash[2];
+    int num_args, start, end, dest, count;
+
+    /* 80 == MAX_LABEL_LEN - 1 */
+    num_args = sscanf(args, "%80s%80s%80s%1s", arg1, arg2, arg3, trash);
+    if (num_args < 3 || (start = parse_address(arg1)) == -1 ||
+        (end = parse_address(arg2)) == -1 ||
+        (dest = parse_address(arg3)) == -1) {
+        sim_printf("syntax: copy <addr1> <addr2> <destination>\n");
+        return;
+    }
+    if (num_args > 3)
+        warn_too_many_args();
+    /* Read everything first, so overlapping ranges copy correctly. */
+    count = ((end - start) & 0xFFFF) + 1;
+    for (int i = 0; i < count; i++)
+        values[i] = lc3_memory[(start + i) & 0xFFFF];
+    write_words(dest, values, count);
+}
+
+// The "fill" command (stores one value throughout a range of memory)
+static void cmd_fill(const char *args) {
+    static int values[65536];
+    char arg1[MAX_LABEL_LEN], arg2[MAX_LABEL_LEN], arg3[MAX_LABEL_LEN];
+    char trash[2];
+    int num_args, start, end, value, count;
+
+    /* 80 == MAX_LABEL_LEN - 1 */
+    num_args = sscanf(args, "%80s%80s%80s%1s", arg1, arg2, arg3, trash);
+    if (num_args < 3 || (start = parse_address(arg1)) == -1 ||
+        (end = parse_address(arg2)) == -1 ||
+        (value = parse_address(arg3)) == -1) {
+        sim_printf("syntax: fill <addr1> <addr2> <value>\n");
+        return;
+    }
+    if (num_args > 3)
+        warn_too_many_args();
+    count = ((end - start) & 0xFFFF) + 1;
+    for (int i = 0; i < count; i++)
+        values[i] = value;
+    write_words(start, values, count);
+}
+
+// Reads words written in hex (x1234, 0x1234, or 1234; ';' comments)
+static int read_hex_words(FILE *f, int *values, int max) {
+    char buf[100], *pos, *end;
+    long value;
+    int count = 0, line = 0;
+
+    while (fgets(buf, sizeof(buf), f) != NULL) {
+        line++;
+        if ((pos = strchr(buf, ';')) != NULL)
+            *pos = '\0';
+        for (pos = buf; ; pos = end) {
+            while (isspace(*pos) || *pos == ',')
+                pos++;
+            if (*pos == '\0')
+                break;
+            if (tolower(*pos) == 'x')
+                pos++;
+            value = strtol(pos, &end, 16);
+            if (end == pos || (*end != '\0' && !isspace(*end) &&
+                               *end != ',') ||
+                value < 0 || value > 0xFFFF) {
+                sim_printf("Bad hex word on line %d.\n", line);
+                return -1;
+            }
+            if (count == max) {
+                sim_printf("Too many words to load.\n");
+                return -1;
+            }
+            values[count++] = value;
+        }
+    }
+    return count;
+}
+
+// Reads words stored as raw big-endian pairs of bytes (as in .obj files)
+static int read_bin_words(FILE *f, int *values, int max) {
+    unsigned char buf[2];
+    int count = 0;
+    size_t got;
+
+    while ((got = fread(buf, 1, 2, f)) == 2) {
+        if (count == max) {
+            sim_printf("Too many words to load.\n");
+            return -1;
+        }
+        values[count++] = (buf[0] << 8) | buf[1];
+    }
+    if (got == 1) {
+        sim_printf("File has an odd number of bytes.\n");
+        return -1;
+    }
+    return count;
+}
+
+// The "load" command (loads words from a hex or binary file at an address)
+static void cmd_load(const char *args) {
+    static int values[65536];
+    char arg1[MAX_LABEL_LEN];
+    const char *name, *ext;
+    int start, count, used;
+    FILE *f;
+
+    /* 80 == MAX_LABEL_LEN - 1 */
+    if (sscanf(args, "%80s%n", arg1, &used) != 1 ||
+        (start = parse_address(arg1)) == -1) {
+        sim_printf("syntax: load <addr> <hex or binary file>\n");
+        return;
+    }
+    for (name = args + used; isspace(*name); name++);
+    if (*name == '\0') {
+        sim_printf("syntax: load <addr> <hex or binary file>\n");
+        return;
+    }
+    if ((f = fopen(name, "rb")) == NULL) {
+        if (gui_mode)
+            sim_printf("ERR {Could not open file.}\n");
+        else
+            sim_error("Could not open \"%s\".", name);
+        return;
+    }
+    /* .hex and .txt files are text; anything else is binary. */
+    ext = strrchr(name, '.');
+    if (ext != NULL && (strcasecmp(ext, ".hex") == 0 ||
+                        strcasecmp(ext, ".txt") == 0))
+        count = read_hex_words(f, values, 65536);
+    else
+        count = read_bin_words(f, values, 65536);
+    fclose(f);
+    if (count > 0)
+        write_words(start, values, count);
+}
+
 // The "file" command (load an LC-3 object file)
 static void cmd_file(const char *args) {
     /* extra 4 chars in buf for ".obj" possibly added later */ 
@@ -1506,9 +4510,9 @@ static void cmd_file(const char *args) {
     len = strlen(args);
     if (len == 0 || len > MAX_FILE_NAME_LEN - 1) {
         if (gui_mode)
-            printf("ERR {Could not parse file name!}\n");
+            sim_printf("ERR {Could not parse file name!}\n");
         else
-            printf("syntax: file <file to load>\n");
+            sim_printf("syntax: file <file to load>\n");
         return;
     }
     strcpy(buf, args);
@@ -1520,30 +4524,28 @@ static void cmd_file(const char *args) {
     } else {
         if (!gui_mode && strcasecmp(ext, ".sym") == 0) {
             if (read_sym_file(buf))
-                printf("Failed to read symbols from \"%s.\"\n", buf);
+                sim_error("Failed to read symbols from \"%s.\"", buf);
             else
-                printf("Read symbols from \"%s.\"\n", buf);
+                sim_printf("Read symbols from \"%s.\"\n", buf);
             return;
         }
         if (strcasecmp(ext, ".obj") != 0) {
             if (gui_mode)
-                printf("ERR {Only .obj files can be loaded.}\n");
+                sim_printf("ERR {Only .obj files can be loaded.}\n");
             else
-                printf("Only .obj or .sym files can be loaded.\n");
+                sim_error("Only .obj or .sym files can be loaded.");
             return;
         }
     }
     if (read_obj_file(buf, &start, &end) == -1) {
-        if (gui_mode)
-            printf("ERR {Failed to load \"%s.\"}\n", buf);
-        else
-            printf("Failed to load \"%s.\"\n", buf);
+        sim_error("Failed to load \"%s.\"", buf);
         return;
     }
     /* Success: reload same file next time machine is reset. */
     if (start_file != NULL)
         free(start_file);
     start_file = strdup(buf);
+    restart_expected_output();
 
     strcpy(ext, ".sym");
     if (read_sym_file(buf))
@@ -1555,15 +4557,22 @@ static void cmd_file(const char *args) {
         /* load new code into GUI display */
         disassemble(start, end);
         /* change focus in GUI */
-        printf("TOCODE\n");
+        sim_printf("TOCODE\n");
         print_register(R_PC);
         if (warn)
-            printf("ERR {WARNING: No symbols are available.}\n");
+            sim_printf("ERR {WARNING: No symbols are available.}\n");
+    } else if (json_mode) {
+        strcpy(ext, ".obj");
+        begin_record("loaded");
+        json_string("file", buf);
+        json_number("pc", start);
+        json_bool("symbols", !warn);
+        json_end();
     } else {
         strcpy(ext, ".obj");
-        printf("Loaded \"%s\" and set PC to x%04X\n", buf, start);
+        sim_printf("Loaded \"%s\" and set PC to x%04X\n", buf, start);
         if (warn)
-            printf("WARNING: No symbols are available.\n");
+            sim_printf("WARNING: No symbols are available.\n");
     }
 
     /* Should not immediately start, even if we stopped simulator to
@@ -1576,6 +4585,134 @@ static void cmd_file(const char *args) {
         gui_stop_and_dump();
 }
 
+/*
+ * Reads a string for the "find" command into pattern (as .STRINGZ does,
+ * or two characters to a word as PUTSP expects), with masks for the bits
+ * that must match.  The string is quoted, with C escapes, or else is the
+ * rest of the line.  Returns the number of words, or -1 if too long.
+ */
+static int parse_find_string(const char *s, bool packed, int *pattern,
+                             int *masks) {
+    int len = 0, nchars = 0, c;
+    bool quoted = (*s == '"');
+
+    for (s += quoted; *s != '\0' && !(quoted && *s == '"'); s++) {
+        c = (unsigned char)*s;
+        if (quoted && c == '\\' && s[1] != '\0') {
+            switch (c = *++s) {
+                case 'n': c = '\n'; break;
+                case 't': c = '\t'; break;
+                case 'r': c = '\r'; break;
+                case 'e': c = 27; break;
+                case '0': c = 0; break;
+            }
+        }
+        if (!packed || nchars % 2 == 0) {
+            if (len == MAX_FIND_LEN)
+                return -1;
+            pattern[len] = c;
+            masks[len++] = (packed ? 0x00FF : 0xFFFF);
+        } else {
+            pattern[len - 1] |= c << 8;
+            masks[len - 1] = 0xFFFF;
+        }
+        nchars++;
+    }
+    /* Trailing spaces are kept only inside quotes. */
+    if (!quoted && !packed)
+        while (len > 0 && isspace(pattern[len - 1]))
+            len--;
+    return len;
+}
+
+// The "find" command (searches memory for words or a string)
+static void cmd_find(const char *args) {
+    static const char * const kinds[] = {"words", "string", "packed"};
+    int pattern[MAX_FIND_LEN], masks[MAX_FIND_LEN];
+    char arg1[MAX_LABEL_LEN], arg2[MAX_LABEL_LEN], word[MAX_LABEL_LEN];
+    char kind[11], where[MAX_LABEL_LEN + 10];
+    int start, end, k, len = 0, mask = 0xFFFF, value, found = 0, pos, lo, hi;
+    size_t kind_len;
+
+    if (scan_word(&args, arg1, sizeof(arg1)) == 0 ||
+        scan_word(&args, arg2, sizeof(arg2)) == 0 ||
+        scan_word(&args, kind, sizeof(kind)) == 0)
+        goto syntax;
+    if ((start = parse_address(arg1)) == -1 ||
+        (end = parse_address(arg2)) == -1) {
+        sim_error(BAD_ADDRESS);
+        return;
+    }
+    kind_len = strlen(kind);
+    for (k = 0; k < 3; k++)
+        if (strncasecmp(kind, kinds[k], kind_len) == 0)
+            break;
+    if (k == 0) {
+        /* words, then perhaps a mask for all of them */
+        while (scan_word(&args, word, sizeof(word)) > 0) {
+            if (strcasecmp(word, "mask") == 0) {
+                if (scan_word(&args, word, sizeof(word)) == 0 ||
+                    (mask = parse_address(word)) == -1)
+                    goto syntax;
+                if (scan_word(&args, word, sizeof(word)) > 0)
+                    warn_too_many_args();
+                break;
+            }
+            if ((value = parse_address(word)) == -1) {
+                sim_error(BAD_ADDRESS);
+                return;
+            }
+            if (len == MAX_FIND_LEN) {
+                sim_error("Search for at most %d words.", MAX_FIND_LEN);
+                return;
+            }
+            pattern[len++] = value;
+        }
+        for (int i = 0; i < len; i++)
+            masks[i] = mask;
+    } else if (k < 3) {
+        while (isspace(*args))
+            args++;
+        if ((len = parse_find_string(args, k == 2, pattern, masks)) == -1) {
+            sim_error("Search for at most %d words.", MAX_FIND_LEN);
+            return;
+        }
+    } else
+        goto syntax;
+    if (len == 0)
+        goto syntax;
+
+    /* Search the range in one or two pieces, as it may wrap past xFFFF
+       (a match across the wrap is not found). */
+    for (lo = start; ; lo = 0) {
+        hi = (end >= lo ? end : 0xFFFF);
+        pos = 0;
+        while ((pos = range_find(lc3_memory + lo, hi - lo + 1, pattern,
+                                 masks, len, pos)) != -1) {
+            if (*describe_location(lo + pos, where) != '\0')
+                sim_printf("  x%04X  %s\n", lo + pos, where);
+            else
+                sim_printf("  x%04X\n", lo + pos);
+            found++;
+            pos++;
+        }
+        if (hi == end)
+            break;
+    }
+    sim_printf("Found %d match%s in x%04X-x%04X.\n", found,
+               (found == 1 ? "" : "es"), start, end);
+    return;
+
+syntax:
+    sim_printf("find options include:\n");
+    sim_printf("  find <a1> <a2> words <v>... [mask <m>] -- words in a row "
+               "(bits in m only)\n");
+    sim_printf("  find <a1> <a2> string \"<text>\"        -- one character "
+               "per word (.STRINGZ)\n");
+    sim_printf("  find <a1> <a2> packed \"<text>\"        -- two characters "
+               "per word (PUTSP)\n");
+}
+
 // The "finish" command (run to end of current subroutine)
 static void cmd_finish(const char *args) {
     no_args_allowed(args);
@@ -1584,6 +4721,58 @@ static void cmd_finish(const char *args) {
     run_until_stopped();
 }
 
+// The "hash" command (hashes a range of memory)
+static void cmd_hash(const char *args) {
+    int start, end, count;
+
+    if (parse_range(args, &start, &end, -1, -1) != 0) {
+        sim_printf("syntax: hash <addr1> <addr2>\n");
+        return;
+    }
+    /* Both ends are included, wrapping past xFFFF if necessary. */
+    count = ((end - start) & 0xFFFF) + 1;
+    sim_printf("XXH64 of x%04X-x%04X (%d word%s): %016llX\n", start, end,
+               count, (count == 1 ? "" : "s"),
+               range_hash(lc3_memory, start, count));
+}
+
+// The "history" command (keeps undo records for reverse execution)
+static void cmd_history(const char *args) {
+    char opt[11], trash[2];
+    int size;
+
+    if (scan_word(&args, opt, sizeof(opt)) == 0) {
+        if (gui_mode)
+            return;
+        if (history == NULL)
+            sim_printf("History is off.\n");
+        else
+            sim_printf("History holds %d of up to %d instructions.\n",
+                       history_len, history_size);
+        return;
+    }
+    if (scan_word(&args, trash, sizeof(trash)) != 0)
+        warn_too_many_args();
+    if (strcasecmp(opt, "on") == 0)
+        size = (history != NULL ? history_size : HISTORY_DEFAULT);
+    else if (strcasecmp(opt, "off") == 0)
+        size = 0;
+    else if (!parse_number(opt, 10, &size) || size < 0 ||
+             size > HISTORY_MAX) {
+        sim_printf("syntax: history [on|off|<instructions>]\n");
+        return;
+    }
+    if (size == (history != NULL ? history_size : 0))
+        return;
+    if (set_history_size(size) == -1) {
+        sim_error("Not enough memory for that much history.");
+        return;
+    }
+    if (!gui_mode && history != NULL)
+        sim_printf("Keeping history for the last %d instructions.\n",
+                   history_size);
+}
+
 // The "list" command (lists instructions in specified areas of memory)
 static void cmd_list(const char *args) {
     static int last_end = 0;
@@ -1595,46 +4784,117 @@ static void cmd_list(const char *args) {
         return;
     }
 
-    printf("list options include:\n");
-    printf("  list               -- list instructions around PC\n");
-    printf("  list <addr>        -- list instructions starting from an "
-           "address or label\n");
-    printf("  list <addr> <addr> -- list a range of instructions\n");
-    printf("  list more          -- continue previous listing (or press "
-           "<Enter>)\n");
+    sim_printf("list options include:\n");
+    sim_printf("  list               -- list instructions around PC\n");
+    sim_printf("  list <addr>        -- list instructions starting from an "
+               "address or label\n");
+    sim_printf("  list <addr> <addr> -- list a range of instructions\n");
+    sim_printf("  list more          -- continue previous listing (or press "
+               "<Enter>)\n");
 }
 
 // The "memory" command (writes data in regions of memory)
 static void cmd_memory(const char *args) {
-    int addr, value;
+    static int values[65536];
+    char arg1[MAX_LABEL_LEN], arg2[MAX_LABEL_LEN], arg3[2];
+    const char *rest = args, *values_start;
+    int addr, value, count;
+
+    /* Several values are stored at consecutive addresses. */
+    scan_word(&rest, arg1, MAX_LABEL_LEN);
+    values_start = rest;
+    if (scan_word(&rest, arg2, MAX_LABEL_LEN) > 0 &&
+        scan_word(&rest, arg3, 2) > 0) {
+        if ((addr = parse_address(arg1)) == -1) {
+            sim_printf("syntax: memory <addr> <value> [<value>...]\n");
+            return;
+        }
+        if ((count = parse_words(values_start, values, 65536)) > 0)
+            write_words(addr, values, count);
+        return;
+    }
 
     if (parse_range(args, &addr, &value, -1, -1) == 0) {
         write_memory(addr, value);
+        forget_history();
         if (gui_mode) {
-            printf("TRANS x%04X x%04X\n", addr, value);
+            sim_printf("TRANS x%04X x%04X\n", addr, value);
             disassemble_one(addr);
         } else
-            printf("Wrote x%04X to address x%04X.\n", value, addr);
+            sim_printf("Wrote x%04X to address x%04X.\n", value, addr);
     } else {
         if (gui_mode) {
             /* Address is provided by the GUI, so only the value can
                be bad in this case. */
-            printf("ERR {No address or label corresponding to the "
-                   "desired value exists.}\n");
+            sim_printf("ERR {No address or label corresponding to the "
+                       "desired value exists.}\n");
         } else
-            printf("syntax: memory <addr> <value>\n");
+            sim_printf("syntax: memory <addr> <value> [<value>...]\n");
+    }
+}
+
+// Parses a whole string as a decimal number no larger than max
+static bool parse_unsigned(const char *value, unsigned long long max,
+                           unsigned long long *valuep) {
+    char *end;
+
+    errno = 0;
+    *valuep = strtoull(value, &end, 10);
+    return (isdigit(*value) && *end == '\0' && errno == 0 && *valuep <= max);
+}
+
+// Parses a run limit (a decimal number no larger than max, or off/0)
+static bool parse_run_limit(const char *value, unsigned long long max,
+                            unsigned long long *limitp) {
+    if (strcasecmp(value, "off") == 0) {
+        *limitp = 0;
+        return true;
+    }
+    return parse_unsigned(value, max, limitp);
+}
+
+// Sets the instruction budget ('b') or wall-clock limit ('t') of each run
+static void set_run_limit(char which, const char *value) {
+    unsigned long long limit;
+
+    which = tolower(which);
+    if (!parse_run_limit(value, (which == 'b' ? ULLONG_MAX : INT_MAX),
+                         &limit)) {
+        sim_error("Run limits must be a number or off.");
+        return;
+    }
+    if (which == 'b') {
+        max_insns = limit;
+        if (!gui_mode && limit == 0)
+            sim_printf("Will not limit the instructions in each run.\n");
+        else if (!gui_mode)
+            sim_printf("Will stop each run after %llu instructions.\n", limit);
+    } else {
+        timeout_ms = (int)limit;
+        if (!gui_mode && limit == 0)
+            sim_printf("Will not limit the time taken by each run.\n");
+        else if (!gui_mode)
+            sim_printf("Will stop each run after %d ms.\n", timeout_ms);
     }
 }
 
 // The "option" command (changes simulator settings)
 static void cmd_option(const char *args) {
-    char opt[11], onoff[6], trash[2];
+    char opt[11], onoff[21], trash[2];
     int num_args, opt_len;
     bool oval;
 
-    num_args = sscanf(args, "%10s%5s%1s", opt, onoff, trash);
+    num_args = sscanf(args, "%10s%20s%1s", opt, onoff, trash);
     if (num_args >= 2) {
         opt_len = strlen(opt);
+        /* Run limits take a number instead of on/off. */
+        if (strncasecmp(opt, "budget", opt_len) == 0 ||
+            strncasecmp(opt, "timeout", opt_len) == 0) {
+            set_run_limit(opt[0], onoff);
+            if (num_args > 2)
+                warn_too_many_args();
+            return;
+        }
         if (strcasecmp(onoff, "on") == 0)
             oval = true;
         else if (strcasecmp(onoff, "off") == 0)
@@ -1646,22 +4906,22 @@ static void cmd_option(const char *args) {
         if (strncasecmp(opt, "flush", opt_len) == 0) {
             flush_on_start = oval;
             if (!gui_mode)
-                printf("Will %sflush the console input when starting.\n",
-                       oval ? "" : "not ");
+                sim_printf("Will %sflush the console input when starting.\n",
+                           oval ? "" : "not ");
             return;
         }
         if (strncasecmp(opt, "keep", opt_len) == 0) {
             keep_input_on_stop = oval;
             if (!gui_mode)
-                printf("Will %skeep remaining input when the LC-3 stops.\n", 
-                       oval ? "" : "not ");
+                sim_printf("Will %skeep remaining input when the LC-3 "
+                           "stops.\n", oval ? "" : "not ");
             return;
         }
         if (strncasecmp(opt, "device", opt_len) == 0) {
             rand_device = oval;
             if (!gui_mode)
-                printf("Will %srandomize device interactions.\n",
-                       oval ? "" : "not ");
+                sim_printf("Will %srandomize device interactions.\n",
+                           oval ? "" : "not ");
             return;
         }
         /* GUI-only option: Delay memory updates to GUI until LC-3 stops? */
@@ -1678,8 +4938,8 @@ static void cmd_option(const char *args) {
         if (strncasecmp(opt, "stdin", opt_len) == 0) {
             script_uses_stdin = oval;
             if (!gui_mode)
-                printf("Will %suse stdin for LC-3 console input during "
-                       "script execution.\n", oval ? "" : "not ");
+                sim_printf("Will %suse stdin for LC-3 console input during "
+                           "script execution.\n", oval ? "" : "not ");
             if (script_depth > 0) {
                 if (!oval)
                     lc3in = sim_in;
@@ -1693,14 +4953,17 @@ static void cmd_option(const char *args) {
     }
 
 show_syntax:
-    printf("syntax: option <option> on|off\n   options include:\n");
-    printf("      device -- simulate random device (keyboard/display)"
-           "timing\n");
-    printf("      flush  -- flush console input each time LC-3 starts\n");
-    printf("      keep   -- keep remaining input when the LC-3 stops\n");
-    printf("      stdin  -- use stdin for LC-3 console input during script "
-           "execution\n");
-    printf("NOTE: all options are ON by default\n");
+    sim_printf("syntax: option <option> on|off\n   options include:\n");
+    sim_printf("      device -- simulate random device (keyboard/display)"
+               "timing\n");
+    sim_printf("      flush  -- flush console input each time LC-3 starts\n");
+    sim_printf("      keep   -- keep remaining input when the LC-3 stops\n");
+    sim_printf("      stdin  -- use stdin for LC-3 console input during "
+               "script execution\n");
+    sim_printf("NOTE: all options are ON by default\n");
+    sim_printf("       option budget <instructions>|off\n");
+    sim_printf("       option timeout <milliseconds>|off\n");
+    sim_printf("      limit each run of the LC-3 (off by default)\n");
 }
 
 // The "next" instruction (execute 1 LC-3 instruction)
@@ -1711,7 +4974,7 @@ static void cmd_next(const char *args) {
     flush_console_input();
 
     /* Note that we might hit a breakpoint immediately. */
-    if (execute_instruction()) {
+    if (step_instruction()) {
         if ((last_flags & FLG_SUBROUTINE) != 0) {
             /*
              * Mark system breakpoint. This approach allows the GUI
@@ -1736,14 +4999,91 @@ static void cmd_printregs(const char *args) {
     print_registers();
 }
 
+// Prints the syntax of the "profile" command
+static void profile_usage(void) {
+    sim_printf("profile options include:\n");
+    sim_printf("  profile on|off           -- start or stop counting "
+               "instructions\n");
+    sim_printf("  profile reset            -- discard the counts so far\n");
+    sim_printf("  profile labels [<count>] -- show the labels that ran the "
+               "most instructions\n");
+    sim_printf("  profile list ...         -- list instructions with their "
+               "counts\n");
+    sim_printf("  profile calls            -- show the calls made, with "
+               "instruction counts\n");
+    sim_printf("  profile folded <file>    -- write call stacks for flame "
+               "graph tools\n");
+}
+
+// The "profile" command (counts the instructions run at each address)
+static void cmd_profile(const char *args) {
+    static unsigned long long total[PROFILE_MAX_NODES];
+    char opt[11], word[MAX_LABEL_LEN], trash[2];
+    int start, end, count = 20;
+
+    if (scan_word(&args, opt, sizeof(opt)) == 0) {
+        profile_usage();
+        return;
+    }
+    if (strcasecmp(opt, "on") == 0 || strcasecmp(opt, "off") == 0 ||
+        strcasecmp(opt, "reset") == 0) {
+        if (scan_word(&args, trash, sizeof(trash)) != 0)
+            warn_too_many_args();
+        if (strcasecmp(opt, "off") == 0)
+            profiling = false;
+        else if (strcasecmp(opt, "reset") == 0 || prof_num_nodes == 0)
+            reset_profile();
+        if (strcasecmp(opt, "on") == 0)
+            profiling = true;
+        if (!gui_mode)
+            sim_printf("Profiling is %s.\n", (profiling ? "on" : "off"));
+        return;
+    }
+    if (strcasecmp(opt, "list") == 0) {
+        if (parse_range(args, &start, &end, -1, 10) == -1)
+            profile_usage();
+        else
+            profile_list(start, end);
+        return;
+    }
+    if (strcasecmp(opt, "folded") == 0) {
+        while (isspace(*args))
+            args++;
+        if (*args == '\0')
+            profile_usage();
+        else if (profile_folded(args) == -1)
+            sim_error("Could not write \"%s\".", args);
+        return;
+    }
+    if (strcasecmp(opt, "labels") == 0 && scan_word(&args, word, sizeof(word))
+        != 0 && (!parse_number(word, 10, &count) || count < 1)) {
+        profile_usage();
+        return;
+    }
+    if (scan_word(&args, trash, sizeof(trash)) != 0)
+        warn_too_many_args();
+    if (strcasecmp(opt, "labels") == 0)
+        profile_labels(count);
+    else if (strcasecmp(opt, "calls") != 0)
+        profile_usage();
+    else if (prof_num_nodes == 0)
+        sim_printf("No instructions have been profiled.\n");
+    else {
+        profile_totals(total);
+        sim_printf("%10s %12s %12s  routine\n", "calls", "self", "total");
+        profile_calls(0, total);
+    }
+}
+
 // The "quit" command
 static void cmd_quit(const char *args) {
     no_args_allowed(args);
+    end_response("quit");
     exit(0);
 }
 
-// The "register" command
-static void cmd_register(const char *args) {
+// Sets one register (or CC) for the "register" command
+static bool set_register(const char *arg1, const char *arg2) {
     static const char * const rname[NUM_REGS + 1] = {
         "R0", "R1", "R2", "R3", "R4", "R5", "R6", "R7",
         "PC", "IR", "PSR", "CC"
@@ -1751,23 +5091,14 @@ static void cmd_register(const char *args) {
     static const char * const cc_val[4] = {
         "POSITIVE", "ZERO", "", "NEGATIVE"
     };
-    char arg1[MAX_LABEL_LEN], arg2[MAX_LABEL_LEN], trash[2];
-    int num_args, rnum, value, len;
-
-    /* 80 == MAX_LABEL_LEN - 1 */
-    num_args = sscanf(args, "%80s%80s%1s", arg1, arg2, trash);
-    if (num_args < 2) {
-        /* should never happen in GUI mode */
-        printf("syntax: register <reg> <value>\n");
-        return;
-    }
+    int rnum, value, len;
 
     /* Determine which register is to be set. */
     for (rnum = 0; ; rnum++) {
         if (rnum == NUM_REGS + 1) {
             /* No match (should never happen in GUI mode). */
-            puts("Registers are R0...R7, PC, IR, PSR, and CC.");
-            return;
+            sim_puts("Registers are R0...R7, PC, IR, PSR, and CC.");
+            return false;
         }
         if (strcasecmp(rname[rnum], arg1) == 0)
             break;
@@ -1780,37 +5111,116 @@ static void cmd_register(const char *args) {
             if (strncasecmp(arg2, cc_val[value], len) == 0) {
                 REG(R_PSR) &= ~0x0E00;
                 REG(R_PSR) |= ((value + 1) << 9);
+                forget_history();
                 if (gui_mode)
                     /* printing PSR prints both PSR and CC */
                     print_register(R_PSR);
                 else
-                    printf("Set CC to %s.\n", cc_val[value]);
-                return;
+                    sim_printf("Set CC to %s.\n", cc_val[value]);
+                return true;
             }
         }
-        if (gui_mode)
-            printf("ERR {CC can only be set to NEGATIVE, ZERO, or "
-                   "POSITIVE.}\n");
-        else
-            printf("CC can only be set to NEGATIVE, ZERO, or "
-                   "POSITIVE.\n");
-        return;
+        sim_error("CC can only be set to NEGATIVE, ZERO, or POSITIVE.");
+        return false;
     }
 
     /* Parse the value and set the register, or complain if it's a bad
        value. */
     if ((value = parse_address(arg2)) != -1) {
         REG(rnum) = value;
+        forget_history();
         if (gui_mode)
             print_register(rnum);
         else
-            printf("Set %s to x%04X.\n", rname[rnum], value);
-    } else if (gui_mode)
-        printf("ERR {No address or label corresponding to the "
-               "desired value exists.}\n");
-    else
-        puts("No address or label corresponding to the "
-             "desired value exists.");
+            sim_printf("Set %s to x%04X.\n", rname[rnum], value);
+        return true;
+    }
+    sim_error("No address or label corresponding to the desired value "
+              "exists.");
+    return false;
+}
+
+// The "rcontinue" command (runs backward to the last breakpoint)
+static void cmd_rcontinue(const char *args) {
+    no_args_allowed(args);
+    if (!undo_instruction())
+        report_history_start();
+    else {
+        while (!breakpoint_stops_at(REG(R_PC))) {
+            if (!undo_instruction()) {
+                report_history_start();
+                break;
+            }
+        }
+    }
+    show_state_if_stop_visible();
+}
+
+// The "record" command (logs nondeterministic events for replay)
+static void cmd_record(const char *args) {
+    while (isspace(*args))
+        args++;
+    if (*args == '\0') {
+        if (!gui_mode)
+            sim_printf("Recording is %s.\n",
+                       (record_file != NULL ? "on" : "off"));
+        return;
+    }
+    if (strcasecmp(args, "off") == 0)
+        record_close();
+    else if (record_open(args) == -1) {
+        if (gui_mode)
+            sim_printf("ERR {Could not open the record log.}\n");
+        else
+            sim_error("Could not open \"%s\".", args);
+        return;
+    }
+    if (!gui_mode)
+        sim_printf("Recording is %s.\n", (record_file != NULL ? "on" : "off"));
+}
+
+// The "register" command (any number of register/value pairs)
+static void cmd_register(const char *args) {
+    char arg1[MAX_LABEL_LEN], arg2[MAX_LABEL_LEN];
+
+    if (scan_word(&args, arg1, sizeof(arg1)) == 0 ||
+        scan_word(&args, arg2, sizeof(arg2)) == 0) {
+        /* should never happen in GUI mode */
+        sim_printf("syntax: register <reg> <value> [<reg> <value>...]\n");
+        return;
+    }
+    /* Stop at the first bad pair. */
+    while (set_register(arg1, arg2) &&
+           scan_word(&args, arg1, sizeof(arg1)) != 0) {
+        if (scan_word(&args, arg2, sizeof(arg2)) == 0) {
+            sim_printf("syntax: register <reg> <value> [<reg> <value>...]\n");
+            break;
+        }
+    }
+}
+
+// The "replay" command (repeats the events of a recorded run)
+static void cmd_replay(const char *args) {
+    while (isspace(*args))
+        args++;
+    if (*args == '\0') {
+        if (!gui_mode)
+            sim_printf("Replay is %s.\n", (replay_file != NULL ? "on" : "off"));
+        return;
+    }
+    if (strcasecmp(args, "off") == 0) {
+        if (replay_file != NULL)
+            fclose(replay_file);
+        replay_file = NULL;
+    } else if (replay_open(args) == -1) {
+        if (gui_mode)
+            sim_printf("ERR {Could not read the replay log.}\n");
+        else
+            sim_error("Could not read a replay log from \"%s\".", args);
+        return;
+    }
+    if (!gui_mode)
+        sim_printf("Replay is %s.\n", (replay_file != NULL ? "on" : "off"));
 }
 
 // The "reset" command
@@ -1819,10 +5229,7 @@ static void cmd_reset(const char *args) {
 
     if (script_depth > 0) {
         /* Should never be executing a script in GUI mode, but check... */
-        if (!gui_mode)
-            puts("Cannot reset the LC-3 from within a script.");
-        else
-            puts("ERR {Cannot reset the LC-3 from within a script.}");
+        sim_error("Cannot reset the LC-3 from within a script.");
         return;
     }
     no_args_allowed(args);
@@ -1830,11 +5237,14 @@ static void cmd_reset(const char *args) {
     /*
      * If in GUI mode, we need to write over all memory with zeroes
      * rather than just setting (so that disassembly info gets sent
-     * to GUI).
+     * to GUI).  Below the device page, restore_word just marks the
+     * words that change, without write_memory's checks.
      */
     if (gui_mode) {
         interrupted_at_gui_request = false;
-        for (addr = 0; addr < 65536; addr++)
+        for (addr = 0; addr < 0xFE00; addr++)
+            restore_word(addr, 0);
+        for (; addr < 65536; addr++)
             write_memory(addr, 0);
         gui_stop_and_dump();
     }
@@ -1851,46 +5261,389 @@ static void cmd_reset(const char *args) {
 
     /* change focus in GUI, and turn off delay cursor */
     if (gui_mode)
-        printf("TOCODE\n");
+        sim_printf("TOCODE\n");
+}
+
+// Name of a TRAP vector in lc3.def, or NULL
+static const char * trap_name(int vec) {
+#define DEF_INST(name,format,mask,match,flags,code)
+#define DEF_P_OP(name,format,mask,match)              \
+    if ((mask) == 0xFFFF && (match) == (0xF000 | vec)) \
+        return #name;
+#include "lc3.def"
+#undef DEF_P_OP
+#undef DEF_INST
+    return NULL;
+}
+
+// Mnemonics for an opcode in lc3.def (such as "JSR/JSRR")
+static const char * opcode_name(int opcode) {
+    static char buf[40];
+    const char *last = NULL;
+
+    buf[0] = '\0';
+#define DEF_INST(name,format,mask,match,flags,code)                   \
+    if (((match) >> 12) == opcode &&                                  \
+        (last == NULL || strcmp(last, #name) != 0)) {                 \
+        if (last != NULL)                                             \
+            strcat(buf, "/");                                         \
+        strcat(buf, (last = #name));                                  \
+    }
+#define DEF_P_OP(name,format,mask,match)
+#include "lc3.def"
+#undef DEF_P_OP
+#undef DEF_INST
+    return buf;
+}
+
+// Prints the performance counters
+static void print_stats(void) {
+    const unsigned long long *n = lc3_stats.opcodes;
+    unsigned long long insns = 0, loads, stores;
+    long long busy_ns = lc3_stats.run_ns - lc3_stats.wait_ns;
+    const char *name;
+    char key[20];
+    int i;
+
+    for (i = 0; i < 16; i++)
+        insns += n[i];
+    /* LDI and STI also load a pointer, and TRAP loads its vector. */
+    loads = n[0x2] + n[0x6] + 2 * n[0xA] + n[0xB] + n[0xF];
+    stores = n[0x3] + n[0x7] + n[0xB];
+
+    if (json_mode) {
+        begin_record("stats");
+        json_number("insns", insns);
+        json_number("loads", loads);
+        json_number("stores", stores);
+        json_number("run_us", lc3_stats.run_ns / 1000);
+        json_number("wait_us", lc3_stats.wait_ns / 1000);
+        for (i = 0; i < 16; i++)
+            if (*(name = opcode_name(i)) != '\0')
+                json_number(name, n[i]);
+        for (i = 0; i < 256; i++) {
+            if (lc3_stats.traps[i] == 0)
+                continue;
+            sprintf(key, "TRAP x%02X", i);
+            json_number(key, lc3_stats.traps[i]);
+        }
+        for (i = 0; i < NUM_DEVICES; i++) {
+            sprintf(key, "%s reads", device_names[i]);
+            json_number(key, lc3_stats.dev_reads[i]);
+            sprintf(key, "%s writes", device_names[i]);
+            json_number(key, lc3_stats.dev_writes[i]);
+        }
+        json_end();
+        return;
+    }
+
+    sim_printf("Instructions: %llu (%llu loads, %llu stores)\n", insns,
+               loads, stores);
+    sim_printf("Host time:    %.3f ms running, %.3f ms waiting for input",
+               busy_ns / 1e6, lc3_stats.wait_ns / 1e6);
+    if (busy_ns > 0)
+        sim_printf(" (%.2f MIPS)", insns * 1e3 / busy_ns);
+    sim_printf("\n");
+    if (insns > 0) {
+        sim_printf("Opcode mix:\n");
+        for (i = 0; i < 16; i++)
+            if (n[i] > 0)
+                sim_printf("  %-8s %12llu %6.2f%%\n", opcode_name(i), n[i],
+                           n[i] * 100.0 / insns);
+    }
+    if (n[0xF] > 0) {
+        sim_printf("TRAPs:\n");
+        for (i = 0; i < 256; i++) {
+            if (lc3_stats.traps[i] == 0)
+                continue;
+            name = trap_name(i);
+            sim_printf("  x%02X %-5s %12llu\n", i, (name != NULL ? name : ""),
+                       lc3_stats.traps[i]);
+        }
+    }
+    sim_printf("Device registers (reads/writes):\n");
+    for (i = 0; i < NUM_DEVICES; i++)
+        sim_printf("  %-4s %12llu %12llu\n", device_names[i],
+                   lc3_stats.dev_reads[i], lc3_stats.dev_writes[i]);
+}
+
+// The "restore" command (replaces the machine with a snapshot)
+static void cmd_restore(const char *args) {
+    int dropped = count_conditions();
+
+    while (isspace(*args))
+        args++;
+    if (*args == '\0') {
+        sim_printf("syntax: restore <file>\n");
+        return;
+    }
+    if (restore_snapshot(args) == -1) {
+        if (gui_mode)
+            sim_printf("ERR {Could not restore the snapshot.}\n");
+        else
+            sim_error("Could not restore a snapshot from \"%s\".", args);
+        return;
+    }
+    if (!gui_mode)
+        sim_printf("Restored \"%s\".\n", args);
+    if (!gui_mode && dropped > 0)
+        sim_printf("Dropped the conditions and commands of %d "
+                   "breakpoint%s.\n", dropped, (dropped == 1 ? "" : "s"));
+    show_state_if_stop_visible();
+}
+
+// The "rnext" command (steps backward over subroutine calls)
+static void cmd_rnext(const char *args) {
+    int inst, depth = 0;
+
+    no_args_allowed(args);
+    do {
+        /* Count the returns and calls undone on the way. */
+        inst = REG(R_IR);
+        if (!undo_instruction()) {
+            report_history_start();
+            break;
+        }
+        if (inst == 0xC1C0)
+            depth++;
+        else if ((inst >> 12) == 0x4 || (inst >> 12) == 0xF)
+            depth--;
+    } while (depth > 0 && !breakpoint_stops_at(REG(R_PC)));
+    show_state_if_stop_visible();
+}
+
+// The "rstep" command (undoes one instruction)
+static void cmd_rstep(const char *args) {
+    no_args_allowed(args);
+    if (!undo_instruction())
+        report_history_start();
+    show_state_if_stop_visible();
+}
+
+// The "sanitize" command (checks memory use as the LC-3 runs)
+static void cmd_sanitize(const char *args) {
+    char opt[11], trash[2];
+
+    if (scan_word(&args, opt, sizeof(opt)) == 0) {
+        print_sanitizer();
+        return;
+    }
+    if (scan_word(&args, trash, sizeof(trash)) != 0)
+        warn_too_many_args();
+    if (strcasecmp(opt, "on") == 0)
+        sanitizing = true;
+    else if (strcasecmp(opt, "off") == 0)
+        sanitizing = false;
+    else if (strcasecmp(opt, "reset") == 0) {
+        memset(san_reported, 0, sizeof(san_reported));
+        memset(san_counts, 0, sizeof(san_counts));
+        san_stack_lo = san_stack_hi = -1;
+    } else {
+        sim_printf("syntax: sanitize [on|off|reset]\n");
+        return;
+    }
+    if (!gui_mode)
+        sim_printf("The sanitizer is %s.\n", (sanitizing ? "on" : "off"));
+}
+
+// The "save" command (writes the machine to a snapshot file)
+static void cmd_save(const char *args) {
+    int dropped;
+
+    while (isspace(*args))
+        args++;
+    if (*args == '\0') {
+        sim_printf("syntax: save <file>\n");
+        return;
+    }
+    if (save_snapshot(args) == -1) {
+        if (gui_mode)
+            sim_printf("ERR {Could not save the snapshot.}\n");
+        else
+            sim_error("Could not write \"%s\".", args);
+    } else if (!gui_mode) {
+        sim_printf("Saved the machine to \"%s\".\n", args);
+        if ((dropped = count_conditions()) > 0)
+            sim_printf("The conditions and commands of %d breakpoint%s "
+                       "were not saved.\n", dropped,
+                       (dropped == 1 ? "" : "s"));
+    }
+}
+
+// The "stats" command (show or clear performance counters)
+static void cmd_stats(const char *args) {
+    char opt[11], trash[2];
+
+    if (scan_word(&args, opt, sizeof(opt)) == 0) {
+        print_stats();
+        return;
+    }
+    if (scan_word(&args, trash, sizeof(trash)) != 0)
+        warn_too_many_args();
+    if (strcasecmp(opt, "reset") != 0) {
+        sim_printf("syntax: stats [reset]\n");
+        return;
+    }
+    memset(&lc3_stats, 0, sizeof(lc3_stats));
+    if (!gui_mode)
+        sim_printf("Cleared the performance counters.\n");
 }
 
 // The "step" command ("step into" an instruction like a debugger)
 static void cmd_step(const char *args) {
     no_args_allowed(args);
     flush_console_input();
-    execute_instruction();
+    step_instruction();
     /* Dump memory and registers if necessary. */
     show_state_if_stop_visible();
 }
 
+// The "trace" command (records each instruction run in a binary file)
+static void cmd_trace(const char *args) {
+    while (isspace(*args))
+        args++;
+    if (*args == '\0') {
+        if (!gui_mode)
+            sim_printf("Tracing is %s.\n", (trace_file != NULL ? "on" : "off"));
+        return;
+    }
+    if (strcasecmp(args, "off") == 0)
+        trace_close();
+    else if (trace_open(args) == -1) {
+        if (gui_mode)
+            sim_printf("ERR {Could not open the trace file.}\n");
+        else
+            sim_error("Could not open \"%s\".", args);
+        return;
+    }
+    if (!gui_mode)
+        sim_printf("Tracing is %s.\n", (trace_file != NULL ? "on" : "off"));
+}
+
 // The "translate" command (read value at memory address)
 static void cmd_translate(const char *args) {
-    char arg1[81], trash[2];
-    int num_args, value;
-
-    /* 80 == MAX_LABEL_LEN - 1 */
-    if ((num_args = sscanf(args, "%80s%1s", arg1, trash)) > 1)
-        warn_too_many_args();
+    char arg1[MAX_LABEL_LEN], trash[2];
+    int value;
 
-    if (num_args < 1) {
-        puts("syntax: translate <addr>");
+    if (scan_word(&args, arg1, sizeof(arg1)) == 0) {
+        sim_puts("syntax: translate <addr>");
         return;
     }
+    if (scan_word(&args, trash, sizeof(trash)) != 0)
+        warn_too_many_args();
 
     /* Try to translate the value. */
     if ((value = parse_address(arg1)) == -1) {
         if (gui_mode)
-            printf("ERR {No such address or label exists.}\n");
+            sim_printf("ERR {No such address or label exists.}\n");
         else
-            puts(BAD_ADDRESS);
+            sim_error(BAD_ADDRESS);
         return;
     }
 
     if (gui_mode)
-        printf("TRANS x%04X x%04X\n", value, read_memory(value));
+        sim_printf("TRANS x%04X x%04X\n", value, read_memory(value));
     else
-        printf("Address x%04X has value x%04x.\n", value,
-               read_memory(value));
+        sim_printf("Address x%04X has value x%04x.\n", value,
+                   read_memory(value));
+}
+
+// The option that opt abbreviates, or -1 if it abbreviates none or several
+static int match_option(const char *opt, const char * const *names, int num) {
+    size_t len = strlen(opt);
+    int found = -1;
+
+    for (int i = 0; i < num; i++) {
+        if (strncasecmp(opt, names[i], len) != 0)
+            continue;
+        if (found != -1)
+            return -1;
+        found = i;
+    }
+    return found;
+}
+
+// The "watch" command (manages watchpoints)
+static void cmd_watch(const char *args) {
+    /* kinds first, in the order of their watch flags */
+    static const char * const options[] = {
+        "read", "write", "change", "clear", "list"
+    };
+    enum {OPT_CLEAR = 3, OPT_LIST};
+    char opt[11], arg1[MAX_LABEL_LEN], arg2[MAX_LABEL_LEN], trash[2];
+    int num_args, start, end, kind;
+
+    /* 80 == MAX_LABEL_LEN - 1 */
+    num_args = sscanf(args, "%10s%80s%80s%1s", opt, arg1, arg2, trash);
+
+    /* "c" could be clear or change, so it matches neither. */
+    if (num_args > 0 && (kind = match_option(opt, options, 5)) != -1) {
+        if (kind == OPT_LIST) {
+            if (num_args > 1)
+                warn_too_many_args();
+            list_watches();
+            return;
+        }
+        if (num_args > 1) {
+            if (num_args > 3)
+                warn_too_many_args();
+            if (kind == OPT_CLEAR && strcasecmp(arg1, "all") == 0) {
+                clear_watches(0, 0x10000);
+                if (!gui_mode)
+                    sim_printf("Cleared all watchpoints.\n");
+                return;
+            }
+            start = parse_address(arg1);
+            end = (num_args > 2 ? parse_address(arg2) : start);
+            if (start == -1 || end == -1) {
+                sim_error(BAD_ADDRESS);
+                return;
+            }
+            if (end < start) {
+                sim_error("The end of a watched range cannot come before "
+                          "its start.");
+                return;
+            }
+            if (kind == OPT_CLEAR) {
+                clear_watches(start, end + 1);
+                if (!gui_mode)
+                    sim_printf("Cleared watchpoints on x%04X-x%04X.\n",
+                               start, end);
+                return;
+            }
+            set_watches(start, end + 1, 1 << kind);
+            if (!gui_mode && start == end)
+                sim_printf("Watching x%04X for %ss.\n", start,
+                           options[kind]);
+            else if (!gui_mode)
+                sim_printf("Watching x%04X-x%04X for %ss.\n", start,
+                           end, options[kind]);
+            return;
+        }
+    }
+
+    // Print help for command
+    sim_printf("watchpoint options include:\n");
+    sim_printf("  watch read <a1> [<a2>]      -- stop on loads from an address "
+               "or range\n");
+    sim_printf("  watch write <a1> [<a2>]     -- stop on stores to an address "
+               "or range\n");
+    sim_printf("  watch change <a1> [<a2>]    -- stop on stores that change "
+               "the value\n");
+    sim_printf("  watch clear <a1> [<a2>]|all -- clear watchpoints\n");
+    sim_printf("  watch list                  -- list all watchpoints\n");
+}
+
+// The GUI's "protocol" command (agrees on a GUI protocol version)
+static void cmd_protocol(const char *args) {
+    int version;
+    char trash[2];
+
+    /* Unknown versions fall back to the text protocol. */
+    if (sscanf(args, "%d%1s", &version, trash) != 1 || version < 1)
+        version = 1;
+    gui_protocol = (version >= 2 ? 2 : 1);
+    sim_printf("PROTOCOL %d\n", gui_protocol);
 }
 
 // The GUI's "stop" command
@@ -1904,12 +5657,49 @@ static void cmd_lc3_stop(const char *args) {
 // The main program
 
 
+// Prints command-line syntax
+static void print_usage(void) {
+    /* argv[0] may not be valid if -gui entered */
+    printf("syntax: lc3sim [<limits>] [<object file>|<symbol file>]\n");
+    printf("        lc3sim [<limits>] [-s <script file>]\n");
+    printf("        lc3sim [<limits>] [--cache <dir>] --batch <object file> "
+           "<input file>...\n");
+    printf("        lc3sim --host <socket> [--threads <n>] <object file>\n");
+    printf("        lc3sim --serve <socket> [<object file>|-s <script file>]\n");
+    printf("        lc3sim [<limits>] --restore <snapshot> [<object file>|"
+           "-s <script file>]\n");
+    printf("        lc3sim -h\n");
+    printf("limits: --max-insns <instructions> --timeout <milliseconds>\n");
+    printf("        --expect <expected output file>\n");
+    printf("output: --output=jsonl (JSON records instead of text)\n");
+    printf("        --stats (print performance counters at exit)\n");
+    printf("        --coverage <file> (write an lcov tracefile at exit)\n");
+    printf("        --sanitize (check memory use, and report at exit)\n");
+    printf("        --trace <file> (record each instruction run, for "
+           "lc3trace)\n");
+    printf("replay: --seed <n> (seed device timing) --record <file> "
+           "--replay <file>\n");
+    printf("checks: --assert <assertion> --hash \"<addr1> <addr2>\" "
+           "(with -s)\n");
+}
+
 int main(int argc, char **argv) {
+    const char *host_socket = NULL, *serve_socket = NULL, *cache_dir = NULL;
+    const char *trace_name = NULL, *record_name = NULL, *replay_name = NULL;
+    int host_threads = 1;
+    bool batch = false, show_stats = false;
+    unsigned long long limit;
+    /* --assert and --hash checks, run after the script */
+    command_func_t *final_func = calloc(argc, sizeof(*final_func));
+    const char **final_args = calloc(argc, sizeof(*final_args));
+    int num_final = 0, i;
+    int argn;
+
     /* check for -gui argument */
     sim_in = stdin;
     if (argc > 1 && strcmp (argv[1], "-gui") == 0) {
         if (launch_gui_connection() != 0) {
-            printf("failed to connect to GUI\n");
+            sim_printf("failed to connect to GUI\n");
             return 1;
         }
         /* skip the -gui argument in later parsing */
@@ -1925,31 +5715,200 @@ int main(int argc, char **argv) {
 #endif
     }
 
+    /* parse options; any object, symbol, or script file is loaded by
+       init_machine */
+    for (argn = 1; argn < argc; argn++) {
+        const char *arg = argv[argn];
+        bool has_value = (argn + 1 < argc);
+
+        if (strcmp(arg, "--batch") == 0 && !gui_mode) {
+            /* the rest are the object file and inputs */
+            batch = true;
+            argn++;
+            break;
+        } else if (strcmp(arg, "--host") == 0 && has_value && !gui_mode) {
+            host_socket = argv[++argn];
+        } else if (strcmp(arg, "--serve") == 0 && has_value && !gui_mode) {
+            serve_socket = argv[++argn];
+        } else if (strcmp(arg, "--expect") == 0 && has_value) {
+            if (load_expected_output(argv[++argn]) == -1) {
+                sim_error("Cannot read expected output file \"%s\".",
+                          argv[argn]);
+                return 1;
+            }
+        } else if ((strcmp(arg, "--assert") == 0 ||
+                    strcmp(arg, "--hash") == 0) && has_value) {
+            final_func[num_final] = (arg[2] == 'a' ? cmd_assert : cmd_hash);
+            final_args[num_final++] = argv[++argn];
+        } else if (strncmp(arg, "--output=", 9) == 0 && !gui_mode) {
+            if (strcmp(arg + 9, "jsonl") == 0)
+                json_mode = true;
+            else if (strcmp(arg + 9, "text") != 0) {
+                print_usage();
+                return 0;
+            }
+        } else if (strcmp(arg, "--stats") == 0) {
+            show_stats = true;
+        } else if (strcmp(arg, "--sanitize") == 0) {
+            sanitizing = true;
+        } else if (strcmp(arg, "--coverage") == 0 && has_value) {
+            lcov_at_exit = argv[++argn];
+        } else if (strcmp(arg, "--trace") == 0 && has_value) {
+            trace_name = argv[++argn];
+        } else if (strcmp(arg, "--record") == 0 && has_value) {
+            record_name = argv[++argn];
+        } else if (strcmp(arg, "--replay") == 0 && has_value) {
+            replay_name = argv[++argn];
+        } else if (strcmp(arg, "--restore") == 0 && has_value) {
+            start_snapshot = argv[++argn];
+        } else if (strcmp(arg, "--seed") == 0 && has_value) {
+            if (!parse_unsigned(argv[++argn], ULLONG_MAX, &limit)) {
+                print_usage();
+                return 0;
+            }
+            have_seed = true;
+            seed_option = limit;
+        } else if (strcmp(arg, "--cache") == 0 && has_value) {
+            cache_dir = argv[++argn];
+        } else if (strcmp(arg, "--max-insns") == 0 && has_value) {
+            if (!parse_run_limit(argv[++argn], ULLONG_MAX, &max_insns)) {
+                print_usage();
+                return 0;
+            }
+        } else if (strcmp(arg, "--timeout") == 0 && has_value) {
+            if (!parse_run_limit(argv[++argn], INT_MAX, &limit)) {
+                print_usage();
+                return 0;
+            }
+            timeout_ms = (int)limit;
+        } else if (strcmp(arg, "--threads") == 0 && has_value) {
+            if ((host_threads = atoi(argv[++argn])) < 1) {
+                print_usage();
+                return 0;
+            }
+        } else if (strcmp(arg, "-s") == 0 && has_value &&
+                   start_script == NULL) {
+            start_script = argv[++argn];
+        } else if (arg[0] == '-' || start_file != NULL) {
+            print_usage();
+            return 0;
+        } else
+            start_file = strdup(arg);
+    }
+
+    /* JSON records are written in large blocks, so make sure the last
+       block is written however the simulator exits. */
+    if (json_mode) {
+        atexit(finish_json);
+        lc3readline = simple_readline;
+    }
+
+    /* the counters, coverage, sanitizer, trace, replay logs and snapshots
+       cover the command loop's LC-3 only */
+    if ((show_stats || lcov_at_exit != NULL || sanitizing ||
+         trace_name != NULL || record_name != NULL ||
+         replay_name != NULL || start_snapshot != NULL) &&
+        (batch || host_socket != NULL)) {
+        print_usage();
+        return 0;
+    }
+
+    /* run a batch of inputs without the command loop */
+    if (batch) {
+        if (argc - argn < 2) {
+            print_usage();
+            return 0;
+        }
+        if (cache_dir != NULL && cache_open(cache_dir) == -1)
+            return 1;
+        return run_batch(argv[argn], argc - argn - 1, argv + argn + 1,
+                         cache_dir != NULL);
+    }
+
+    /* only batch runs are cached */
+    if (cache_dir != NULL) {
+        print_usage();
+        return 0;
+    }
+
+    /* serve sessions until killed */
+    if (host_socket != NULL) {
+        if (start_file == NULL || start_script != NULL ||
+            serve_socket != NULL || json_mode) {
+            print_usage();
+            return 0;
+        }
+        return run_host(host_socket, start_file, host_threads);
+    }
+
+    if (start_script != NULL && start_file != NULL) {
+        print_usage();
+        return 0;
+    }
+
     /* used to simulate random device timing behavior */
-    srandom(time(NULL));
+    seed_random(have_seed ? seed_option : (unsigned long long)time(NULL));
 
     /* used to halt LC-3 when CTRL-C pressed */
     signal(SIGINT, halt_lc3);
 
-    /* load any object, symbol, or script files requested on command line */
-    if (argc == 3 && strcmp(argv[1], "-s") == 0) {
-        start_script = argv[2];
-        init_machine(); /* also executes script */
+    if (serve_socket != NULL)
+        return serve_sessions(serve_socket);
+
+    if (num_final > 0 && start_script == NULL) {
+        print_usage();
         return 0;
-    } else if (argc == 2 && strcmp(argv[1], "-h") != 0) {
-        start_file = strdup(argv[1]);
-        init_machine(); /* also loads file */
-    } else if (argc != 1) {
-        /* argv[0] may not be valid if -gui entered */
-        printf("syntax: lc3sim [<object file>|<symbol file>]\n");
-        printf("        lc3sim [-s <script file>]\n");
-        printf("        lc3sim -h\n");
+    }
+
+    if (show_stats)
+        atexit(print_stats);
+    if (lcov_at_exit != NULL) {
+        covering = true;
+        atexit(write_lcov_at_exit);
+    }
+    if (sanitizing)
+        atexit(print_sanitizer);
+    if (trace_name != NULL) {
+        if (trace_open(trace_name) == -1) {
+            perror(trace_name);
+            return 1;
+        }
+        atexit(trace_close);
+    }
+    if (record_name != NULL) {
+        if (record_open(record_name) == -1) {
+            perror(record_name);
+            return 1;
+        }
+        atexit(record_close);
+    }
+    if (replay_name != NULL && replay_open(replay_name) == -1) {
+        sim_error("Could not read a replay log from \"%s\".", replay_name);
+        return 1;
+    }
+
+    init_machine(); /* also loads file or executes script */
+    end_response("start");
+    if (start_script != NULL) {
+        for (i = 0; i < num_final; i++) {
+            final_func[i](final_args[i]);
+            end_response(final_func[i] == cmd_assert ? "assert" : "hash");
+        }
+        /* Let whoever ran the script tell runaway programs apart. */
+        if (stop_reason == STOP_BUDGET)
+            return 4;
+        if (stop_reason == STOP_TIMEOUT)
+            return 5;
+        if (expect_ever_failed)
+            return 6;
+        if (assert_failures > 0)
+            return 7;
         return 0;
-    } else
-        init_machine();
+    }
 
     command_loop();
 
-    puts("");
+    if (!json_mode)
+        puts("");
     return 0;
 }
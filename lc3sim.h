@@ -35,6 +35,9 @@
 
 #pragma once
 
+#include <stdbool.h>
+#include <stddef.h>
+
 /* field access macros; "i" is an instruction */
 
 #define F_DR(i)    (((i) >> 9) & 0x7)
@@ -110,3 +113,136 @@ enum reg_num_t {
 
 extern int read_memory(int addr);
 extern void write_memory(int addr, int value);
+
+/* Lockstep batch execution of one program against many inputs
+   (lc3lanes.c). */
+extern int run_lanes_batch(const int *image, int boot_pc, int start_pc,
+                           int num_inputs, char * const *inputs,
+                           unsigned long long max_insns, int timeout_ms,
+                           bool use_cache, bool json);
+
+/* Hosting many interactive sessions in one process (lc3host.c). */
+extern int run_lc3_host(const char *socket_path, const int *image,
+                        int boot_pc, int start_pc, int num_threads);
+extern int open_unix_listener(const char *path);
+
+/* Bulk compare, search and hash of memory ranges (lc3range.c). */
+extern int range_mismatch(const int *a, const int *b, int n);
+extern int range_find(const int *words, int n, const int *pattern,
+                      const int *masks, int len, int from);
+extern unsigned long long range_hash(const int *memory, int start,
+                                     int count);
+extern unsigned long long xxh64_bytes(const void *data, size_t len,
+                                      unsigned long long seed);
+
+/* On-disk cache of complete runs (lc3cache.c). */
+typedef struct cache_key_t cache_key_t;
+struct cache_key_t {
+    unsigned long long hi, lo;
+};
+
+typedef struct cache_record_t cache_record_t;
+struct cache_record_t {
+    int state;          /* how the run stopped (caller's encoding) */
+    int stop_pc;
+    unsigned long long insns;
+    unsigned long long reg_digest, mem_digest;
+    unsigned char *out; /* LC-3 output */
+    size_t out_len;
+};
+
+extern int cache_open(const char *dir);
+extern bool cache_key(const int *image, int start_pc,
+                      unsigned long long max_insns,
+                      const unsigned char *input, size_t input_len,
+                      cache_key_t *key);
+extern bool cache_lookup(const cache_key_t *key, int num_states,
+                         cache_record_t *rec);
+extern void cache_store(const cache_key_t *key, const cache_record_t *rec);
+
+/* JSON Lines records on standard output (lc3json.c). */
+extern void json_begin(const char *type);
+extern void json_string(const char *key, const char *value);
+extern void json_bytes(const char *key, const void *value, size_t len);
+extern void json_number(const char *key, unsigned long long value);
+extern void json_bool(const char *key, bool value);
+extern void json_end(void);
+extern void json_flush(void);
+
+/* Disassembly and .sym files, shared with lc3trace (lc3dis.c). */
+#define OPCODE_WIDTH       6              /* opcode column, with CCs  */
+#define DIS_LINE_LEN       (2 * 81 + 64)  /* room for a dis_line      */
+#define MAX_SOURCE_FILES 255              /* line table sources       */
+
+/*
+ * Progress through a .sym file: the header, the symbol table, then the
+ * line table that lc3as writes after it (source lines of instructions).
+ */
+typedef struct sym_reader_t sym_reader_t;
+struct sym_reader_t {
+    enum {SYM_HEADER, SYM_SYMBOLS, SYM_LINES} part;
+    int file;                   /* source file of the line table, or 0 */
+    const char *sym_file;       /* where it was read from, or NULL     */
+};
+
+extern unsigned int dis_sym_gen;
+extern unsigned char lc3_src_file[65536];
+extern int lc3_src_line[65536];
+extern char *src_names[MAX_SOURCE_FILES + 1];
+extern int num_src_names;
+
+extern int dis_inst(char *buf, int addr, int inst);
+extern int dis_line(char *buf, int addr, int inst);
+extern void read_sym_line(const char *buf, sym_reader_t *rd);
+extern int read_sym_file(const char *filename);
+
+/*
+ * Binary execution traces, written by lc3sim's trace command and read by
+ * lc3trace.  After the magic string, each retired instruction is one
+ * record: a flags byte, then the fields it flags in the order below.
+ * 16-bit fields are little-endian.  Fields that usually repeat are left
+ * out: the PC when it is one past the last record's, and the IR when it
+ * matches the last instruction recorded at that PC.  Memory addresses
+ * are the difference from the last address recorded, zigzag-encoded as
+ * a varint (seven bits per byte, low bits first).
+ */
+#define TRACE_MAGIC      "LC3TRC1\n"
+#define TRACE_PC         0x01  /* PC                                   */
+#define TRACE_IR         0x02  /* IR                                   */
+#define TRACE_REG        0x04  /* value written to trace_dest(IR)      */
+#define TRACE_ADDR       0x08  /* data address (see trace_access(IR))  */
+#define TRACE_VALUE      0x10  /* value stored, or TRAP vector read    */
+#define TRACE_MAX_RECORD 12    /* bytes in the longest record          */
+
+typedef enum trace_access_t trace_access_t;
+enum trace_access_t {
+    TRACE_NONE, TRACE_LOAD, TRACE_STORE, TRACE_VECTOR
+};
+
+/* The register an instruction writes, or -1 for none. */
+static inline int trace_dest(int ir) {
+    switch (ir >> 12) {
+        case 0x1: case 0x2: case 0x5: case 0x6:
+        case 0x9: case 0xA: case 0xE:
+            return F_DR(ir);
+        case 0x4: case 0xF:
+            return 7;
+        default:
+            return -1;
+    }
+}
+
+/* How an instruction uses data memory.  A load's value is the value
+   written to its register, so only stores and TRAPs record one. */
+static inline trace_access_t trace_access(int ir) {
+    switch (ir >> 12) {
+        case 0x2: case 0x6: case 0xA:
+            return TRACE_LOAD;
+        case 0x3: case 0x7: case 0xB:
+            return TRACE_STORE;
+        case 0xF:
+            return TRACE_VECTOR;
+        default:
+            return TRACE_NONE;
+    }
+}
@@ -0,0 +1,235 @@
+/* tab:8
+ *
+ * lc3trace.c - prints execution traces recorded by lc3sim
+ *
+ * Copyright (c) 2026 by LandonTheCoder.
+ *
+ * Permission to use, copy, modify, and distribute this software and its
+ * documentation for any purpose, without fee, and without written
+ * agreement is hereby granted, provided that the above copyright notice
+ * and the following two paragraphs appear in all copies of this software,
+ * that the files COPYING and NO_WARRANTY are included verbatim with
+ * any distribution, and that the contents of the file README are included
+ * verbatim as part of a file named README with any distribution.
+ *
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE TO ANY PARTY FOR DIRECT,
+ * INDIRECT, SPECIAL, INCIDENTAL, OR CONSEQUENTIAL DAMAGES ARISING OUT
+ * OF THE USE OF THIS SOFTWARE AND ITS DOCUMENTATION, EVEN IF THE AUTHOR
+ * HAS BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * THE AUTHOR SPECIFICALLY DISCLAIMS ANY WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE.  THE SOFTWARE PROVIDED HEREUNDER IS ON AN "AS IS"
+ * BASIS, AND THE AUTHOR NO OBLIGATION TO PROVIDE MAINTENANCE, SUPPORT,
+ * UPDATES, ENHANCEMENTS, OR MODIFICATIONS."
+ *
+ * Filename:	    lc3trace.c
+ *
+ * Decodes a trace written by lc3sim's trace command (see lc3sim.h for
+ * the format) and prints one line per instruction: its number in the
+ * trace, address, word and disassembly, and the register and memory
+ * values it produced.  Records leave out whatever the previous ones
+ * imply, so every record is decoded even when only some are printed.
+ */
+
+#include <ctype.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lc3sim.h"
+#include "symbol.h"
+
+#define OPERAND_WIDTH 20
+
+/* An inclusive range of addresses, which may wrap around xFFFF. */
+typedef struct addr_range_t addr_range_t;
+struct addr_range_t {
+    bool on;
+    int from, to;
+};
+
+/* The last instruction seen at each address. */
+static int trace_ir[65536];
+
+// Parses a label or a hexadecimal address (with optional x), or returns -1
+static int parse_address(const char *s) {
+    symbol_t *label;
+    char *end;
+    long value;
+
+    if ((label = find_symbol(s, NULL)) != NULL)
+        return label->addr;
+    if (tolower(*s) == 'x')
+        s++;
+    if (!isxdigit(*s))
+        return -1;
+    value = strtol(s, &end, 16);
+    if (*end != '\0' || value > 0xFFFF)
+        return -1;
+    return value;
+}
+
+// Parses "<from>[:<to>]"
+static bool parse_range(char *s, addr_range_t *range) {
+    char *colon = strchr(s, ':');
+
+    if (colon != NULL)
+        *colon = '\0';
+    range->on = true;
+    range->from = parse_address(s);
+    range->to = (colon != NULL ? parse_address(colon + 1) : range->from);
+    return range->from != -1 && range->to != -1;
+}
+
+static bool in_range(const addr_range_t *range, int addr) {
+    if (range->from <= range->to)
+        return range->from <= addr && addr <= range->to;
+    return addr >= range->from || addr <= range->to;
+}
+
+// Label at an address, or ""
+static const char * label_at(int addr) {
+    return (lc3_sym_names[addr] != NULL ? lc3_sym_names[addr]->name : "");
+}
+
+static bool get_word(FILE *f, int *value) {
+    int lo = getc(f), hi = getc(f);
+
+    *value = lo | (hi << 8);
+    return hi != EOF;
+}
+
+static bool get_varint(FILE *f, unsigned int *value) {
+    int c, shift = 0;
+
+    *value = 0;
+    do {
+        if ((c = getc(f)) == EOF || shift > 21)
+            return false;
+        *value |= (unsigned int)(c & 0x7F) << shift;
+        shift += 7;
+    } while (c & 0x80);
+    return true;
+}
+
+// Prints the records of a trace that pass the filters
+static int print_trace(FILE *f, const char *name, const addr_range_t *pcs,
+                       const addr_range_t *mem) {
+    char magic[sizeof(TRACE_MAGIC) - 1], text[DIS_LINE_LEN];
+    int flags, pc = 0, inst = 0, reg = 0, addr = 0, value = 0, dest;
+    unsigned long long num = 0;
+    trace_access_t access;
+    unsigned int zigzag;
+
+    if (fread(magic, sizeof(magic), 1, f) != 1 ||
+        memcmp(magic, TRACE_MAGIC, sizeof(magic)) != 0) {
+        fprintf(stderr, "%s is not an lc3sim trace.\n", name);
+        return 1;
+    }
+    memset(trace_ir, 0xFF, sizeof(trace_ir));
+    for (; (flags = getc(f)) != EOF; num++) {
+        if ((flags & TRACE_PC) != 0 && !get_word(f, &pc))
+            break;
+        if ((flags & TRACE_IR) != 0) {
+            if (!get_word(f, &trace_ir[pc]))
+                break;
+        } else if (trace_ir[pc] == -1)
+            break;
+        inst = trace_ir[pc];
+        if ((flags & TRACE_REG) != 0 && !get_word(f, &reg))
+            break;
+        if ((flags & TRACE_ADDR) != 0) {
+            if (!get_varint(f, &zigzag))
+                break;
+            addr = (addr + (int)((zigzag >> 1) ^ -(zigzag & 1))) & 0xFFFF;
+        }
+        if ((flags & TRACE_VALUE) != 0 && !get_word(f, &value))
+            break;
+        dest = trace_dest(inst);
+        access = trace_access(inst);
+
+        if ((pcs->on && !in_range(pcs, pc)) ||
+            (mem->on && (access == TRACE_NONE || !in_range(mem, addr)))) {
+            pc = (pc + 1) & 0xFFFF;
+            continue;
+        }
+        text[dis_inst(text, pc, inst)] = '\0';
+        printf("%12llu %16.16s x%04X x%04X ", num, label_at(pc), pc, inst);
+        printf((dest != -1 || access != TRACE_NONE ? "%-*s" : "%.*s"),
+               OPCODE_WIDTH + OPERAND_WIDTH, text);
+        if (dest != -1)
+            printf(" R%d=x%04X", dest, reg);
+        switch (access) {
+            case TRACE_LOAD:   printf(" <- mem[x%04X]", addr); break;
+            case TRACE_STORE:  printf(" mem[x%04X]=x%04X", addr, value); break;
+            case TRACE_VECTOR: printf(" PC=x%04X", value); break;
+            case TRACE_NONE:   break;
+        }
+        printf("\n");
+        pc = (pc + 1) & 0xFFFF;
+    }
+    if (flags != EOF) {
+        fprintf(stderr, "%s is damaged or cut short after %llu "
+                "instructions.\n", name, num);
+        return 1;
+    }
+    return 0;
+}
+
+static void print_usage(void) {
+    fprintf(stderr, "syntax: lc3trace [-s <symbol file>] [-p <from>[:<to>]] "
+            "[-m <from>[:<to>]] <trace file>\n");
+    fprintf(stderr, "        -p shows instructions at addresses in the "
+            "range; -m shows loads,\n");
+    fprintf(stderr, "        stores and TRAPs that use memory in it.  "
+            "Addresses are hex or labels.\n");
+}
+
+int main(int argc, char **argv) {
+    addr_range_t pcs = {false, 0, 0}, mem = {false, 0, 0};
+    const char *name = NULL;
+    FILE *f;
+    int argn, result;
+
+    /* Read the symbols first, so that ranges can use labels. */
+    for (argn = 1; argn + 1 < argc; argn++)
+        if (strcmp(argv[argn], "-s") == 0 &&
+            read_sym_file(argv[++argn]) == -1) {
+            perror(argv[argn]);
+            return 1;
+        }
+    for (argn = 1; argn < argc; argn++) {
+        if (strcmp(argv[argn], "-s") == 0 && argn + 1 < argc)
+            argn++;
+        else if (strcmp(argv[argn], "-p") == 0 && argn + 1 < argc) {
+            if (!parse_range(argv[++argn], &pcs)) {
+                print_usage();
+                return 2;
+            }
+        } else if (strcmp(argv[argn], "-m") == 0 && argn + 1 < argc) {
+            if (!parse_range(argv[++argn], &mem)) {
+                print_usage();
+                return 2;
+            }
+        } else if (argv[argn][0] == '-' || name != NULL) {
+            print_usage();
+            return 2;
+        } else
+            name = argv[argn];
+    }
+    if (name == NULL) {
+        print_usage();
+        return 2;
+    }
+    if ((f = fopen(name, "rb")) == NULL) {
+        perror(name);
+        return 1;
+    }
+    /* Traces are long; read them in large blocks. */
+    setvbuf(f, NULL, _IOFBF, 1 << 20);
+    result = print_trace(f, name, &pcs, &mem);
+    fclose(f);
+    return result;
+}
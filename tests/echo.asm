@@ -0,0 +1,17 @@
+;##############################################################################
+;#
+;# echo.asm -- echoes one line of console input, then halts
+;#
+;#  Used by the tests in this directory.
+;#
+;##############################################################################
+
+	.ORIG x3000
+
+AGAIN	GETC			; read a character
+	OUT			; and echo it
+	ADD R1,R0,#-10		; stop after the newline
+	BRnp AGAIN
+	HALT
+
+	.END
@@ -0,0 +1,63 @@
+#!/usr/bin/env python3
+# Checks that a hosted session (lc3sim --host, which has its own device
+# model) writes exactly what the plain simulator writes for the same
+# program and input.
+#
+# Usage: host-output.py LC3SIM OBJ
+
+import os
+import socket
+import subprocess
+import sys
+import tempfile
+
+lc3sim, obj = sys.argv[1:3]
+console_input = b'hello, host\n'
+
+with tempfile.TemporaryDirectory() as tmp:
+    path = os.path.join(tmp, 'sock')
+    server = subprocess.Popen([lc3sim, '--host', path, obj],
+                              stdout=subprocess.PIPE,
+                              stderr=subprocess.DEVNULL)
+    try:
+        # The host is listening once it says so.
+        line = b''
+        while not line.startswith(b'Serving'):
+            line = server.stdout.readline()
+            if not line:
+                sys.exit('lc3sim --host did not start')
+        s = socket.socket(socket.AF_UNIX)
+        s.connect(path)
+        s.settimeout(10)
+        s.sendall(console_input)
+        # The session closes the connection when the LC-3 halts.
+        hosted = b''
+        while True:
+            chunk = s.recv(4096)
+            if not chunk:
+                break
+            hosted += chunk
+    except socket.timeout:
+        sys.exit('no end of session, got %r' % hosted)
+    finally:
+        server.kill()
+        server.wait()
+
+    # The plain simulator stops with status 6 on the first byte that
+    # differs from the hosted output.
+    # Console input comes from a file, which always polls ready.
+    expected = os.path.join(tmp, 'expected')
+    script = os.path.join(tmp, 'script')
+    console = os.path.join(tmp, 'console')
+    with open(expected, 'wb') as f:
+        f.write(hosted)
+    with open(script, 'w') as f:
+        f.write('file %s\ncontinue\n' % os.path.abspath(obj))
+    with open(console, 'wb') as f:
+        f.write(console_input)
+    with open(console, 'rb') as f:
+        plain = subprocess.run([lc3sim, '--expect', expected, '-s', script],
+                               stdin=f, capture_output=True)
+    if plain.returncode != 0:
+        sys.exit('hosted output %r differs from the plain simulator:\n%s'
+                 % (hosted, plain.stdout.decode(errors='replace')))
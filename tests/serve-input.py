@@ -0,0 +1,44 @@
+#!/usr/bin/env python3
+# Checks that an lc3sim --serve session sees console input sent in the
+# same write as the command that runs the program.
+#
+# Usage: serve-input.py LC3SIM ECHO_OBJ
+
+import os
+import socket
+import subprocess
+import sys
+import tempfile
+
+lc3sim, echo_obj = sys.argv[1:3]
+
+with tempfile.TemporaryDirectory() as tmp:
+    path = os.path.join(tmp, 'sock')
+    server = subprocess.Popen([lc3sim, '--serve', path, echo_obj],
+                              stdout=subprocess.PIPE,
+                              stderr=subprocess.DEVNULL)
+    try:
+        # The server is listening once it says so.
+        line = b''
+        while not line.startswith(b'Serving'):
+            line = server.stdout.readline()
+            if not line:
+                sys.exit('lc3sim --serve did not start')
+        s = socket.socket(socket.AF_UNIX)
+        s.connect(path)
+        s.settimeout(10)
+        s.sendall(b'continue\nhello\n')
+        data = b''
+        while b'\036continue' not in data:
+            chunk = s.recv(4096)
+            if not chunk:
+                break
+            data += chunk
+    except socket.timeout:
+        sys.exit('no response, got %r' % data)
+    finally:
+        server.kill()
+        server.wait()
+
+if not data.startswith(b'hello\n') or b'\036continue halted' not in data:
+    sys.exit('unexpected response %r' % data)